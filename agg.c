@@ -0,0 +1,68 @@
+/* agg
+   Sums up durations in constant memory for the mp4len command.
+
+   Bucket i holds durations from gamma^(i - 1 - OFFSET) up to
+   gamma^(i - OFFSET), with gamma = (1 + a) / (1 - a) for accuracy a, and is
+   read back as the value within a of both ends.  Durations beyond the end
+   buckets are counted in them, and min and max are kept exactly.
+
+   Nicholas A. Masluk
+   nick@randombytes.net
+   Copyright 2023
+   Mozilla Public License Version 2.0
+*/
+
+#include <math.h>
+#include <string.h>
+
+#include "agg.h"
+
+#define GAMMA ((1 + AGG_ACCURACY) / (1 - AGG_ACCURACY))
+#define OFFSET (AGG_BUCKETS / 2) // bucket of a one second duration
+
+void agg_init(struct agg *a)
+{
+    memset(a, 0, sizeof(*a));
+}
+
+// Add a duration of len seconds.
+void agg_add(struct agg *a, double len)
+{
+    double idx = 0; // no length at all
+
+    if (len > 0) {
+        idx = ceil(log(len) / log(GAMMA)) + OFFSET;
+    }
+    idx = (idx < 0) ? 0 : (idx > AGG_BUCKETS - 1) ? AGG_BUCKETS - 1 : idx;
+    a->buckets[(int)idx] += 1;
+
+    if ((a->count == 0) || (len < a->min)) {
+        a->min = len;
+    }
+    if ((a->count == 0) || (len > a->max)) {
+        a->max = len;
+    }
+    a->count += 1;
+    a->sum += len;
+}
+
+// Return the q quantile (0 to 1) of the durations added, or 0 if none were.
+double agg_quantile(const struct agg *a, double q)
+{
+    unsigned long long rank, seen = 0;
+    double val;
+
+    if (a->count == 0) {
+        return 0;
+    }
+    rank = (unsigned long long)(q * (a->count - 1));
+    for (int ii = 0; ii < AGG_BUCKETS; ii++) {
+        seen += a->buckets[ii];
+        if (seen > rank) {
+            val = 2 * pow(GAMMA, ii - OFFSET) / (GAMMA + 1);
+            // the end buckets also hold everything beyond them
+            return (val < a->min) ? a->min : (val > a->max) ? a->max : val;
+        }
+    }
+    return a->max;
+}
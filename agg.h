@@ -0,0 +1,35 @@
+/* agg
+   Sums up durations in constant memory for the mp4len command.
+
+   Nicholas A. Masluk
+   nick@randombytes.net
+   Copyright 2023
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef AGG_H
+#define AGG_H
+
+#define AGG_ACCURACY 0.01 // relative error of quantiles
+#define AGG_BUCKETS 2048 // covering about 1e-9 to 1e9 seconds
+
+// Count, sum, extremes and a histogram of durations in buckets of
+// logarithmic width, from which quantiles are read to within AGG_ACCURACY
+// of the true value, however many durations are added.
+struct agg {
+    unsigned long long count;
+    double sum;
+    double min;
+    double max;
+    unsigned long long buckets[AGG_BUCKETS];
+};
+
+void agg_init(struct agg *a);
+
+// Add a duration of len seconds.
+void agg_add(struct agg *a, double len);
+
+// Return the q quantile (0 to 1) of the durations added, or 0 if none were.
+double agg_quantile(const struct agg *a, double q);
+
+#endif
@@ -0,0 +1,1260 @@
+/* batch
+   Probes many files on a pool of worker threads for the mp4len command.
+
+   Each submitted file takes one of window slots, and waits in a queue until
+   a worker takes it in submission order.  In input order, a finished slot
+   is held until every earlier one has been emitted, so a slow file holds up
+   output (and, once every slot is held, submission) behind it.  In
+   completion order, a finished slot is emitted and freed straight away.
+   Either way no more than window paths are held at once, however long the
+   input.  Jobs ready to emit are queued in order, and emitted with the lock
+   released by one thread at a time, so the output does not hold up the
+   workers.
+
+   Given device limits, each file is queued with the device (st_dev) it is
+   on, and a worker takes the oldest queued file on a device with fewer than
+   its limit of workers, so a slow disk cannot take every worker from a fast
+   one.  An automatic limit starts from the kind of device, then rises by
+   one while the mean time to probe a file stays near the lowest seen, and
+   falls by a quarter once it doubles.
+
+   Given a timeout or hedging, workers probe copies of their jobs and a
+   watchdog thread looks over them.  A job still running past its deadline
+   is emitted as timed out, and its worker, which may be stuck in a read
+   that never returns, is left behind and replaced, with up to three times
+   as many workers left behind at once.  Once every worker is stuck, queued
+   jobs time out as well.  A job running longer than most recent probes
+   took is hedged: an idle worker probes it again, and whichever copy
+   finishes first is emitted.
+
+   Nicholas A. Masluk
+   nick@randombytes.net
+   Copyright 2023
+   Mozilla Public License Version 2.0
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/vfs.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "sched.h"
+
+#define NO_SLOT ((size_t)-1)
+#define TUNE_FILES 8 // fewest files between changes of an automatic limit
+#define LAT_SAMPLES 256 // recent probe times a hedge threshold is taken from
+#define LAT_MIN 16 // fewest probe times needed before hedging
+#define WATCH_TICK 0.1 // longest time between looks by the watchdog
+#define HEDGE_TICK 0.005 // the same, while hedging
+#define FD_SPARE 64 // descriptors left for all but the files being probed
+
+// Slot states
+enum {
+    JOB_FREE,
+    JOB_QUEUED, // waiting for a worker
+    JOB_RUNNING, // being probed
+    JOB_DONE // waiting to be emitted
+};
+
+// Files queued and probed on one device
+struct batch_dev {
+    dev_t dev;
+    int limit; // most workers at once, 0 for no limit
+    int tuned; // limit is tuned from latency
+    int limit_max; // highest limit reached
+    int running; // workers probing files here
+    size_t q_first; // slot index of the oldest queued file
+    size_t q_last; // slot index of the newest queued file
+    size_t q_len;
+    unsigned long long files; // files probed
+    double lat_total; // seconds probing them
+    double lat_sum; // seconds probing files since the limit last changed
+    int lat_n; // and the number of them
+    double lat_base; // lowest mean seen, slowly forgotten
+};
+
+// A worker thread, and the jobs it is probing.
+struct batch_worker {
+    struct batch *b;
+    pthread_t thread;
+    int busy; // probing ids
+    int hedge; // probing a hedge of ids[0]
+    int hedged; // ids[0] was queued to be hedged
+    int abandoned; // timed out and replaced, exits once its probe returns
+    int gone; // abandoned and exited, the record is free for a replacement
+    int dev; // device index of ids, unless a hedge
+    double start; // time it took them
+    size_t ids[SCHED_MAX_FILES];
+    unsigned long long seqs[SCHED_MAX_FILES]; // to tell if a slot is reused
+    int n_ids;
+};
+
+struct batch {
+    pthread_mutex_t lock;
+    pthread_cond_t work; // a job was queued, or the batch is finishing
+    pthread_cond_t space; // a slot was freed
+    struct batch_job *slots;
+    size_t window;
+    size_t *free_ids; // stack of free slot indexes
+    size_t n_free;
+    size_t *q_next; // next queued slot index on the same device, by slot
+    size_t q_len; // slots queued on every device
+    struct batch_dev *devs;
+    int n_devs;
+    int devs_cap;
+    int by_dev; // queue by device, else everything is device 0
+    struct batch_dev_limit *dev_limits;
+    size_t n_dev_limits;
+    int dev_default;
+    size_t *order; // slot index of each seq not yet emitted, by seq % window
+    int in_order; // emit in input order
+    int group; // most jobs a worker takes at once
+    unsigned long long head; // next seq to emit in input order
+    unsigned long long tail; // next seq to submit
+    int finishing;
+    struct batch_stats stats;
+    double start; // time the batch started
+    double last_change; // time the number of held jobs last changed
+    batch_emit_fn emit;
+    void *emit_arg;
+    size_t *emit_ids; // slot indexes ready to emit, a ring
+    size_t emit_first;
+    size_t n_emit;
+    int emitting; // a thread is emitting them
+    mp4len_cache *cache;
+    int keys; // fill in each job's key
+    int recheck; // probe cache hits again
+    mp4len_pool *pool;
+    int n_threads; // workers wanted at once
+    struct batch_worker *workers; // started so far
+    int n_workers;
+    int workers_cap; // records for workers, those left behind included
+    int n_live; // workers not left behind
+    double stuck_since; // time n_live fell to 0
+    int n_abandoned; // workers left behind and still running
+    int orphaned; // finished, last abandoned worker frees the batch
+    double timeout; // seconds a probe may take, 0 for no limit
+    double hedge; // quantile of probe times to hedge past, 0 for none
+    int watched; // timeout or hedge, so the watchdog is running
+    int watch_stop;
+    pthread_cond_t tick; // wakes the watchdog to stop
+    pthread_t watchdog;
+    double lat[LAT_SAMPLES]; // recent probe times, a ring
+    int n_lat;
+    size_t *hedge_ids; // slots queued to be hedged
+    unsigned long long *hedge_seqs;
+    size_t n_hedges;
+    double fault_delay; // seconds to hold up reads, for testing
+    double fault_rate; // share of reads held up
+    mp4len_read_fn read; // reads for probes, or NULL for pread()
+};
+
+// File system types where probes spend most of their time waiting on the
+// network, see statfs(2).
+static const unsigned long net_fs[] = {
+    0x6969, // NFS
+    0x517B, // SMB
+    0xFF534D42, // CIFS
+    0xFE534D42, // SMB2
+    0x65735546, // FUSE, for object store mounts
+    0x00C36400, // Ceph
+    0x01021997, // 9P
+    0x5346414F, // AFS
+    0x0BD00BD0 // Lustre
+};
+
+// Return 1 if the block device holding st is a spinning disk.
+static int is_rotational(const struct stat *st)
+{
+    char path[128];
+    FILE *fptr;
+    int rot = 0;
+
+    // partitions keep their queue settings with the whole disk
+    const char *fmt[] = {"/sys/dev/block/%u:%u/queue/rotational",
+                         "/sys/dev/block/%u:%u/../queue/rotational"};
+    for (int ii = 0; ii < 2; ii++) {
+        snprintf(path, sizeof(path), fmt[ii], major(st->st_dev),
+                 minor(st->st_dev));
+        fptr = fopen(path, "r");
+        if (fptr) {
+            if (fscanf(fptr, "%d", &rot) != 1) {
+                rot = 0;
+            }
+            fclose(fptr);
+            return rot == 1;
+        }
+    }
+    return 0;
+}
+
+// Number of workers to use by default for files like path.
+int batch_default_jobs(const char *path)
+{
+    struct statfs sfs;
+    struct stat st;
+    long cpus;
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        cpus = 1;
+    }
+
+    if (statfs(path, &sfs) == 0) {
+        for (size_t ii = 0; ii < sizeof(net_fs) / sizeof(net_fs[0]); ii++) {
+            if ((unsigned long)sfs.f_type == net_fs[ii]) {
+                // latency bound, keep plenty of requests in flight
+                cpus *= 4;
+                return (cpus < 8) ? 8 : (cpus > 64) ? 64 : cpus;
+            }
+        }
+    }
+    if ((stat(path, &st) == 0) && is_rotational(&st)) {
+        // more than a couple of readers just makes the heads seek
+        return 2;
+    }
+    return (cpus > 16) ? 16 : cpus;
+}
+
+// Return the most files each of n_workers workers may hold open at once
+// within the limit on open files, from 1 to SCHED_MAX_FILES.
+static int fd_group_max(int n_workers)
+{
+    struct rlimit rl;
+    rlim_t n;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) || (rl.rlim_cur == RLIM_INFINITY)) {
+        return SCHED_MAX_FILES;
+    }
+    if (rl.rlim_cur < FD_SPARE + (rlim_t)n_workers) {
+        return 1;
+    }
+    n = (rl.rlim_cur - FD_SPARE) / n_workers;
+    return (n > SCHED_MAX_FILES) ? SCHED_MAX_FILES : (int)n;
+}
+
+// Seconds on a monotonic clock.
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Change the number of finished jobs held for input order by delta, keeping
+// the occupancy statistics.  Called with the lock held.
+static void held_change(struct batch *b, int delta)
+{
+    struct batch_stats *st = &b->stats;
+    double t = now();
+
+    st->held_time += st->held * (t - b->last_change);
+    b->last_change = t;
+    st->held += delta;
+    if (st->held > st->held_max) {
+        st->held_max = st->held;
+    }
+}
+
+// Queue a finished job to be emitted by emit_ready().  Called with the lock
+// held.
+static void emit_job(struct batch *b, size_t id)
+{
+    b->emit_ids[(b->emit_first + b->n_emit) % b->window] = id;
+    b->n_emit += 1;
+    b->stats.files += 1;
+    if (b->slots[id].ret) {
+        b->stats.failed += 1;
+    }
+}
+
+// Emit the queued jobs and free their slots, unless another thread is
+// already emitting and will emit these too.  A job is left alone while it
+// waits, so it is read without the lock.  Called with the lock held, which
+// is released while emitting.
+static void emit_ready(struct batch *b)
+{
+    struct batch_job *job;
+    size_t id;
+
+    if (b->emitting) {
+        return;
+    }
+    b->emitting = 1;
+    while (b->n_emit > 0) {
+        id = b->emit_ids[b->emit_first];
+        b->emit_first = (b->emit_first + 1) % b->window;
+        b->n_emit -= 1;
+        job = &b->slots[id];
+        pthread_mutex_unlock(&b->lock);
+        b->emit(b->emit_arg, job);
+        pthread_mutex_lock(&b->lock);
+        free(job->path);
+        job->path = NULL;
+        job->state = JOB_FREE;
+        b->free_ids[b->n_free++] = id;
+        if (b->finishing) {
+            // batch_finish() waits for the last
+            pthread_cond_broadcast(&b->space);
+        }
+        else {
+            pthread_cond_signal(&b->space);
+        }
+    }
+    b->emitting = 0;
+}
+
+// A job has finished, queue whatever it allows to be emitted.  Called with
+// the lock held.
+static void job_done(struct batch *b, size_t id)
+{
+    b->slots[id].state = JOB_DONE;
+    if (!b->in_order) {
+        emit_job(b, id);
+        return;
+    }
+
+    if (b->slots[id].seq != b->head) {
+        // held up behind an earlier file
+        b->stats.held_jobs += 1;
+        held_change(b, 1);
+        return;
+    }
+    emit_job(b, id);
+    b->head += 1;
+    while (b->head < b->tail) {
+        id = b->order[b->head % b->window];
+        if (b->slots[id].state != JOB_DONE) {
+            break;
+        }
+        held_change(b, -1);
+        emit_job(b, id);
+        b->head += 1;
+    }
+}
+
+// Probe one job on its own, at the header in job->res.hdr_off first if
+// set.
+static void probe_one(struct batch *b, struct batch_job *job)
+{
+    mp4len_ctx *ctx;
+    int pooled = 1;
+
+    ctx = mp4len_pool_get(b->pool);
+    if (ctx == NULL) {
+        // workers left behind, or gone with one set aside, hold the rest
+        ctx = mp4len_ctx_new();
+        pooled = 0;
+    }
+    if (ctx == NULL) {
+        job->ret = MP4LEN_ERR_NOMEM;
+        return;
+    }
+    mp4len_ctx_set_read(ctx, b->read, b);
+    job->ret = mp4len_probe_path_hint(ctx, job->path, job->res.hdr_off,
+                                      &job->res);
+    if (pooled) {
+        mp4len_pool_put(b->pool, ctx);
+    }
+    else {
+        mp4len_ctx_free(ctx);
+    }
+}
+
+// Probe a group of jobs together in disk order, each reading into the
+// buffer of a context of its own.
+static void probe_group(struct batch *b, struct batch_job **jobs, int n_jobs,
+                        struct sched_stats *sst)
+{
+    mp4len_ctx *ctxs[SCHED_MAX_FILES];
+    int pooled[SCHED_MAX_FILES];
+    int n_ctxs;
+
+    for (n_ctxs = 0; n_ctxs < n_jobs; n_ctxs++) {
+        ctxs[n_ctxs] = mp4len_pool_get(b->pool);
+        pooled[n_ctxs] = (ctxs[n_ctxs] != NULL);
+        if (ctxs[n_ctxs] == NULL) {
+            // workers left behind, or gone with some set aside, hold the rest
+            ctxs[n_ctxs] = mp4len_ctx_new();
+        }
+        if (ctxs[n_ctxs] == NULL) {
+            break;
+        }
+    }
+    if (n_ctxs == n_jobs) {
+        sched_probe(jobs, ctxs, n_jobs, sst, b->read, b);
+    }
+    else {
+        for (int ii = 0; ii < n_jobs; ii++) {
+            memset(&jobs[ii]->res, 0, sizeof(jobs[ii]->res));
+            jobs[ii]->ret = MP4LEN_ERR_NOMEM;
+        }
+    }
+    for (int ii = 0; ii < n_ctxs; ii++) {
+        if (pooled[ii]) {
+            mp4len_pool_put(b->pool, ctxs[ii]);
+        }
+        else {
+            mp4len_ctx_free(ctxs[ii]);
+        }
+    }
+}
+
+// Read like pread(), but first sleep for b->fault_delay on a random
+// b->fault_rate share of reads, as storage with a slow tail would.
+static long long fault_read(void *arg, int fd, void *buf, size_t len,
+                            long long off)
+{
+    static _Thread_local unsigned long long rng;
+    struct batch *b = (struct batch*)arg;
+    struct timespec ts;
+    double r;
+
+    if (rng == 0) {
+        rng = (unsigned long long)(uintptr_t)&rng ^ (unsigned long long)now();
+    }
+    // xorshift64*, seeded per thread
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    r = (double)((rng * 0x2545F4914F6CDD1DULL) >> 11) / (1ULL << 53);
+    if (r < b->fault_rate) {
+        ts.tv_sec = (time_t)b->fault_delay;
+        ts.tv_nsec = (long)((b->fault_delay - ts.tv_sec) * 1e9);
+        while (nanosleep(&ts, &ts) && (errno == EINTR)) {
+        }
+    }
+    return pread(fd, buf, len, (off_t)off);
+}
+
+// Return the index of the device with the oldest queued file among those
+// below their limit, or -1 if there is none.  Called with the lock held.
+static int pick_dev(struct batch *b)
+{
+    struct batch_dev *d;
+    int pick = -1;
+
+    for (int ii = 0; ii < b->n_devs; ii++) {
+        d = &b->devs[ii];
+        if ((d->q_len == 0) || (d->limit && (d->running >= d->limit))) {
+            continue;
+        }
+        if ((pick < 0) || (b->slots[d->q_first].seq
+                           < b->slots[b->devs[pick].q_first].seq)) {
+            pick = ii;
+        }
+    }
+    return pick;
+}
+
+// Count n_files probed on a device in secs seconds, tuning its limit if
+// automatic.  Called with the lock held.
+static void dev_probed(struct batch *b, struct batch_dev *d, int n_files,
+                       double secs)
+{
+    double mean;
+
+    d->files += n_files;
+    d->lat_total += secs;
+    if (!d->tuned) {
+        return;
+    }
+    d->lat_sum += secs;
+    d->lat_n += n_files;
+    if ((d->lat_n < TUNE_FILES) || (d->lat_n < 2 * d->limit)) {
+        return;
+    }
+
+    // the lowest mean creeps up, so a lucky start is not held against
+    // every later period
+    mean = d->lat_sum / d->lat_n;
+    d->lat_base *= 1.1;
+    if ((d->lat_base == 0) || (mean < d->lat_base)) {
+        d->lat_base = mean;
+    }
+    if ((mean < 1.5 * d->lat_base) && (d->limit < b->n_threads)) {
+        d->limit += 1;
+    }
+    else if ((mean > 2 * d->lat_base) && (d->limit > 1)) {
+        d->limit -= (d->limit < 4) ? 1 : d->limit / 4;
+    }
+    if (d->limit > d->limit_max) {
+        d->limit_max = d->limit;
+    }
+    d->lat_sum = 0;
+    d->lat_n = 0;
+}
+
+// Probe a group of jobs, looking each up in the cache first if there is
+// one, and storing the results and lasting errors of those probed.  A file
+// the cache knew, as it is (with recheck) or before it changed, is probed
+// on its own at the header remembered, in two small reads if it is still
+// there.  Adds the reads and seeks of the group to *sst, the files probed
+// at a remembered header to *hinted, and the hits on a cached error to
+// *negative.
+// Return the number of cache hits.
+static int probe_jobs(struct batch *b, struct batch_job **jobs, int n_jobs,
+                      struct sched_stats *sst, int *hinted, int *negative)
+{
+    struct batch_job *misses[SCHED_MAX_FILES], *unknown[SCHED_MAX_FILES];
+    int n_misses = 0, n_unknown = 0, hits = 0;
+
+    for (int ii = 0; ii < n_jobs; ii++) {
+        jobs[ii]->keyed = ((b->cache != NULL) || b->keys)
+            && (mp4len_key_path(jobs[ii]->path, &jobs[ii]->key) == 0);
+        if (jobs[ii]->keyed && (b->cache != NULL)) {
+            jobs[ii]->ret = mp4len_cache_lookup(b->cache, &jobs[ii]->key,
+                                                &jobs[ii]->res);
+        }
+        else {
+            jobs[ii]->ret = MP4LEN_AGAIN;
+        }
+        if (jobs[ii]->ret != MP4LEN_AGAIN) {
+            hits += 1;
+            *negative += (jobs[ii]->ret != MP4LEN_OK);
+            if (!b->recheck) {
+                continue;
+            }
+        }
+        misses[n_misses++] = jobs[ii];
+        if (jobs[ii]->res.hdr_off > 0) {
+            probe_one(b, jobs[ii]);
+            *hinted += 1;
+        }
+        else {
+            unknown[n_unknown++] = jobs[ii];
+        }
+    }
+
+    if (n_unknown > 1) {
+        probe_group(b, unknown, n_unknown, sst);
+    }
+    else if (n_unknown == 1) {
+        probe_one(b, unknown[0]);
+    }
+    for (int ii = 0; (b->cache != NULL) && (ii < n_misses); ii++) {
+        if (!misses[ii]->keyed) {
+            continue;
+        }
+        if (misses[ii]->ret == MP4LEN_OK) {
+            mp4len_cache_put(b->cache, &misses[ii]->key, &misses[ii]->res);
+        }
+        else {
+            mp4len_cache_put_error(b->cache, &misses[ii]->key,
+                                   misses[ii]->ret);
+        }
+    }
+    return hits;
+}
+
+// Copy the job in slot id into *job for a worker to probe, along with its
+// path if the watchdog may emit the slot first.  Called with the lock held.
+static int copy_job(struct batch *b, size_t id, struct batch_job *job)
+{
+    *job = b->slots[id];
+    if (b->watched) {
+        job->path = strdup(job->path);
+        if (job->path == NULL) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Finish the job in slot id with what a worker found probing its copy, if
+// the slot still holds the same job and nothing else finished it first.
+// Return 1 if it did.  Called with the lock held.
+static int finish_job(struct batch *b, size_t id, unsigned long long seq,
+                      struct batch_job *job)
+{
+    struct batch_job *slot = &b->slots[id];
+    int taken = 0;
+
+    if ((slot->state == JOB_RUNNING) && (slot->seq == seq)) {
+        slot->ret = job->ret;
+        slot->res = job->res;
+        slot->keyed = job->keyed;
+        slot->key = job->key;
+        job_done(b, id);
+        taken = 1;
+    }
+    if (b->watched) {
+        free(job->path);
+    }
+    return taken;
+}
+
+// Remember how long a file took to probe, for hedging.  Called with the
+// lock held.
+static void lat_add(struct batch *b, double secs)
+{
+    b->lat[b->n_lat % LAT_SAMPLES] = secs;
+    b->n_lat += 1;
+    // no overflow, just the same place in the ring
+    if (b->n_lat == 2 * LAT_SAMPLES) {
+        b->n_lat = LAT_SAMPLES;
+    }
+}
+
+// qsort comparison of doubles.
+static int double_cmp(const void *a, const void *b)
+{
+    double da = *(const double*)a, db = *(const double*)b;
+
+    return (da > db) - (da < db);
+}
+
+// Return the b->hedge quantile of recent probe times, or 0 if too few
+// files have been probed yet.  Called with the lock held.
+static double lat_quantile(struct batch *b)
+{
+    double lat[LAT_SAMPLES];
+    int n = (b->n_lat < LAT_SAMPLES) ? b->n_lat : LAT_SAMPLES;
+
+    if (n < LAT_MIN) {
+        return 0;
+    }
+    memcpy(lat, b->lat, n * sizeof(double));
+    qsort(lat, n, sizeof(double), double_cmp);
+    return lat[(int)(b->hedge * (n - 1))];
+}
+
+// Probe a queued hedge in an idle worker, unless what it hedges already
+// finished, and emit the job if this copy finishes first.  Called with the
+// lock held, which is released while probing.
+static void run_hedge(struct batch *b, struct batch_worker *w)
+{
+    struct batch_job job, *jobp = &job;
+    struct sched_stats sst;
+    size_t id;
+    unsigned long long seq;
+    int hinted = 0, negative = 0;
+
+    b->n_hedges -= 1;
+    id = b->hedge_ids[b->n_hedges];
+    seq = b->hedge_seqs[b->n_hedges];
+    if ((b->slots[id].state != JOB_RUNNING) || (b->slots[id].seq != seq)
+        || copy_job(b, id, &job)) {
+        return;
+    }
+    w->busy = 1;
+    w->hedge = 1;
+    w->ids[0] = id;
+    w->seqs[0] = seq;
+    w->n_ids = 1;
+    w->start = now();
+    pthread_mutex_unlock(&b->lock);
+
+    memset(&sst, 0, sizeof(sst));
+    probe_jobs(b, &jobp, 1, &sst, &hinted, &negative);
+
+    pthread_mutex_lock(&b->lock);
+    w->busy = 0;
+    w->hedge = 0;
+    if (w->abandoned) {
+        free(job.path);
+        return;
+    }
+    if (finish_job(b, id, seq, &job)) {
+        b->stats.hedge_wins += 1;
+    }
+}
+
+static void *worker(void *arg);
+
+// Emit every queued job as timed out.  Called with the lock held.
+static void drain_queue(struct batch *b)
+{
+    struct batch_dev *d;
+    size_t id;
+
+    for (int ii = 0; ii < b->n_devs; ii++) {
+        d = &b->devs[ii];
+        while (d->q_len > 0) {
+            id = d->q_first;
+            d->q_first = b->q_next[id];
+            d->q_len -= 1;
+            b->q_len -= 1;
+            b->slots[id].ret = MP4LEN_ERR_TIMEOUT;
+            b->stats.timeouts += 1;
+            job_done(b, id);
+        }
+    }
+}
+
+// Start a worker in place of one left behind, in the record of one that
+// has since exited or a new one while there is room.  Called with the lock
+// held.
+// Return 0 if successful, or -1 if there is no room or thread.
+static int replace_worker(struct batch *b)
+{
+    struct batch_worker *w = NULL;
+
+    for (int ii = 0; (ii < b->n_workers) && (w == NULL); ii++) {
+        if (b->workers[ii].gone) {
+            w = &b->workers[ii];
+        }
+    }
+    if ((w == NULL) && (b->n_workers < b->workers_cap)) {
+        w = &b->workers[b->n_workers];
+    }
+    if (w == NULL) {
+        return -1;
+    }
+    memset(w, 0, sizeof(*w));
+    w->b = b;
+    if (pthread_create(&w->thread, NULL, worker, w)) {
+        w->gone = 1;
+        return -1;
+    }
+    b->n_workers += (w == &b->workers[b->n_workers]);
+    b->n_live += 1;
+    b->stats.replaced += 1;
+    return 0;
+}
+
+// Give up on a worker past its deadline: emit each of its jobs not yet
+// finished as timed out, and leave the worker to finish its probe and exit
+// whenever it can.  Called with the lock held.
+static void abandon(struct batch *b, struct batch_worker *w)
+{
+    struct batch_job *slot;
+
+    w->abandoned = 1;
+    b->n_live -= 1;
+    if (b->n_live == 0) {
+        b->stuck_since = now();
+    }
+    b->n_abandoned += 1;
+    pthread_detach(w->thread);
+    if (!w->hedge) {
+        // its device is free for others
+        b->devs[w->dev].running -= 1;
+    }
+    for (int ii = 0; ii < w->n_ids; ii++) {
+        slot = &b->slots[w->ids[ii]];
+        if ((slot->state == JOB_RUNNING) && (slot->seq == w->seqs[ii])) {
+            memset(&slot->res, 0, sizeof(slot->res));
+            slot->ret = MP4LEN_ERR_TIMEOUT;
+            b->stats.timeouts += 1;
+            job_done(b, w->ids[ii]);
+        }
+    }
+    pthread_cond_broadcast(&b->work);
+}
+
+// Watchdog thread, looks over the busy workers every tick until stopped,
+// abandoning those past their deadline and queueing hedges for single
+// files running longer than the hedge quantile.
+static void *watchdog(void *arg)
+{
+    struct batch *b = (struct batch*)arg;
+    double tick = (b->hedge > 0) ? HEDGE_TICK : WATCH_TICK;
+    double t, hedge_after;
+    struct batch_worker *w;
+    struct timespec ts;
+
+    if ((b->timeout > 0) && (b->timeout / 4 < tick)) {
+        tick = b->timeout / 4;
+    }
+    pthread_mutex_lock(&b->lock);
+    while (!b->watch_stop) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += (time_t)tick;
+        ts.tv_nsec += (long)((tick - (time_t)tick) * 1e9);
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec += 1;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&b->tick, &b->lock, &ts);
+
+        t = now();
+        hedge_after = (b->hedge > 0) ? lat_quantile(b) : 0;
+        for (int ii = 0; ii < b->n_workers; ii++) {
+            w = &b->workers[ii];
+            if (!w->busy || w->abandoned) {
+                continue;
+            }
+            if ((b->timeout > 0) && (t - w->start > b->timeout * w->n_ids)) {
+                abandon(b, w);
+            }
+            else if ((hedge_after > 0) && !w->hedge && !w->hedged
+                     && (w->n_ids == 1) && (t - w->start > hedge_after)
+                     && (b->n_hedges < b->window)) {
+                w->hedged = 1;
+                b->hedge_ids[b->n_hedges] = w->ids[0];
+                b->hedge_seqs[b->n_hedges] = w->seqs[0];
+                b->n_hedges += 1;
+                b->stats.hedges += 1;
+                pthread_cond_signal(&b->work);
+            }
+        }
+
+        while ((b->n_live < b->n_threads) && (replace_worker(b) == 0)) {
+        }
+        if ((b->n_live == 0) && (b->timeout > 0)
+            && (now() - b->stuck_since > b->timeout)) {
+            // every worker is stuck and none can be added, so nothing
+            // queued would be probed in time
+            drain_queue(b);
+        }
+        emit_ready(b);
+    }
+    pthread_mutex_unlock(&b->lock);
+    return NULL;
+}
+
+static void batch_free(struct batch *b);
+
+// Worker thread, probes queued jobs, and hedges, until the batch is
+// finishing and nothing is left.  Each time round it takes up to b->group
+// jobs, all on the same device.
+static void *worker(void *arg)
+{
+    struct batch_worker *w = (struct batch_worker*)arg;
+    struct batch *b = w->b;
+    struct batch_job copies[SCHED_MAX_FILES], *jobs[SCHED_MAX_FILES];
+    struct sched_stats sst;
+    struct batch_dev *d;
+    double start, secs;
+    int n_ids, dev, hits, hinted, negative, orphan;
+
+    pthread_mutex_lock(&b->lock);
+    for (;;) {
+        // whatever this worker finished last time round
+        emit_ready(b);
+        dev = pick_dev(b);
+        while ((dev < 0) && (b->n_hedges == 0)
+               && ((b->q_len > 0) || !b->finishing)) {
+            pthread_cond_wait(&b->work, &b->lock);
+            dev = pick_dev(b);
+        }
+        if (b->n_hedges > 0) {
+            run_hedge(b, w);
+            if (w->abandoned) {
+                break;
+            }
+            continue;
+        }
+        if (dev < 0) {
+            break;
+        }
+        d = &b->devs[dev];
+        for (n_ids = 0; (n_ids < b->group) && (d->q_len > 0); n_ids++) {
+            w->ids[n_ids] = d->q_first;
+            w->seqs[n_ids] = b->slots[d->q_first].seq;
+            d->q_first = b->q_next[d->q_first];
+            d->q_len -= 1;
+            b->q_len -= 1;
+            b->slots[w->ids[n_ids]].state = JOB_RUNNING;
+            if (copy_job(b, w->ids[n_ids], &copies[n_ids])) {
+                b->slots[w->ids[n_ids]].ret = MP4LEN_ERR_NOMEM;
+                job_done(b, w->ids[n_ids]);
+                n_ids -= 1;
+                continue;
+            }
+            jobs[n_ids] = &copies[n_ids];
+        }
+        if (n_ids == 0) {
+            continue;
+        }
+        d->running += 1;
+        w->busy = 1;
+        w->hedged = 0;
+        w->dev = dev;
+        w->n_ids = n_ids;
+        w->start = now();
+        start = w->start;
+        pthread_mutex_unlock(&b->lock);
+
+        memset(&sst, 0, sizeof(sst));
+        hinted = 0;
+        negative = 0;
+        hits = probe_jobs(b, jobs, n_ids, &sst, &hinted, &negative);
+
+        pthread_mutex_lock(&b->lock);
+        w->busy = 0;
+        if (w->abandoned) {
+            for (int ii = 0; b->watched && (ii < n_ids); ii++) {
+                free(copies[ii].path);
+            }
+            break;
+        }
+        // the table may have moved while unlocked
+        d = &b->devs[dev];
+        d->running -= 1;
+        secs = now() - start;
+        dev_probed(b, d, n_ids, secs);
+        lat_add(b, secs / n_ids);
+        if (b->by_dev && (b->q_len > 0)) {
+            // files waiting on this device, or any other if its limit rose
+            pthread_cond_broadcast(&b->work);
+        }
+        b->stats.sched_reads += sst.reads;
+        b->stats.seek += sst.seek;
+        b->stats.seek_file_order += sst.seek_file_order;
+        if (b->cache != NULL) {
+            for (int ii = 0; ii < n_ids; ii++) {
+                // a file that could not be keyed was never looked up
+                b->stats.cache_lookups += copies[ii].keyed;
+            }
+            b->stats.cache_hits += hits;
+            b->stats.hinted += hinted;
+            b->stats.cache_negative += negative;
+        }
+        for (int ii = 0; ii < n_ids; ii++) {
+            finish_job(b, w->ids[ii], w->seqs[ii], &copies[ii]);
+        }
+    }
+
+    orphan = 0;
+    if (w->abandoned) {
+        b->n_abandoned -= 1;
+        w->gone = 1;
+        orphan = b->orphaned && (b->n_abandoned == 0);
+    }
+    pthread_mutex_unlock(&b->lock);
+    if (orphan) {
+        // the batch finished without this worker
+        batch_free(b);
+    }
+    return NULL;
+}
+
+// Free everything held by the batch.
+static void batch_free(struct batch *b)
+{
+    mp4len_pool_free(b->pool);
+    pthread_cond_destroy(&b->tick);
+    pthread_cond_destroy(&b->space);
+    pthread_cond_destroy(&b->work);
+    pthread_mutex_destroy(&b->lock);
+    free(b->hedge_seqs);
+    free(b->hedge_ids);
+    free(b->workers);
+    free(b->dev_limits);
+    free(b->devs);
+    free(b->emit_ids);
+    free(b->order);
+    free(b->q_next);
+    free(b->free_ids);
+    free(b->slots);
+    free(b);
+}
+
+// Return the index of the device dev in the table, adding it with its limit
+// if new, or -1 if out of memory.  path is a file on it, used to pick where
+// an automatic limit starts.  Called with the lock held, or before the
+// workers start.
+static int dev_find(struct batch *b, dev_t dev, const char *path)
+{
+    struct batch_dev *devs, *d;
+    int limit = b->dev_default;
+
+    for (int ii = 0; ii < b->n_devs; ii++) {
+        if (b->devs[ii].dev == dev) {
+            return ii;
+        }
+    }
+    if (b->n_devs == b->devs_cap) {
+        b->devs_cap = b->devs_cap ? 2 * b->devs_cap : 4;
+        devs = (struct batch_dev*)realloc(b->devs, b->devs_cap
+                                          * sizeof(struct batch_dev));
+        if (devs == NULL) {
+            return -1;
+        }
+        b->devs = devs;
+    }
+    for (size_t ii = 0; ii < b->n_dev_limits; ii++) {
+        if (b->dev_limits[ii].dev == dev) {
+            limit = b->dev_limits[ii].limit;
+        }
+    }
+
+    d = &b->devs[b->n_devs];
+    memset(d, 0, sizeof(*d));
+    d->dev = dev;
+    d->q_first = NO_SLOT;
+    d->q_last = NO_SLOT;
+    if (limit == BATCH_DEV_AUTO) {
+        d->tuned = 1;
+        limit = (path != NULL) ? batch_default_jobs(path) : 1;
+        limit = (limit > b->n_threads) ? b->n_threads : limit;
+    }
+    d->limit = limit;
+    d->limit_max = limit;
+    return b->n_devs++;
+}
+
+// Start the workers.  Return NULL if out of memory or threads.
+struct batch *batch_start(const struct batch_opts *opts)
+{
+    struct batch *b;
+
+    b = (struct batch*)calloc(1, sizeof(struct batch));
+    if (b == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->work, NULL);
+    pthread_cond_init(&b->space, NULL);
+    pthread_cond_init(&b->tick, NULL);
+    b->emit = opts->emit;
+    b->emit_arg = opts->emit_arg;
+    b->cache = opts->cache;
+    b->keys = opts->keys;
+    b->recheck = opts->recheck;
+    b->timeout = opts->timeout;
+    b->hedge = opts->hedge;
+    b->watched = (b->timeout > 0) || (b->hedge > 0);
+    b->fault_delay = opts->fault_delay;
+    b->fault_rate = opts->fault_rate;
+    if (b->fault_delay > 0) {
+        b->read = fault_read;
+    }
+    b->in_order = (opts->order == BATCH_ORDER_INPUT);
+    b->n_threads = (opts->jobs < 1) ? 1 : opts->jobs;
+    b->window = opts->window;
+    b->by_dev = (opts->n_dev_limits > 0) || opts->dev_default;
+    b->dev_default = opts->dev_default;
+    // three times as many again may be left behind at once
+    b->workers_cap = b->watched ? 4 * b->n_threads : b->n_threads;
+    b->group = 1;
+    if (opts->schedule == BATCH_SCHED_PHYSICAL) {
+        // the larger the groups, the shorter the sweeps, but every file of
+        // a group is open at once, in every worker
+        if (b->window == 0) {
+            b->window = (size_t)SCHED_MAX_FILES * b->n_threads;
+        }
+        b->group = (int)(b->window / b->n_threads);
+        b->group = (b->group < 1) ? 1
+                 : (b->group > SCHED_MAX_FILES) ? SCHED_MAX_FILES : b->group;
+        if (b->group > fd_group_max(b->workers_cap)) {
+            b->group = fd_group_max(b->workers_cap);
+        }
+    }
+    if (b->window == 0) {
+        b->window = (b->n_threads < 4) ? 16 : 4 * b->n_threads;
+    }
+    b->start = now();
+    b->last_change = b->start;
+
+    b->slots = (struct batch_job*)calloc(b->window, sizeof(struct batch_job));
+    b->free_ids = (size_t*)calloc(b->window, sizeof(size_t));
+    b->q_next = (size_t*)calloc(b->window, sizeof(size_t));
+    b->order = (size_t*)calloc(b->window, sizeof(size_t));
+    b->emit_ids = (size_t*)calloc(b->window, sizeof(size_t));
+    b->workers = (struct batch_worker*)calloc(b->workers_cap,
+                                              sizeof(struct batch_worker));
+    if (b->hedge > 0) {
+        b->hedge_ids = (size_t*)calloc(b->window, sizeof(size_t));
+        b->hedge_seqs = (unsigned long long*)calloc(
+            b->window, sizeof(unsigned long long));
+    }
+    // each worker holds at most one context per file of its group,
+    // checked out or set aside
+    b->pool = mp4len_pool_new(b->workers_cap * b->group);
+    if (opts->n_dev_limits > 0) {
+        b->dev_limits = (struct batch_dev_limit*)malloc(
+            opts->n_dev_limits * sizeof(struct batch_dev_limit));
+        if (b->dev_limits != NULL) {
+            memcpy(b->dev_limits, opts->dev_limits,
+                   opts->n_dev_limits * sizeof(struct batch_dev_limit));
+            b->n_dev_limits = opts->n_dev_limits;
+        }
+    }
+    if ((b->slots == NULL) || (b->free_ids == NULL) || (b->q_next == NULL)
+        || (b->order == NULL) || (b->emit_ids == NULL) || (b->workers == NULL)
+        || (b->pool == NULL)
+        || ((b->hedge > 0)
+            && ((b->hedge_ids == NULL) || (b->hedge_seqs == NULL)))
+        || ((opts->n_dev_limits > 0) && (b->dev_limits == NULL))
+        || (!b->by_dev && (dev_find(b, 0, NULL) < 0))) {
+        batch_free(b);
+        return NULL;
+    }
+    for (size_t ii = 0; ii < b->window; ii++) {
+        b->free_ids[ii] = b->window - 1 - ii;
+    }
+    b->n_free = b->window;
+
+    if (b->watched && pthread_create(&b->watchdog, NULL, watchdog, b)) {
+        // probes run unwatched
+        b->watched = 0;
+    }
+    pthread_mutex_lock(&b->lock);
+    for (int ii = 0; ii < b->n_threads; ii++) {
+        b->workers[ii].b = b;
+        if (pthread_create(&b->workers[ii].thread, NULL, worker,
+                           &b->workers[ii])) {
+            // carry on with the workers we have, if any
+            break;
+        }
+        b->n_workers += 1;
+        b->n_live += 1;
+    }
+    b->n_threads = b->n_workers;
+    if (b->n_workers == 0) {
+        b->watch_stop = 1;
+        pthread_cond_signal(&b->tick);
+        pthread_mutex_unlock(&b->lock);
+        if (b->watched) {
+            pthread_join(b->watchdog, NULL);
+        }
+        batch_free(b);
+        return NULL;
+    }
+    pthread_mutex_unlock(&b->lock);
+    return b;
+}
+
+// Queue a file to probe, waiting while the window is full.  arg is passed
+// back with the job.
+// Return 0 if successful, or MP4LEN_ERR_NOMEM.
+int batch_submit(struct batch *b, const char *path, void *arg)
+{
+    struct batch_job *job;
+    struct batch_dev *d;
+    struct stat st;
+    dev_t dev = 0;
+    double stall = 0;
+    char *copy;
+    size_t id;
+    int dev_id = 0;
+
+    copy = strdup(path);
+    if (copy == NULL) {
+        return MP4LEN_ERR_NOMEM;
+    }
+    // a file that cannot be found goes on device 0 and fails when probed
+    if (b->by_dev && (stat(path, &st) == 0)) {
+        dev = st.st_dev;
+    }
+
+    pthread_mutex_lock(&b->lock);
+    if (b->by_dev) {
+        dev_id = dev_find(b, dev, path);
+        if (dev_id < 0) {
+            pthread_mutex_unlock(&b->lock);
+            free(copy);
+            return MP4LEN_ERR_NOMEM;
+        }
+    }
+    if (b->n_free == 0) {
+        stall = now();
+        b->stats.stalls += 1;
+        while (b->n_free == 0) {
+            pthread_cond_wait(&b->space, &b->lock);
+        }
+        b->stats.stall_time += now() - stall;
+    }
+    id = b->free_ids[--b->n_free];
+    job = &b->slots[id];
+    memset(job, 0, sizeof(*job));
+    job->path = copy;
+    job->arg = arg;
+    job->seq = b->tail;
+    job->state = JOB_QUEUED;
+    b->order[b->tail % b->window] = id;
+    b->tail += 1;
+    d = &b->devs[dev_id];
+    b->q_next[id] = NO_SLOT;
+    if (d->q_len > 0) {
+        b->q_next[d->q_last] = id;
+    }
+    else {
+        d->q_first = id;
+    }
+    d->q_last = id;
+    d->q_len += 1;
+    b->q_len += 1;
+    pthread_cond_signal(&b->work);
+    pthread_mutex_unlock(&b->lock);
+    return 0;
+}
+
+// Return the most files that may be submitted and not yet emitted.
+size_t batch_window(const struct batch *b)
+{
+    return b->window;
+}
+
+// Wait for every submitted file to be probed and emitted, then stop the
+// workers and free the batch.
+// Return the number of files that failed.
+unsigned long long batch_finish(struct batch *b, struct batch_stats *stats)
+{
+    struct batch_dev_stats *ds;
+    struct batch_dev *d;
+    unsigned long long failed;
+
+    pthread_mutex_lock(&b->lock);
+    b->finishing = 1;
+    pthread_cond_broadcast(&b->work);
+    if (b->watched) {
+        // every job is emitted, then the watchdog can stop, and a worker
+        // still busy is only probing a hedge that lost
+        while (b->n_free < b->window) {
+            pthread_cond_wait(&b->space, &b->lock);
+        }
+        b->watch_stop = 1;
+        pthread_cond_signal(&b->tick);
+        pthread_mutex_unlock(&b->lock);
+        pthread_join(b->watchdog, NULL);
+        pthread_mutex_lock(&b->lock);
+        for (int ii = 0; ii < b->n_workers; ii++) {
+            if (b->workers[ii].busy && !b->workers[ii].abandoned) {
+                b->workers[ii].abandoned = 1;
+                b->n_live -= 1;
+                b->n_abandoned += 1;
+                pthread_detach(b->workers[ii].thread);
+            }
+        }
+    }
+    pthread_mutex_unlock(&b->lock);
+    for (int ii = 0; ii < b->n_workers; ii++) {
+        if (!b->workers[ii].abandoned && !b->workers[ii].gone) {
+            pthread_join(b->workers[ii].thread, NULL);
+        }
+    }
+
+    held_change(b, 0);
+    b->stats.window = b->window;
+    b->stats.elapsed = now() - b->start;
+    for (int ii = 0; b->by_dev && (ii < b->n_devs)
+                     && (ii < BATCH_STATS_DEVS); ii++) {
+        d = &b->devs[ii];
+        ds = &b->stats.dev[ii];
+        ds->dev = d->dev;
+        ds->files = d->files;
+        ds->limit = d->limit;
+        ds->limit_max = d->limit_max;
+        ds->tuned = d->tuned;
+        ds->latency = d->files ? d->lat_total / d->files : 0;
+        b->stats.n_devs = ii + 1;
+    }
+    failed = b->stats.failed;
+    if (stats != NULL) {
+        *stats = b->stats;
+    }
+    pthread_mutex_lock(&b->lock);
+    if (b->n_abandoned > 0) {
+        // freed by whichever abandoned worker exits last
+        b->orphaned = 1;
+        pthread_mutex_unlock(&b->lock);
+        return failed;
+    }
+    pthread_mutex_unlock(&b->lock);
+    batch_free(b);
+    return failed;
+}
@@ -0,0 +1,139 @@
+/* batch
+   Probes many files on a pool of worker threads for the mp4len command.
+
+   Nicholas A. Masluk
+   nick@randombytes.net
+   Copyright 2023
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "mp4len.h"
+
+// One file to probe and, once probed, its result.
+struct batch_job {
+    char *path;
+    void *arg; // as given to batch_submit
+    unsigned long long seq; // position in input order, from 0
+    int state; // see batch.c
+    int ret; // MP4LEN_OK or error code
+    struct mp4len_result res;
+    int keyed; // key is filled in, with batch_opts.keys or a cache
+    struct mp4len_key key; // as before probing
+};
+
+// Called once for each finished job, in the order chosen by
+// batch_opts.order.  Calls are never made at the same time.
+typedef void (*batch_emit_fn)(void *arg, const struct batch_job *job);
+
+// Order finished jobs are emitted in
+enum {
+    BATCH_ORDER_INPUT, // as submitted, holding back jobs that finish early
+    BATCH_ORDER_COMPLETION // as soon as each finishes
+};
+
+// How workers pick files
+enum {
+    BATCH_SCHED_FIFO, // one at a time, in input order
+    BATCH_SCHED_PHYSICAL // groups at a time, reading in disk order
+};
+
+#define BATCH_DEV_AUTO (-1) // device limit tuned from probe latency
+#define BATCH_DEV_JOBS 64 // workers to use when devices have their own limits
+#define BATCH_STATS_DEVS 16 // most devices reported in batch_stats
+
+// Most workers probing files on one device (st_dev) at once
+struct batch_dev_limit {
+    dev_t dev;
+    int limit; // workers, or BATCH_DEV_AUTO
+};
+
+struct batch_opts {
+    int jobs; // number of worker threads
+    int order; // BATCH_ORDER_*
+    int schedule; // BATCH_SCHED_*
+    size_t window; // most jobs submitted but not yet emitted, 0 for default
+    const struct batch_dev_limit *dev_limits; // limits for given devices
+    size_t n_dev_limits;
+    int dev_default; // limit for other devices, BATCH_DEV_AUTO, or 0 for none
+    mp4len_cache *cache; // results to look files up in first, or NULL
+    int keys; // fill in each job's key, even without a cache
+    int recheck; // probe files found in the cache again, at their header
+    double timeout; // seconds a file may take, then MP4LEN_ERR_TIMEOUT
+    double hedge; // probe a file again once it takes longer than this
+                  // quantile of recent files, such as 0.95, or 0 for never
+    double fault_delay; // seconds to hold up reads by, for testing
+    double fault_rate; // share of reads held up, from 0 to 1
+    batch_emit_fn emit;
+    void *emit_arg;
+};
+
+// Counters kept for one device
+struct batch_dev_stats {
+    dev_t dev;
+    unsigned long long files; // files probed
+    int limit; // limit at the end, 0 for none
+    int limit_max; // highest limit reached
+    int tuned; // limit was tuned from latency
+    double latency; // mean seconds probing each file
+};
+
+// Counters kept over the life of a batch.  Jobs finished but held back
+// waiting for an earlier job to be emitted in input order are the cost of
+// head of line blocking.
+struct batch_stats {
+    unsigned long long files; // files emitted
+    unsigned long long failed; // files emitted with an error
+    size_t window; // slots in the reorder window
+    unsigned long long held_jobs; // jobs held back at all
+    size_t held; // jobs held back right now
+    size_t held_max; // most jobs held back at once
+    double held_time; // sum over time of jobs held back, in job seconds
+    unsigned long long stalls; // submissions that waited for a free slot
+    double stall_time; // seconds submissions spent waiting
+    unsigned long long sched_reads; // reads placed on disk by FIEMAP
+    unsigned long long seek; // bytes of head movement between them
+    unsigned long long seek_file_order; // the same, reading file by file
+    unsigned long long cache_lookups; // files looked up in the cache
+    unsigned long long cache_hits; // and found there
+    unsigned long long cache_negative; // found there as having failed
+    unsigned long long hinted; // probed at a header the cache remembered
+    unsigned long long timeouts; // files emitted as timed out
+    unsigned long long replaced; // workers started to replace stuck ones
+    unsigned long long hedges; // files probed again for running long
+    unsigned long long hedge_wins; // and emitted from the second probe
+    double elapsed; // seconds from start to finish
+    struct batch_dev_stats dev[BATCH_STATS_DEVS]; // with device limits only
+    int n_devs;
+};
+
+struct batch;
+
+// Number of workers to use by default for files like path: more for
+// network storage where probes mostly wait, fewer for spinning disks.
+int batch_default_jobs(const char *path);
+
+// Start the workers.  Return NULL if out of memory or threads.
+struct batch *batch_start(const struct batch_opts *opts);
+
+// Queue a file to probe, waiting while the window is full.  arg is passed
+// back with the job when emitted.  May be called from several threads at
+// once.
+// Return 0 if successful, or MP4LEN_ERR_NOMEM.
+int batch_submit(struct batch *b, const char *path, void *arg);
+
+// Return the most files that may be submitted and not yet emitted, beyond
+// which batch_submit() waits.
+size_t batch_window(const struct batch *b);
+
+// Wait for every submitted file to be probed and emitted, then stop the
+// workers and free the batch, filling in *stats if not NULL.
+// Return the number of files that failed.
+unsigned long long batch_finish(struct batch *b, struct batch_stats *stats);
+
+#endif
@@ -0,0 +1,274 @@
+/* checkpoint
+   Records the files a long run of the mp4len command has finished, so that
+   it can be resumed after being stopped without probing them again.
+
+   A checkpoint file is a magic number and then index records, one for each
+   file finished, with its length or an error that would come again, in
+   the order they were finished.  Records are gathered in memory and
+   appended about once a second in a single write and sync, so keeping one
+   costs a hash of each path and little else.  The walk is not
+   recorded as such: a resumed run walks the directories again, which
+   lists them without opening a file, and passes over every file found in
+   the checkpoint.  A record cut short by the run being stopped is dropped
+   when resuming.
+
+   Nicholas A. Masluk
+   nick@randombytes.net
+   Copyright 2023
+   Mozilla Public License Version 2.0
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+
+#define CHECKPOINT_MAGIC "MP4LCKP1"
+#define CHECKPOINT_MAGIC_LEN 8
+#define CHECKPOINT_BUF 65536 // records held before writing anyway
+
+struct checkpoint {
+    int fd;
+    char *cwd; // relative paths are taken from here
+    struct index_rec *done; // finished before resuming, sorted by hash
+    size_t n_done;
+    struct index_rec *recs; // added since the last write
+    size_t n_recs;
+    size_t cap;
+    off_t size; // of the file in whole records
+    double last; // when last written
+};
+
+// Return a monotonic time in seconds.
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// qsort and bsearch comparison of records by hash.
+static int rec_cmp(const void *a, const void *b)
+{
+    unsigned long long ha = ((const struct index_rec*)a)->hash;
+    unsigned long long hb = ((const struct index_rec*)b)->hash;
+
+    return (ha > hb) - (ha < hb);
+}
+
+// Write all len bytes of buf.
+// Return 0 if successful, or -1 with errno set.
+static int write_full(int fd, const void *buf, size_t len)
+{
+    const char *pos = (const char*)buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, pos, len);
+        if ((n < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        pos += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Read the records already in the checkpoint into cp->done and cut off any
+// partial record after them.
+// Return 0 if successful, or -1 with errno set.
+static int load(struct checkpoint *cp)
+{
+    char magic[CHECKPOINT_MAGIC_LEN];
+    struct stat st;
+    ssize_t n;
+    size_t len;
+
+    if (fstat(cp->fd, &st)) {
+        return -1;
+    }
+    cp->size = sizeof(magic);
+    if (st.st_size == 0) {
+        return write_full(cp->fd, CHECKPOINT_MAGIC, sizeof(magic));
+    }
+    if ((pread(cp->fd, magic, sizeof(magic), 0) != sizeof(magic))
+        || memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    cp->n_done = (st.st_size - sizeof(magic)) / sizeof(struct index_rec);
+    len = cp->n_done * sizeof(struct index_rec);
+    if (cp->n_done > 0) {
+        cp->done = (struct index_rec*)malloc(len);
+        if (cp->done == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        n = pread(cp->fd, cp->done, len, sizeof(magic));
+        if (n != (ssize_t)len) {
+            errno = (n < 0) ? errno : EIO;
+            return -1;
+        }
+        qsort(cp->done, cp->n_done, sizeof(struct index_rec), rec_cmp);
+        // a path given twice is kept once
+        n = 1;
+        for (size_t ii = 1; ii < cp->n_done; ii++) {
+            if (cp->done[ii].hash != cp->done[n - 1].hash) {
+                cp->done[n++] = cp->done[ii];
+            }
+        }
+        cp->n_done = n;
+    }
+    cp->size += len;
+    if (ftruncate(cp->fd, cp->size) || (lseek(cp->fd, 0, SEEK_END) < 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+// Open a checkpoint file, starting it empty or resuming it.
+// Return NULL with errno set if it cannot be opened or is not a checkpoint.
+struct checkpoint *checkpoint_open(const char *file, int resume)
+{
+    struct checkpoint *cp;
+    char cwd[PATH_MAX];
+    int err;
+
+    cp = (struct checkpoint*)calloc(1, sizeof(struct checkpoint));
+    if (cp == NULL) {
+        return NULL;
+    }
+    cp->cwd = strdup(getcwd(cwd, sizeof(cwd)) ? cwd : "/");
+    cp->fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC
+                  | (resume ? 0 : O_TRUNC), 0666);
+    if ((cp->cwd == NULL) || (cp->fd < 0) || load(cp)) {
+        err = (cp->cwd == NULL) ? ENOMEM : errno;
+        if (cp->fd >= 0) {
+            close(cp->fd);
+        }
+        free(cp->done);
+        free(cp->cwd);
+        free(cp);
+        errno = err;
+        return NULL;
+    }
+    cp->last = now();
+    return cp;
+}
+
+// Return the record of path if it was finished before resuming, or NULL.
+const struct index_rec *checkpoint_find(const struct checkpoint *cp,
+                                        const char *path)
+{
+    struct index_rec key;
+
+    if (cp->n_done == 0) {
+        return NULL;
+    }
+    key.hash = index_hash(cp->cwd, path);
+    return (const struct index_rec*)bsearch(&key, cp->done, cp->n_done,
+                                            sizeof(struct index_rec),
+                                            rec_cmp);
+}
+
+// Return the records of the files finished before resuming.
+const struct index_rec *checkpoint_done(const struct checkpoint *cp,
+                                        size_t *n)
+{
+    *n = cp->n_done;
+    return cp->done;
+}
+
+// Note the result of probing path, to be written later.
+// Return 0 if successful, or MP4LEN_ERR_NOMEM.
+int checkpoint_add(struct checkpoint *cp, const char *path,
+                   const struct mp4len_key *key, int ret,
+                   const struct mp4len_result *res)
+{
+    struct index_rec *recs;
+    size_t cap;
+
+    if ((ret != MP4LEN_OK) && !mp4len_error_lasting(ret)) {
+        return 0;
+    }
+    if (cp->n_recs == cp->cap) {
+        cap = cp->cap ? 2 * cp->cap : 1024;
+        recs = (struct index_rec*)realloc(cp->recs,
+                                          cap * sizeof(struct index_rec));
+        if (recs == NULL) {
+            return MP4LEN_ERR_NOMEM;
+        }
+        cp->recs = recs;
+        cp->cap = cap;
+    }
+    index_rec_set(&cp->recs[cp->n_recs++], index_hash(cp->cwd, path), key,
+                  ret, res);
+    return 0;
+}
+
+// Return 1 if it is time to write the files added.
+int checkpoint_due(const struct checkpoint *cp)
+{
+    return (cp->n_recs >= CHECKPOINT_BUF)
+        || ((cp->n_recs > 0) && (now() - cp->last >= CHECKPOINT_SECS));
+}
+
+// Append the files added since the last write, and wait for them to reach
+// the disk, so that the checkpoint outlasts a power loss.  Files that could
+// not be written are dropped, to be probed again if resumed.
+// Return 0 if successful, or -1 with errno set.
+int checkpoint_write(struct checkpoint *cp)
+{
+    size_t len = cp->n_recs * sizeof(struct index_rec);
+    int ret, err;
+
+    ret = write_full(cp->fd, cp->recs, len);
+    if ((ret == 0) && (len > 0)) {
+        ret = fdatasync(cp->fd);
+    }
+    if (ret == 0) {
+        cp->size += len;
+    }
+    else {
+        // keep what follows in step with the records
+        err = errno;
+        if (ftruncate(cp->fd, cp->size) == 0) {
+            lseek(cp->fd, 0, SEEK_END);
+        }
+        errno = err;
+    }
+    cp->n_recs = 0;
+    cp->last = now();
+    return ret;
+}
+
+// Write the files still to be written, and close the checkpoint.
+// Return 0 if successful, or -1 with errno set.
+int checkpoint_close(struct checkpoint *cp)
+{
+    int ret, err;
+
+    ret = checkpoint_write(cp);
+    err = errno;
+    if (close(cp->fd) && (ret == 0)) {
+        ret = -1;
+        err = errno;
+    }
+    free(cp->done);
+    free(cp->recs);
+    free(cp->cwd);
+    free(cp);
+    errno = err;
+    return ret;
+}
@@ -0,0 +1,61 @@
+/* checkpoint
+   Records the files a long run of the mp4len command has finished, so that
+   it can be resumed after being stopped without probing them again.
+
+   Nicholas A. Masluk
+   nick@randombytes.net
+   Copyright 2023
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stddef.h>
+
+#include "index.h"
+#include "mp4len.h"
+
+#define CHECKPOINT_SECS 1.0 // most seconds between writes
+
+struct checkpoint;
+
+// Open a checkpoint file, starting it empty, or with resume keeping the
+// files finished there before and adding to them.
+// Return NULL with errno set if it cannot be opened or is not a checkpoint
+// (EINVAL).
+struct checkpoint *checkpoint_open(const char *file, int resume);
+
+// Return the record of path if it was finished before resuming, or NULL.
+const struct index_rec *checkpoint_find(const struct checkpoint *cp,
+                                        const char *path);
+
+// Return the records of the files finished before resuming, sorted by
+// hash, setting *n to their number.
+const struct index_rec *checkpoint_done(const struct checkpoint *cp,
+                                        size_t *n);
+
+// Note the result of probing path, with key as it was before probing, or
+// NULL if it was not looked at.  A file that failed in a way that may not
+// last, such as timing out, is not noted, so that a resumed run tries it
+// again.  Nothing is written until checkpoint_write().
+// Return 0 if successful, or MP4LEN_ERR_NOMEM.
+int checkpoint_add(struct checkpoint *cp, const char *path,
+                   const struct mp4len_key *key, int ret,
+                   const struct mp4len_result *res);
+
+// Return 1 if files were added CHECKPOINT_SECS or more since the last
+// write, or enough to write anyway.  Whatever the caller did with them,
+// such as printing them, should be written out before writing them.
+int checkpoint_due(const struct checkpoint *cp);
+
+// Append the files added since the last write, and wait for them to reach
+// the disk.
+// Return 0 if successful, or -1 with errno set.
+int checkpoint_write(struct checkpoint *cp);
+
+// Write the files still to be written, and close the checkpoint.
+// Return 0 if successful, or -1 with errno set.
+int checkpoint_close(struct checkpoint *cp);
+
+#endif
@@ -0,0 +1,681 @@
+/* index
+   Builds and reads files indexing the lengths of many videos by path for
+   the mp4len command.
+
+   An index file is a header and then records sorted by path hash, so a
+   lookup is a binary search of the mapped file that never touches the
+   videos themselves.  Paths are not stored, only a 64 bit hash of each, so
+   two paths can collide, though among even 100 million paths the chance
+   is below 1 in 1000.
+
+   Changes made after an index is built are appended to a log beside it,
+   FILE.log, each a record that replaces the index's record for its hash
+   or, with INDEX_REMOVED, deletes it.  Readers load the log, then open
+   the index, and look in the log first.  Compacting merges the log into a
+   new index, renames it over the old one and only then empties the log,
+   and a reader finding a different index from the one there before it
+   loaded the log reads both again, so it sees every change whichever
+   moment it opens the two files.
+
+   Nicholas A. Masluk
+   nick@randombytes.net
+   Copyright 2023
+   Mozilla Public License Version 2.0
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "index.h"
+
+#define INDEX_MAGIC "MP4LIDX1"
+#define LOG_SUFFIX ".log"
+
+struct index_header {
+    char magic[8];
+    unsigned int rec_size;
+    unsigned int pad;
+    unsigned long long n_recs;
+    unsigned long long spare;
+};
+
+struct index {
+    void *map;
+    size_t map_len;
+    const struct index_rec *recs;
+    size_t n_recs;
+    struct index_rec *log; // latest record of each hash in the log, sorted
+    size_t n_log;
+};
+
+// A log record and its place in the log, for sorting.
+struct log_ent {
+    struct index_rec rec;
+    size_t seq;
+};
+
+// Append the components of path to the tidy path in buf, len bytes long.
+static void tidy_append(char *buf, size_t *len, size_t cap, const char *path)
+{
+    const char *comp = path, *end;
+    size_t comp_len;
+
+    while (*comp != '\0') {
+        end = strchr(comp, '/');
+        comp_len = end ? (size_t)(end - comp) : strlen(comp);
+        if ((comp_len == 2) && (comp[0] == '.') && (comp[1] == '.')) {
+            while ((*len > 0) && (buf[--*len] != '/')) {
+            }
+        }
+        else if ((comp_len > 0) && !((comp_len == 1) && (comp[0] == '.'))
+                 && (*len + 1 + comp_len < cap)) {
+            buf[(*len)++] = '/';
+            memcpy(buf + *len, comp, comp_len);
+            *len += comp_len;
+        }
+        comp += comp_len + (end ? 1 : 0);
+    }
+}
+
+// Return the hash of path, made absolute from cwd and tidied.
+unsigned long long index_hash(const char *cwd, const char *path)
+{
+    char buf[2 * PATH_MAX];
+    size_t len = 0;
+    unsigned long long h = 0xCBF29CE484222325ULL;
+
+    if (path[0] != '/') {
+        tidy_append(buf, &len, sizeof(buf), cwd);
+    }
+    tidy_append(buf, &len, sizeof(buf), path);
+    if (len == 0) {
+        buf[len++] = '/';
+    }
+
+    // FNV-1a, then the splitmix64 finalizer to spread it
+    for (size_t ii = 0; ii < len; ii++) {
+        h = (h ^ (unsigned char)buf[ii]) * 0x100000001B3ULL;
+    }
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+    return h ^ (h >> 31);
+}
+
+// Start gathering records.
+// Return 0 if successful, or MP4LEN_ERR_NOMEM.
+int index_build_init(struct index_build *ib)
+{
+    char cwd[PATH_MAX];
+
+    memset(ib, 0, sizeof(*ib));
+    ib->cwd = strdup(getcwd(cwd, sizeof(cwd)) ? cwd : "/");
+    return (ib->cwd == NULL) ? MP4LEN_ERR_NOMEM : 0;
+}
+
+// Fill in a record from the result of probing a file.
+void index_rec_set(struct index_rec *rec, unsigned long long hash,
+                   const struct mp4len_key *key, int ret,
+                   const struct mp4len_result *res)
+{
+    memset(rec, 0, sizeof(*rec));
+    rec->hash = hash;
+    if (key != NULL) {
+        rec->size = key->size;
+        rec->mtime_ns = key->mtime_ns;
+    }
+    if (ret == MP4LEN_OK) {
+        rec->len_unit = res->len_unit;
+        rec->unit_per_sec = (unsigned int)res->unit_per_sec;
+    }
+    else {
+        rec->len_unit = ret;
+        rec->flags = INDEX_FAILED;
+    }
+}
+
+// Add a record, growing the array as needed.
+// Return 0 if successful, or MP4LEN_ERR_NOMEM.
+int index_build_push(struct index_build *ib, const struct index_rec *rec)
+{
+    struct index_rec *recs;
+    size_t cap;
+
+    if (ib->n_recs == ib->cap) {
+        cap = ib->cap ? 2 * ib->cap : 1024;
+        recs = (struct index_rec*)realloc(ib->recs,
+                                          cap * sizeof(struct index_rec));
+        if (recs == NULL) {
+            return MP4LEN_ERR_NOMEM;
+        }
+        ib->recs = recs;
+        ib->cap = cap;
+    }
+    ib->recs[ib->n_recs++] = *rec;
+    return 0;
+}
+
+// Add the result of probing path.
+// Return 0 if successful, or MP4LEN_ERR_NOMEM.
+int index_build_add(struct index_build *ib, const char *path,
+                    const struct mp4len_key *key, int ret,
+                    const struct mp4len_result *res)
+{
+    struct index_rec rec;
+
+    index_rec_set(&rec, index_hash(ib->cwd, path), key, ret, res);
+    return index_build_push(ib, &rec);
+}
+
+// qsort comparison of records by hash.
+static int rec_cmp(const void *a, const void *b)
+{
+    unsigned long long ha = ((const struct index_rec*)a)->hash;
+    unsigned long long hb = ((const struct index_rec*)b)->hash;
+
+    return (ha > hb) - (ha < hb);
+}
+
+// Sort the records and write them to file, replacing it in one step.
+// Return 0 if successful, or -1 with errno set.
+int index_build_write(struct index_build *ib, const char *file)
+{
+    struct index_header hdr = {0};
+    char *tmp;
+    size_t n = 0;
+    FILE *fptr;
+    int err;
+
+    qsort(ib->recs, ib->n_recs, sizeof(struct index_rec), rec_cmp);
+    // a path given twice is kept once
+    for (size_t ii = 0; ii < ib->n_recs; ii++) {
+        if ((n == 0) || (ib->recs[ii].hash != ib->recs[n - 1].hash)) {
+            ib->recs[n++] = ib->recs[ii];
+        }
+    }
+    ib->n_recs = n;
+
+    memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+    hdr.rec_size = sizeof(struct index_rec);
+    hdr.n_recs = n;
+    tmp = (char*)malloc(strlen(file) + 32);
+    if (tmp == NULL) {
+        return -1;
+    }
+    sprintf(tmp, "%s.%ld.tmp", file, (long)getpid());
+    fptr = fopen(tmp, "w");
+    if (fptr == NULL) {
+        free(tmp);
+        return -1;
+    }
+    if ((fwrite(&hdr, sizeof(hdr), 1, fptr) != 1)
+        || (fwrite(ib->recs, sizeof(struct index_rec), n, fptr) != n)
+        || fflush(fptr) || fsync(fileno(fptr))) {
+        err = errno;
+        fclose(fptr);
+        unlink(tmp);
+        free(tmp);
+        errno = err;
+        return -1;
+    }
+    if (fclose(fptr) || rename(tmp, file)) {
+        err = errno;
+        unlink(tmp);
+        free(tmp);
+        errno = err;
+        return -1;
+    }
+    free(tmp);
+    return 0;
+}
+
+void index_build_free(struct index_build *ib)
+{
+    free(ib->recs);
+    free(ib->cwd);
+    memset(ib, 0, sizeof(*ib));
+}
+
+// Return the name of file's log, or NULL if out of memory.
+static char *log_name(const char *file)
+{
+    char *name;
+
+    name = (char*)malloc(strlen(file) + sizeof(LOG_SUFFIX));
+    if (name != NULL) {
+        strcpy(name, file);
+        strcat(name, LOG_SUFFIX);
+    }
+    return name;
+}
+
+// qsort comparison of log entries by hash, then place in the log.
+static int ent_cmp(const void *a, const void *b)
+{
+    const struct log_ent *ea = (const struct log_ent*)a;
+    const struct log_ent *eb = (const struct log_ent*)b;
+    int cmp = rec_cmp(&ea->rec, &eb->rec);
+
+    return cmp ? cmp : (ea->seq > eb->seq) - (ea->seq < eb->seq);
+}
+
+// Read the log of file into idx, keeping the last record of each hash.  A
+// missing log is an empty one, and a record cut short by a writer is left
+// for next time.
+// Return 0 if successful, or -1 with errno set.
+static int log_load(struct index *idx, const char *file)
+{
+    struct log_ent *ents;
+    struct stat st;
+    char *name;
+    size_t n = 0;
+    FILE *fptr;
+
+    idx->log = NULL;
+    idx->n_log = 0;
+    name = log_name(file);
+    if (name == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    fptr = fopen(name, "r");
+    free(name);
+    if (fptr == NULL) {
+        return (errno == ENOENT) ? 0 : -1;
+    }
+    if (fstat(fileno(fptr), &st)
+        || (st.st_size < (off_t)sizeof(struct index_rec))) {
+        fclose(fptr);
+        return 0;
+    }
+    ents = (struct log_ent*)malloc(st.st_size / sizeof(struct index_rec)
+                                   * sizeof(struct log_ent));
+    idx->log = (struct index_rec*)malloc(st.st_size);
+    if ((ents == NULL) || (idx->log == NULL)) {
+        free(ents);
+        free(idx->log);
+        idx->log = NULL;
+        fclose(fptr);
+        errno = ENOMEM;
+        return -1;
+    }
+    while ((n < st.st_size / sizeof(struct index_rec))
+           && (fread(&ents[n].rec, sizeof(struct index_rec), 1, fptr) == 1)) {
+        ents[n].seq = n;
+        n += 1;
+    }
+    fclose(fptr);
+
+    qsort(ents, n, sizeof(struct log_ent), ent_cmp);
+    for (size_t ii = 0; ii < n; ii++) {
+        if ((ii + 1 == n) || (ents[ii + 1].rec.hash != ents[ii].rec.hash)) {
+            idx->log[idx->n_log++] = ents[ii].rec;
+        }
+    }
+    free(ents);
+    return 0;
+}
+
+// Return 1 if the map_len bytes at map are a whole index file.
+static int index_valid(const void *map, size_t map_len)
+{
+    const struct index_header *hdr = (const struct index_header*)map;
+
+    return (map_len >= sizeof(*hdr))
+        && (memcmp(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic)) == 0)
+        && (hdr->rec_size == sizeof(struct index_rec))
+        && (hdr->n_recs <= (map_len - sizeof(*hdr))
+            / sizeof(struct index_rec));
+}
+
+// Map the index file itself into idx, setting *st to the file mapped.
+// Return 0 if successful, or -1 with errno set.
+static int index_map(struct index *idx, const char *file, struct stat *st)
+{
+    void *map = MAP_FAILED;
+    int fd, err;
+
+    fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, st) == 0) {
+        map = mmap(NULL, st->st_size ? st->st_size : 1, PROT_READ,
+                   MAP_SHARED, fd, 0);
+    }
+    err = errno;
+    close(fd);
+    if (map == MAP_FAILED) {
+        errno = err;
+        return -1;
+    }
+    if (!index_valid(map, st->st_size)) {
+        munmap(map, st->st_size ? st->st_size : 1);
+        errno = EINVAL;
+        return -1;
+    }
+    idx->map = map;
+    idx->map_len = st->st_size ? st->st_size : 1;
+    idx->recs = (const struct index_rec*)((const char*)map
+                                          + sizeof(struct index_header));
+    idx->n_recs = ((const struct index_header*)map)->n_recs;
+    return 0;
+}
+
+// Map an index file for reading, and load the changes in its log.
+// Return NULL with errno set if it cannot be opened or is not an index.
+struct index *index_open(const char *file)
+{
+    struct index *idx;
+    struct stat before, st;
+    int err;
+
+    idx = (struct index*)calloc(1, sizeof(struct index));
+    if (idx == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (;;) {
+        // the log is loaded before the index, and the index checked to be
+        // the one there before the log was: compacting renames the new
+        // index into place before emptying the log, so a log emptied
+        // meanwhile shows up as a new index, and both are read again
+        if (stat(file, &before) || log_load(idx, file)
+            || index_map(idx, file, &st)) {
+            err = errno;
+            free(idx->log);
+            free(idx);
+            errno = err;
+            return NULL;
+        }
+        if ((st.st_ino == before.st_ino) && (st.st_dev == before.st_dev)) {
+            return idx;
+        }
+        munmap(idx->map, idx->map_len);
+        free(idx->log);
+    }
+}
+
+void index_close(struct index *idx)
+{
+    if (idx == NULL) {
+        return;
+    }
+    munmap(idx->map, idx->map_len);
+    free(idx->log);
+    free(idx);
+}
+
+// Return the record for hash among n sorted records, or NULL.
+static const struct index_rec *find_rec(const struct index_rec *recs,
+                                        size_t n, unsigned long long hash)
+{
+    size_t lo = 0, hi = n, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (recs[mid].hash < hash) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    if ((lo < n) && (recs[lo].hash == hash)) {
+        return &recs[lo];
+    }
+    return NULL;
+}
+
+// Return the record for a path hash, or NULL if it is not in the index.
+const struct index_rec *index_find(const struct index *idx,
+                                   unsigned long long hash)
+{
+    const struct index_rec *rec;
+
+    rec = find_rec(idx->log, idx->n_log, hash);
+    if (rec != NULL) {
+        return (rec->flags & INDEX_REMOVED) ? NULL : rec;
+    }
+    return find_rec(idx->recs, idx->n_recs, hash);
+}
+
+// Number of records in the index file itself, not counting its log.
+size_t index_size(const struct index *idx)
+{
+    return idx->n_recs;
+}
+
+// Open the log of index file for appending, creating it if need be.
+// Return 0 if successful, or -1 with errno set.
+int index_log_open(struct index_log *log, const char *file)
+{
+    char cwd[PATH_MAX];
+    char *name;
+    int err;
+
+    memset(log, 0, sizeof(*log));
+    log->fd = -1;
+    name = log_name(file);
+    log->file = strdup(file);
+    log->cwd = strdup(getcwd(cwd, sizeof(cwd)) ? cwd : "/");
+    if ((name == NULL) || (log->file == NULL) || (log->cwd == NULL)) {
+        free(name);
+        index_log_close(log);
+        errno = ENOMEM;
+        return -1;
+    }
+    log->fd = open(name, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    err = errno;
+    free(name);
+    if (log->fd < 0) {
+        index_log_close(log);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// Append the result of probing path, or its removal if key is NULL.
+// Return 0 if successful, or -1 with errno set.
+int index_log_add(struct index_log *log, const char *path,
+                  const struct mp4len_key *key, int ret,
+                  const struct mp4len_result *res)
+{
+    struct index_rec rec;
+    ssize_t n_written;
+
+    index_rec_set(&rec, index_hash(log->cwd, path), key, ret, res);
+    if (key == NULL) {
+        rec.flags = INDEX_REMOVED;
+    }
+    // one write, so a reader never sees half a record but at the end
+    do {
+        n_written = write(log->fd, &rec, sizeof(rec));
+    } while ((n_written < 0) && (errno == EINTR));
+    if (n_written != (ssize_t)sizeof(rec)) {
+        errno = (n_written < 0) ? errno : ENOSPC;
+        return -1;
+    }
+    log->n_recs += 1;
+    return 0;
+}
+
+// Add the records of an index as its log leaves them, in hash order.
+// Return 0 if successful, or MP4LEN_ERR_NOMEM.
+static int push_current(struct index_build *ib, const struct index *idx)
+{
+    size_t ii = 0, jj = 0;
+    const struct index_rec *rec;
+    int err = 0;
+
+    // both are sorted by hash, and the log's record wins
+    while ((err == 0) && ((ii < idx->n_recs) || (jj < idx->n_log))) {
+        if ((jj == idx->n_log)
+            || ((ii < idx->n_recs) && (idx->recs[ii].hash
+                                       < idx->log[jj].hash))) {
+            rec = &idx->recs[ii++];
+        }
+        else {
+            if ((ii < idx->n_recs) && (idx->recs[ii].hash
+                                       == idx->log[jj].hash)) {
+                ii += 1;
+            }
+            rec = &idx->log[jj++];
+            if (rec->flags & INDEX_REMOVED) {
+                continue;
+            }
+        }
+        err = index_build_push(ib, rec);
+    }
+    return err;
+}
+
+// Merge the log into a new index file and empty the log.
+// Return 0 if successful, or -1 with errno set.
+int index_log_compact(struct index_log *log)
+{
+    struct index_build ib = {0};
+    struct index *idx;
+    int err;
+
+    idx = index_open(log->file);
+    if (idx == NULL) {
+        return -1;
+    }
+    err = push_current(&ib, idx);
+    index_close(idx);
+    if (err || index_build_write(&ib, log->file)) {
+        err = err ? ENOMEM : errno;
+        index_build_free(&ib);
+        errno = err;
+        return -1;
+    }
+    log->n_base = ib.n_recs;
+    index_build_free(&ib);
+    // only now that the new index holds everything in it
+    if (ftruncate(log->fd, 0)) {
+        return -1;
+    }
+    log->n_recs = 0;
+    return 0;
+}
+
+// qsort comparison of merged records by hash, then the file modified
+// last, then the index given last.
+static int merge_cmp(const void *a, const void *b)
+{
+    const struct log_ent *ea = (const struct log_ent*)a;
+    const struct log_ent *eb = (const struct log_ent*)b;
+    int cmp = rec_cmp(&ea->rec, &eb->rec);
+
+    if (cmp == 0) {
+        cmp = (ea->rec.mtime_ns < eb->rec.mtime_ns)
+            - (ea->rec.mtime_ns > eb->rec.mtime_ns);
+    }
+    return cmp ? cmp : (ea->seq < eb->seq) - (ea->seq > eb->seq);
+}
+
+// Merge the indexes, each with its log, into a new index file out.
+// Return 0 if successful, or -1 with errno set and *bad set to the file at
+// fault.
+int index_merge(char **files, int n_files, const char *out, const char **bad)
+{
+    struct index_build ib = {0};
+    struct log_ent *ents;
+    struct index *idx;
+    size_t n = 0;
+    char *name;
+    int err = 0;
+
+    *bad = out;
+    for (int ii = 0; (err == 0) && (ii < n_files); ii++) {
+        idx = index_open(files[ii]);
+        if (idx == NULL) {
+            *bad = files[ii];
+            index_build_free(&ib);
+            return -1;
+        }
+        err = push_current(&ib, idx);
+        index_close(idx);
+    }
+    ents = (err || (ib.n_recs == 0)) ? NULL
+         : (struct log_ent*)malloc(ib.n_recs * sizeof(struct log_ent));
+    if (err || ((ents == NULL) && (ib.n_recs > 0))) {
+        index_build_free(&ib);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    // records were added index by index, so the place of each tells which
+    // index it came from
+    for (size_t ii = 0; ii < ib.n_recs; ii++) {
+        ents[ii].rec = ib.recs[ii];
+        ents[ii].seq = ii;
+    }
+    if (ib.n_recs > 0) {
+        qsort(ents, ib.n_recs, sizeof(struct log_ent), merge_cmp);
+    }
+    for (size_t ii = 0; ii < ib.n_recs; ii++) {
+        if ((ii == 0) || (ents[ii].rec.hash != ents[ii - 1].rec.hash)) {
+            ib.recs[n++] = ents[ii].rec;
+        }
+    }
+    ib.n_recs = n;
+    free(ents);
+
+    if (index_build_write(&ib, out)) {
+        err = errno;
+        index_build_free(&ib);
+        errno = err;
+        return -1;
+    }
+    index_build_free(&ib);
+    // a log left from before belongs to the index just replaced
+    name = log_name(out);
+    if (name == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (truncate(name, 0) && (errno != ENOENT)) {
+        err = errno;
+        free(name);
+        errno = err;
+        return -1;
+    }
+    free(name);
+    return 0;
+}
+
+void index_log_close(struct index_log *log)
+{
+    if (log->fd >= 0) {
+        close(log->fd);
+    }
+    free(log->file);
+    free(log->cwd);
+    memset(log, 0, sizeof(*log));
+    log->fd = -1;
+}
+
+// Fill in *res from a record.
+// Return MP4LEN_OK, or the error code probing the file gave.
+int index_result(const struct index_rec *rec, struct mp4len_result *res)
+{
+    memset(res, 0, sizeof(*res));
+    res->fsize = rec->size;
+    if (rec->flags & INDEX_FAILED) {
+        return (int)rec->len_unit;
+    }
+    res->unit_per_sec = rec->unit_per_sec;
+    res->len_unit = rec->len_unit;
+    // as the parser works it out, to print the same
+    res->len_sec = (double)rec->len_unit / (float)rec->unit_per_sec;
+    return MP4LEN_OK;
+}
@@ -0,0 +1,126 @@
+/* index
+   Builds and reads files indexing the lengths of many videos by path for
+   the mp4len command.
+
+   Nicholas A. Masluk
+   nick@randombytes.net
+   Copyright 2023
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stddef.h>
+
+#include "mp4len.h"
+
+#define INDEX_FAILED 1 // probe failed, len_unit holds the error code
+#define INDEX_REMOVED 2 // in a log, the path is no longer there
+
+// What is known of one path.  Index files hold these sorted by hash.
+struct index_rec {
+    unsigned long long hash; // of the path, see index_hash()
+    long long size;
+    long long mtime_ns; // nanoseconds since the epoch
+    unsigned long long len_unit; // or the error code with INDEX_FAILED
+    unsigned int unit_per_sec;
+    unsigned int flags; // INDEX_*
+};
+
+// Records gathered for a new index file.
+struct index_build {
+    struct index_rec *recs;
+    size_t n_recs;
+    size_t cap;
+    char *cwd; // relative paths are taken from here
+};
+
+// Changes to an index, appended to its log.
+struct index_log {
+    int fd;
+    char *file; // the index
+    char *cwd; // relative paths are taken from here
+    size_t n_recs; // records appended since the log was last emptied
+    size_t n_base; // records in the index when last compacted
+};
+
+struct index;
+
+// Return the hash of path, made absolute from cwd and tidied of ".", ".."
+// and repeated slashes without looking at the file system, so that the
+// same file named in different ways mostly gets the same hash.
+unsigned long long index_hash(const char *cwd, const char *path);
+
+// Fill in *rec for hash from the result of probing its path, with key as
+// it was before probing, or NULL if it could not be found.
+void index_rec_set(struct index_rec *rec, unsigned long long hash,
+                   const struct mp4len_key *key, int ret,
+                   const struct mp4len_result *res);
+
+// Start gathering records.
+// Return 0 if successful, or MP4LEN_ERR_NOMEM.
+int index_build_init(struct index_build *ib);
+
+// Add the result of probing path, with key as it was before probing, or
+// NULL if it could not be found.
+// Return 0 if successful, or MP4LEN_ERR_NOMEM.
+int index_build_add(struct index_build *ib, const char *path,
+                    const struct mp4len_key *key, int ret,
+                    const struct mp4len_result *res);
+
+// Add a record made before, such as one kept in a checkpoint.
+// Return 0 if successful, or MP4LEN_ERR_NOMEM.
+int index_build_push(struct index_build *ib, const struct index_rec *rec);
+
+// Sort the records and write them to file, replacing it in one step.
+// Return 0 if successful, or -1 with errno set.
+int index_build_write(struct index_build *ib, const char *file);
+
+void index_build_free(struct index_build *ib);
+
+// Map an index file for reading, and load the changes in its log.
+// Return NULL with errno set if it cannot be opened or is not an index
+// (EINVAL).
+struct index *index_open(const char *file);
+
+void index_close(struct index *idx);
+
+// Return the record for a path hash, or NULL if it is not in the index.
+const struct index_rec *index_find(const struct index *idx,
+                                   unsigned long long hash);
+
+// Number of records in the index file itself, not counting its log.
+size_t index_size(const struct index *idx);
+
+// Open the log of index file for appending, creating it if need be.
+// Return 0 if successful, or -1 with errno set.
+int index_log_open(struct index_log *log, const char *file);
+
+// Append the result of probing path, with key as it was before probing,
+// or the removal of path if key is NULL.
+// Return 0 if successful, or -1 with errno set.
+int index_log_add(struct index_log *log, const char *path,
+                  const struct mp4len_key *key, int ret,
+                  const struct mp4len_result *res);
+
+// Merge the log into a new index file, replacing it in one step, then
+// empty the log.  Only one process may write to an index's log.
+// Return 0 if successful, or -1 with errno set.
+int index_log_compact(struct index_log *log);
+
+void index_log_close(struct index_log *log);
+
+// Merge the indexes, each with the changes in its log, into a new index
+// file out, replacing it in one step and emptying its log.  Where more
+// than one index has a record for a path, the one for the file modified
+// last is kept, or on a tie the one from the index given last.
+// Return 0 if successful, or -1 with errno set and *bad set to the file at
+// fault.
+int index_merge(char **files, int n_files, const char *out, const char **bad);
+
+// Fill in *res from a record.
+// Return MP4LEN_OK, or the error code probing the file gave.
+int index_result(const struct index_rec *rec, struct mp4len_result *res);
+
+#endif
@@ -0,0 +1,1539 @@
+/* libmp4len
+   Finds the time duration of MP4 video files.  See mp4len.h for the
+   interface.
+
+   Nicholas A. Masluk
+   nick@randombytes.net
+   Copyright 2023
+   Mozilla Public License Version 2.0
+*/
+
+#define _GNU_SOURCE // statx()
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mp4len.h"
+
+// Probe context, see mp4len_ctx_new().
+struct mp4len_ctx {
+    struct mp4len_parser parser;
+    int err; // errno from last failed system call
+    unsigned char *buf; // read buffer
+    size_t buf_len;
+    int owned; // allocated by mp4len_ctx_new()
+    mp4len_read_fn read; // reads in place of pread(), or NULL
+    void *read_arg;
+};
+
+// Parser states, in the order they are normally passed through.
+enum {
+    PARSE_MAGIC,  // reading the magic number
+    PARSE_SEARCH, // searching blocks for the "mvhd" header atom
+    PARSE_HEADER, // reading the header fields after "mvhd"
+    PARSE_DONE    // finished, see mp4len_parser.result
+};
+
+// Finish parsing with result code ret.
+static int parser_done(struct mp4len_parser *p, int ret)
+{
+    p->state = PARSE_DONE;
+    p->result = ret;
+    p->want_len = 0;
+    return ret;
+}
+
+// Start search iteration p->block, or finish if the file is exhausted.
+//
+// Search file for "mvhd" header atom string in blocks.  Since header will be
+// at the beginning or end of the file, we will search alternately in both
+// directions.  Even iterations at beginning of file, odd at end, and work our
+// way inwards.  Blocks at the end of file are aligned to the end of file.
+static int parser_next_block(struct mp4len_parser *p)
+{
+    long long xx = p->block;
+
+    if (xx >= p->n_blocks) {
+        // no match found in file
+        return parser_done(p, MP4LEN_ERR_NO_HEADER);
+    }
+    if (xx % 2) {
+        // odd iteration, work at end of file
+        p->want_off = p->fsize - (1 + (xx - 1) / 2) * MP4LEN_BLOCK_SIZE;
+    }
+    else {
+        // even iteration, work at beginning of file
+        p->want_off = xx / 2 * MP4LEN_BLOCK_SIZE;
+    }
+    p->want_len = MP4LEN_BLOCK_SIZE;
+    if (p->want_off + p->want_len > p->fsize) {
+        p->want_len = p->fsize - p->want_off;
+    }
+    p->blk_end = p->want_off + p->want_len;
+    p->chars_matching = 0;
+    return MP4LEN_AGAIN;
+}
+
+// Header found, ask for the fields after it.
+static int parser_found(struct mp4len_parser *p, long long hdr_off)
+{
+    p->state = PARSE_HEADER;
+    p->hdr_off = hdr_off;
+    p->buf_len = 0;
+    p->want_off = hdr_off;
+    p->want_len = MP4LEN_HDR_SIZE;
+    if (hdr_off + MP4LEN_HDR_SIZE > p->fsize) {
+        p->want_len = p->fsize - hdr_off;
+    }
+    if (p->want_len == 0) {
+        // "mvhd" right at the end of file
+        return parser_done(p, MP4LEN_ERR_TIMESCALE_READ);
+    }
+    return MP4LEN_AGAIN;
+}
+
+// Decode the header fields in p->buf once enough of them have arrived.
+//   1 byte version (if version 1, date and duration values are 8 bytes)
+//   3 bytes of hex flags
+//   4 bytes creation date, (8 bytes if version 1)
+//   4 bytes modified date, (8 bytes if version 1)
+//   4 bytes units per second, a big endian unsigned long
+//   4 bytes time length in units (8 bytes if version 1)
+static int parser_header(struct mp4len_parser *p, int at_end)
+{
+    int version = p->buf[0];
+    int ts_pos = (version == 1) ? 20 : 12;
+    int end_pos = (version == 1) ? 32 : 20;
+
+    if (p->buf_len < end_pos) {
+        if (!at_end) {
+            return MP4LEN_AGAIN;
+        }
+        // we did not complete a full read
+        return parser_done(p, (p->buf_len < ts_pos + 4)
+                          ? MP4LEN_ERR_TIMESCALE_READ
+                          : MP4LEN_ERR_DURATION_READ);
+    }
+
+    unsigned char *ts = p->buf + ts_pos;
+    p->unit_per_sec = ((unsigned long)ts[0] << 24)
+                    + ((unsigned long)ts[1] << 16)
+                    + ((unsigned long)ts[2] << 8) + ts[3];
+    p->len_unit = 0;
+    for (int jj = ts_pos + 4; jj < end_pos; jj++) {
+        p->len_unit = (p->len_unit << 8) + p->buf[jj];
+    }
+    p->len_sec = (double)p->len_unit / (float)p->unit_per_sec;
+    return parser_done(p, MP4LEN_OK);
+}
+
+// Big endian unsigned values.
+static unsigned long be32(const unsigned char *b)
+{
+    return ((unsigned long)b[0] << 24) | ((unsigned long)b[1] << 16)
+         | ((unsigned long)b[2] << 8) | b[3];
+}
+
+static unsigned long long be64(const unsigned char *b)
+{
+    return ((unsigned long long)be32(b) << 32) | be32(b + 4);
+}
+
+// Reset parser for a file fsize bytes long.
+void mp4len_parser_init(struct mp4len_parser *p, long long fsize)
+{
+    memset(p, 0, sizeof(*p));
+    p->fsize = fsize;
+    if (fsize < MP4LEN_MIN_SIZE) {
+        parser_done(p, MP4LEN_ERR_TOO_SMALL);
+        return;
+    }
+    p->n_blocks = fsize / MP4LEN_BLOCK_SIZE;
+    if (fsize % MP4LEN_BLOCK_SIZE > 0) {
+        p->n_blocks += 1;
+    }
+    // the magic number is 8 bytes at an offset of 4 bytes
+    p->state = PARSE_MAGIC;
+    p->want_off = 4;
+    p->want_len = 8;
+}
+
+// Return MP4LEN_AGAIN and set *off/*len to the bytes the parser wants next.
+// Once parsing is finished, return MP4LEN_OK or an error code.
+int mp4len_parser_want(const struct mp4len_parser *p, long long *off,
+                       long long *len)
+{
+    if (p->state == PARSE_DONE) {
+        return p->result;
+    }
+    *off = p->want_off;
+    *len = p->want_len;
+    return MP4LEN_AGAIN;
+}
+
+// Hand the parser len bytes starting at the offset it wants, which may be
+// fewer than it asked for.  Bytes beyond what it asked for are ignored.  A
+// len of 0 means no more bytes could be read there.
+// Return MP4LEN_AGAIN if more bytes are wanted, see mp4len_parser_want().
+// Return MP4LEN_OK once the duration is known, or an error code.
+int mp4len_parser_feed(struct mp4len_parser *p, const unsigned char *data,
+                       long long len)
+{
+    static const char hdr[4] = {'m', 'v', 'h', 'd'}; // header to find
+
+    if (p->state == PARSE_DONE) {
+        return p->result;
+    }
+    if (len > p->want_len) {
+        len = p->want_len;
+    }
+
+    switch (p->state) {
+    case PARSE_MAGIC:
+        if (len == 0) {
+            return parser_done(p, MP4LEN_ERR_MAGIC_READ);
+        }
+        memcpy(p->buf + p->buf_len, data, len);
+        p->buf_len += len;
+        p->want_off += len;
+        p->want_len -= len;
+        if (p->want_len > 0) {
+            return MP4LEN_AGAIN;
+        }
+        //   "ftypisom" for ISO base media file MPEG-4, MP4
+        //   "ftypmp42" for QuickTime MPEG-4, M4V
+        if (memcmp(p->buf, "ftypisom", 8) && memcmp(p->buf, "ftypmp42", 8)) {
+            return parser_done(p, MP4LEN_ERR_NOT_MP4);
+        }
+        p->state = PARSE_SEARCH;
+        p->block = 0;
+        return parser_next_block(p);
+
+    case PARSE_SEARCH:
+        if (p->want_off >= p->blk_end) {
+            // checking a match that flows into neighboring block, where
+            // running out of bytes just means no match
+            for (long long jj = 0; jj < len; jj++) {
+                if (data[jj] != hdr[p->chars_matching]) {
+                    len = 0;
+                    break;
+                }
+                p->chars_matching += 1;
+                if (p->chars_matching == 4) {
+                    return parser_found(p, p->want_off + jj + 1);
+                }
+            }
+            p->want_off += len;
+            p->want_len -= len;
+            if ((len > 0) && (p->want_len > 0)) {
+                // remaining characters not yet seen
+                return MP4LEN_AGAIN;
+            }
+            p->block += 1;
+            return parser_next_block(p);
+        }
+        if (len == 0) {
+            // we did not complete a full read
+            return parser_done(p, MP4LEN_ERR_BLOCK_READ);
+        }
+        for (long long jj = 0; jj < len; jj++) {
+            if (data[jj] == hdr[p->chars_matching]) {
+                p->chars_matching += 1;
+                if (p->chars_matching == 4) {
+                    // we found 'mvhd'
+                    return parser_found(p, p->want_off + jj + 1);
+                }
+            }
+            else {
+                // no match, though this may start a new one
+                p->chars_matching = (data[jj] == hdr[0]);
+            }
+        }
+        p->want_off += len;
+        p->want_len -= len;
+        if (p->want_len > 0) {
+            return MP4LEN_AGAIN;
+        }
+        if ((p->chars_matching > 0) && (p->blk_end < p->fsize)) {
+            // we might have a match that flows into neighboring block
+            p->want_len = 4 - p->chars_matching;
+            if (p->want_off + p->want_len > p->fsize) {
+                p->want_len = p->fsize - p->want_off;
+            }
+            return MP4LEN_AGAIN;
+        }
+        // no match, try next block
+        p->block += 1;
+        return parser_next_block(p);
+
+    case PARSE_HEADER:
+        memcpy(p->buf + p->buf_len, data, len);
+        p->buf_len += len;
+        p->want_off += len;
+        p->want_len -= len;
+        if (p->buf_len == 0) {
+            return parser_done(p, MP4LEN_ERR_TIMESCALE_READ);
+        }
+        return parser_header(p, (len == 0) || (p->want_len == 0));
+    }
+    return p->result;
+}
+
+// Copy the parsed values into *res, once parsing is finished.
+void mp4len_parser_result(const struct mp4len_parser *p,
+                          struct mp4len_result *res)
+{
+    res->len_sec = p->len_sec;
+    res->unit_per_sec = p->unit_per_sec;
+    res->len_unit = p->len_unit;
+    res->fsize = p->fsize;
+    res->hdr_off = p->hdr_off;
+}
+
+// Allocate a probe context, together with its read buffer so that probes
+// made through it never allocate.  Return NULL if out of memory.
+mp4len_ctx *mp4len_ctx_new(void)
+{
+    mp4len_ctx *ctx;
+
+    ctx = (mp4len_ctx*)malloc(sizeof(mp4len_ctx) + MP4LEN_BLOCK_SIZE);
+    if (ctx == NULL) {
+        return NULL;
+    }
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->buf = (unsigned char*)(ctx + 1);
+    ctx->buf_len = MP4LEN_BLOCK_SIZE;
+    ctx->owned = 1;
+    return ctx;
+}
+
+// Number of bytes of memory mp4len_ctx_init() needs for a context.
+size_t mp4len_ctx_size(void)
+{
+    return sizeof(mp4len_ctx);
+}
+
+// Set up a probe context in caller owned memory of mem_len bytes, aligned
+// for any type, reading through a caller owned scratch buffer.
+// Return the context, or NULL if either area is too small.
+mp4len_ctx *mp4len_ctx_init(void *mem, size_t mem_len, void *scratch,
+                            size_t scratch_len)
+{
+    mp4len_ctx *ctx = (mp4len_ctx*)mem;
+
+    if ((mem_len < sizeof(mp4len_ctx)) || (scratch == NULL)
+        || (scratch_len == 0)) {
+        return NULL;
+    }
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->buf = (unsigned char*)scratch;
+    ctx->buf_len = scratch_len;
+    return ctx;
+}
+
+// Free a probe context from mp4len_ctx_new().  Contexts from
+// mp4len_ctx_init() are left alone, their memory belongs to the caller.
+void mp4len_ctx_free(mp4len_ctx *ctx)
+{
+    if ((ctx != NULL) && ctx->owned) {
+        free(ctx);
+    }
+}
+
+// errno from the last failed system call made through ctx, or 0.
+int mp4len_ctx_errno(const mp4len_ctx *ctx)
+{
+    return ctx->err;
+}
+
+// Return the read buffer of ctx, setting *len to its size.
+unsigned char *mp4len_ctx_buf(mp4len_ctx *ctx, size_t *len)
+{
+    *len = ctx->buf_len;
+    return ctx->buf;
+}
+
+// Read files probed through ctx with read, or pread() again for NULL.
+void mp4len_ctx_set_read(mp4len_ctx *ctx, mp4len_read_fn read, void *arg)
+{
+    ctx->read = read;
+    ctx->read_arg = arg;
+}
+
+// Read up to len bytes at off through ctx, retrying when interrupted.
+// Return the number of bytes read, or -1 with errno set.
+static ssize_t ctx_pread(mp4len_ctx *ctx, int fd, void *buf, size_t len,
+                         long long off)
+{
+    ssize_t n_read;
+
+    do {
+        n_read = (ctx->read != NULL)
+            ? (ssize_t)ctx->read(ctx->read_arg, fd, buf, len, off)
+            : pread(fd, buf, len, (off_t)off);
+    } while ((n_read < 0) && (errno == EINTR));
+    return n_read;
+}
+
+// Pool of probe contexts, see mp4len_pool_new().  Free contexts are kept on
+// a lock-free stack of slot indexes.  The head holds the index of the top
+// slot plus one (0 when empty) in its low 32 bits and a count of pops in its
+// high 32 bits, so a slot popped and pushed back between another thread
+// reading the head and swapping it cannot be mistaken for no change.
+struct pool_slot {
+    _Alignas(MP4LEN_CACHE_LINE) mp4len_ctx ctx;
+    _Atomic unsigned int next; // index of the slot below plus one, or 0
+};
+
+struct mp4len_pool {
+    _Alignas(MP4LEN_CACHE_LINE) _Atomic unsigned long long head;
+    _Alignas(MP4LEN_CACHE_LINE) unsigned long long id; // unique per pool
+    struct pool_slot *slots;
+    unsigned char *bufs; // MP4LEN_BLOCK_SIZE read buffer per slot
+    unsigned int n_slots;
+};
+
+// Each thread keeps the last context it returned to a pool, so that a
+// thread checking out and returning one context per file never touches the
+// shared stack.  Pools are told apart by id rather than address, as a freed
+// pool's address may be reused.
+static _Thread_local struct {
+    unsigned long long pool_id;
+    mp4len_ctx *ctx;
+} pool_cache;
+
+static _Atomic unsigned long long pool_ids = 1;
+
+// Push slot index ii onto the pool's free stack.
+static void pool_push(mp4len_pool *pool, unsigned int ii)
+{
+    unsigned long long head, next;
+
+    head = atomic_load_explicit(&pool->head, memory_order_relaxed);
+    do {
+        atomic_store_explicit(&pool->slots[ii].next, (unsigned int)head,
+                              memory_order_relaxed);
+        next = (head & 0xFFFFFFFF00000000ULL) | (ii + 1);
+    } while (!atomic_compare_exchange_weak_explicit(&pool->head, &head, next,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+}
+
+// Pop a slot index off the pool's free stack.
+// Return the index plus one, or 0 if the stack is empty.
+static unsigned int pool_pop(mp4len_pool *pool)
+{
+    unsigned long long head, next;
+    unsigned int top;
+
+    head = atomic_load_explicit(&pool->head, memory_order_acquire);
+    do {
+        top = (unsigned int)head;
+        if (top == 0) {
+            return 0;
+        }
+        next = ((head >> 32) + 1) << 32;
+        next |= atomic_load_explicit(&pool->slots[top - 1].next,
+                                     memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak_explicit(&pool->head, &head, next,
+                                                    memory_order_acquire,
+                                                    memory_order_acquire));
+    return top;
+}
+
+// Allocate a pool of n_ctx probe contexts.  Contexts are cache line aligned
+// and their read buffers page aligned, all allocated up front.
+// Return NULL if out of memory.
+mp4len_pool *mp4len_pool_new(unsigned int n_ctx)
+{
+    mp4len_pool *pool;
+    void *mem;
+
+    if (posix_memalign(&mem, MP4LEN_CACHE_LINE, sizeof(mp4len_pool))) {
+        return NULL;
+    }
+    pool = (mp4len_pool*)mem;
+    memset(pool, 0, sizeof(*pool));
+    pool->n_slots = n_ctx;
+    pool->id = atomic_fetch_add(&pool_ids, 1);
+
+    if (posix_memalign(&mem, MP4LEN_CACHE_LINE,
+                       (size_t)n_ctx * sizeof(struct pool_slot) + 1)) {
+        free(pool);
+        return NULL;
+    }
+    pool->slots = (struct pool_slot*)mem;
+    if (posix_memalign(&mem, 4096, (size_t)n_ctx * MP4LEN_BLOCK_SIZE + 1)) {
+        free(pool->slots);
+        free(pool);
+        return NULL;
+    }
+    pool->bufs = (unsigned char*)mem;
+
+    atomic_init(&pool->head, 0);
+    for (unsigned int ii = n_ctx; ii > 0; ii--) {
+        mp4len_ctx_init(&pool->slots[ii - 1].ctx, sizeof(mp4len_ctx),
+                        pool->bufs + (size_t)(ii - 1) * MP4LEN_BLOCK_SIZE,
+                        MP4LEN_BLOCK_SIZE);
+        pool_push(pool, ii - 1);
+    }
+    return pool;
+}
+
+// Free a pool.  All of its contexts must have been returned.
+void mp4len_pool_free(mp4len_pool *pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+    if (pool_cache.pool_id == pool->id) {
+        pool_cache.ctx = NULL;
+    }
+    free(pool->bufs);
+    free(pool->slots);
+    free(pool);
+}
+
+// Check a context out of the pool.
+// Return NULL if every context is checked out.
+mp4len_ctx *mp4len_pool_get(mp4len_pool *pool)
+{
+    mp4len_ctx *ctx;
+    unsigned int top;
+
+    if ((pool_cache.pool_id == pool->id) && (pool_cache.ctx != NULL)) {
+        ctx = pool_cache.ctx;
+        pool_cache.ctx = NULL;
+        return ctx;
+    }
+    top = pool_pop(pool);
+    if (top == 0) {
+        return NULL;
+    }
+    return &pool->slots[top - 1].ctx;
+}
+
+// Return a context to the pool it came from.
+void mp4len_pool_put(mp4len_pool *pool, mp4len_ctx *ctx)
+{
+    struct pool_slot *slot = (struct pool_slot*)ctx;
+
+    if (pool_cache.ctx == NULL) {
+        pool_cache.pool_id = pool->id;
+        pool_cache.ctx = ctx;
+        return;
+    }
+    pool_push(pool, (unsigned int)(slot - pool->slots));
+}
+
+// Result cache, see mp4len_cache_open().  A file of a header and then a
+// power of two number of entries, mapped shared by every process using it.
+// An entry's place is found by hashing the device and inode, looking at up
+// to CACHE_PROBES entries onwards for a match or an unused entry, and
+// overwriting the first entry when there is neither.  Entries are never
+// removed, so an unused entry ends the search.  Each entry is a seqlock:
+// its count is odd while a writer fills it in, and readers discard what
+// they copied if the count was odd or changed meanwhile.  A writer that
+// finds the count odd, or loses the race to make it odd, gives up.  A file
+// that failed keeps its error code in ret, as a time scale of 0 may be a
+// result like any other.
+#define CACHE_MAGIC "MP4LCAC2"
+#define CACHE_PROBES 16
+#define CACHE_MIN_ENTRIES 1024
+
+struct cache_header {
+    char magic[8];
+    unsigned int entry_size;
+    unsigned int pad;
+    unsigned long long n_entries;
+    unsigned char spare[MP4LEN_CACHE_LINE - 24];
+};
+
+struct cache_entry {
+    _Atomic unsigned int seq; // odd while being written
+    _Atomic unsigned int unit_per_sec;
+    _Atomic int ret; // MP4LEN_OK, or the error the file failed with
+    _Atomic unsigned long long dev; // dev and ino both 0 when unused
+    _Atomic unsigned long long ino;
+    _Atomic long long size;
+    _Atomic long long mtime_ns;
+    _Atomic long long ctime_ns;
+    _Atomic unsigned long long len_unit;
+    _Atomic long long hdr_off;
+};
+
+struct mp4len_cache {
+    struct cache_entry *entries;
+    unsigned long long mask; // number of entries minus one
+    void *map;
+    size_t map_len;
+};
+
+// Read the header of the cache file open on fd into *hdr, first writing
+// one for n_entries entries if the file is empty.
+// Return 0 if it is a whole cache file, or -1 with errno set.
+static int cache_header(int fd, unsigned long long n_entries,
+                        struct cache_header *hdr)
+{
+    struct stat st;
+    int ret = 0;
+
+    // only the first process to take the lock sets the file up
+    if (flock(fd, LOCK_EX)) {
+        return -1;
+    }
+    if (fstat(fd, &st)) {
+        ret = -1;
+    }
+    else if (st.st_size == 0) {
+        memset(hdr, 0, sizeof(*hdr));
+        memcpy(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic));
+        hdr->entry_size = sizeof(struct cache_entry);
+        hdr->n_entries = n_entries;
+        st.st_size = sizeof(*hdr) + n_entries * sizeof(struct cache_entry);
+        // sparse, pages are only allocated as entries are filled in
+        if ((pwrite(fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr))
+            || ftruncate(fd, st.st_size)) {
+            ret = -1;
+        }
+    }
+    else if (pread(fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr)) {
+        errno = EINVAL;
+        ret = -1;
+    }
+    flock(fd, LOCK_UN);
+
+    if ((ret == 0)
+        && ((memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic)) != 0)
+            || (hdr->entry_size != sizeof(struct cache_entry))
+            || (hdr->n_entries < CACHE_MIN_ENTRIES)
+            || (hdr->n_entries & (hdr->n_entries - 1))
+            || ((unsigned long long)st.st_size < sizeof(*hdr)
+                + hdr->n_entries * sizeof(struct cache_entry)))) {
+        errno = EINVAL;
+        ret = -1;
+    }
+    return ret;
+}
+
+// Map the cache file open on fd, setting it up for at least n_entries
+// files if empty, and close fd.
+// Return NULL with errno set if it is not a cache file or out of memory.
+static mp4len_cache *cache_map(int fd, unsigned long long n_entries)
+{
+    struct cache_header hdr;
+    mp4len_cache *cache = NULL;
+    unsigned long long n = CACHE_MIN_ENTRIES;
+    int err;
+
+    while (n < n_entries) {
+        n *= 2;
+    }
+    if ((cache_header(fd, n, &hdr) == 0)
+        && ((cache = (mp4len_cache*)malloc(sizeof(mp4len_cache))) != NULL)) {
+        cache->map_len = sizeof(hdr)
+            + hdr.n_entries * sizeof(struct cache_entry);
+        cache->map = mmap(NULL, cache->map_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, fd, 0);
+        if (cache->map == MAP_FAILED) {
+            free(cache);
+            cache = NULL;
+        }
+        else {
+            cache->entries = (struct cache_entry*)((char*)cache->map
+                                                   + sizeof(hdr));
+            cache->mask = hdr.n_entries - 1;
+        }
+    }
+    err = errno;
+    close(fd);
+    errno = err;
+    return cache;
+}
+
+// Open the cache file at path, creating it with room for at least
+// n_entries files if it does not exist.
+// Return NULL with errno set if it cannot be opened, is not a cache file,
+// or out of memory.
+mp4len_cache *mp4len_cache_open(const char *path,
+                                unsigned long long n_entries)
+{
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+    return cache_map(fd, n_entries);
+}
+
+// Open the POSIX shared memory cache called name, creating it with room
+// for at least n_entries files if it does not exist.
+// Return NULL with errno set if it cannot be opened, is not a cache, or
+// out of memory.
+mp4len_cache *mp4len_cache_open_shm(const char *name,
+                                    unsigned long long n_entries)
+{
+    int fd;
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+    return cache_map(fd, n_entries);
+}
+
+// Unmap a cache.
+void mp4len_cache_close(mp4len_cache *cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+    munmap(cache->map, cache->map_len);
+    free(cache);
+}
+
+// Fill in *key for the file at path with a single statx().
+// Return 0 if successful, or -1 with errno set.
+int mp4len_key_path(const char *path, struct mp4len_key *key)
+{
+    struct statx stx;
+
+    if (statx(AT_FDCWD, path, 0,
+              STATX_INO | STATX_SIZE | STATX_MTIME | STATX_CTIME, &stx)) {
+        return -1;
+    }
+    key->dev = ((unsigned long long)stx.stx_dev_major << 32)
+        | stx.stx_dev_minor;
+    key->ino = stx.stx_ino;
+    key->size = stx.stx_size;
+    key->mtime_ns = stx.stx_mtime.tv_sec * 1000000000LL
+        + stx.stx_mtime.tv_nsec;
+    key->ctime_ns = stx.stx_ctime.tv_sec * 1000000000LL
+        + stx.stx_ctime.tv_nsec;
+    return 0;
+}
+
+// First entry to look at for a file.
+static unsigned long long cache_hash(const struct mp4len_key *key)
+{
+    unsigned long long h = key->dev * 0x9E3779B97F4A7C15ULL ^ key->ino;
+
+    // splitmix64 finalizer
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+    return h ^ (h >> 31);
+}
+
+// Look a file up in the cache.
+// Return MP4LEN_OK and fill in *res if it is there unchanged with a
+// result, the error code it failed with if it is there unchanged without
+// one, or MP4LEN_AGAIN, with res->hdr_off set if it is there changed.
+int mp4len_cache_lookup(mp4len_cache *cache, const struct mp4len_key *key,
+                        struct mp4len_result *res)
+{
+    unsigned long long idx = cache_hash(key), dev, ino, len_unit;
+    long long size, mtime_ns, ctime_ns, hdr_off;
+    unsigned int seq, unit_per_sec;
+    struct cache_entry *e;
+    int ret;
+
+    memset(res, 0, sizeof(*res));
+    for (int ii = 0; ii < CACHE_PROBES; ii++) {
+        e = &cache->entries[(idx + ii) & cache->mask];
+        seq = atomic_load_explicit(&e->seq, memory_order_acquire);
+        if (seq & 1) {
+            continue;
+        }
+        dev = atomic_load_explicit(&e->dev, memory_order_relaxed);
+        ino = atomic_load_explicit(&e->ino, memory_order_relaxed);
+        size = atomic_load_explicit(&e->size, memory_order_relaxed);
+        mtime_ns = atomic_load_explicit(&e->mtime_ns, memory_order_relaxed);
+        ctime_ns = atomic_load_explicit(&e->ctime_ns, memory_order_relaxed);
+        len_unit = atomic_load_explicit(&e->len_unit, memory_order_relaxed);
+        hdr_off = atomic_load_explicit(&e->hdr_off, memory_order_relaxed);
+        unit_per_sec = atomic_load_explicit(&e->unit_per_sec,
+                                            memory_order_relaxed);
+        ret = atomic_load_explicit(&e->ret, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&e->seq, memory_order_relaxed) != seq) {
+            continue;
+        }
+
+        if ((dev == 0) && (ino == 0)) {
+            return MP4LEN_AGAIN;
+        }
+        if ((dev != key->dev) || (ino != key->ino)) {
+            continue;
+        }
+        if ((size != key->size) || (mtime_ns != key->mtime_ns)
+            || (ctime_ns != key->ctime_ns)) {
+            // most likely still laid out the same
+            res->hdr_off = hdr_off;
+            return MP4LEN_AGAIN;
+        }
+        res->fsize = size;
+        if (ret != MP4LEN_OK) {
+            return ret;
+        }
+        res->unit_per_sec = unit_per_sec;
+        res->len_unit = len_unit;
+        // as the parser works it out, to print the same
+        res->len_sec = (double)len_unit / (float)unit_per_sec;
+        res->hdr_off = hdr_off;
+        return MP4LEN_OK;
+    }
+    return MP4LEN_AGAIN;
+}
+
+// Look a file up in the cache.
+// Return 1 and fill in *res if it is there unchanged with a result, or 0,
+// with res->hdr_off set if it is there changed.
+int mp4len_cache_get(mp4len_cache *cache, const struct mp4len_key *key,
+                     struct mp4len_result *res)
+{
+    int ret = mp4len_cache_lookup(cache, key, res);
+
+    if ((ret != MP4LEN_OK) && (ret != MP4LEN_AGAIN)) {
+        memset(res, 0, sizeof(*res));
+    }
+    return ret == MP4LEN_OK;
+}
+
+// Store an entry for a file in the cache.  Nothing is stored if another
+// process or thread is writing the same entry.
+static void cache_store(mp4len_cache *cache, const struct mp4len_key *key,
+                        int ret, unsigned int unit_per_sec,
+                        unsigned long long len_unit, long long hdr_off)
+{
+    unsigned long long idx = cache_hash(key), dev, ino;
+    struct cache_entry *e, *victim;
+    unsigned int seq;
+
+    victim = &cache->entries[idx & cache->mask];
+    for (int ii = 0; ii < CACHE_PROBES; ii++) {
+        e = &cache->entries[(idx + ii) & cache->mask];
+        dev = atomic_load_explicit(&e->dev, memory_order_relaxed);
+        ino = atomic_load_explicit(&e->ino, memory_order_relaxed);
+        if (((dev == key->dev) && (ino == key->ino))
+            || ((dev == 0) && (ino == 0))) {
+            victim = e;
+            break;
+        }
+    }
+
+    e = victim;
+    seq = atomic_load_explicit(&e->seq, memory_order_relaxed);
+    if ((seq & 1)
+        || !atomic_compare_exchange_strong_explicit(&e->seq, &seq, seq + 1,
+                                                    memory_order_relaxed,
+                                                    memory_order_relaxed)) {
+        return;
+    }
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&e->dev, key->dev, memory_order_relaxed);
+    atomic_store_explicit(&e->ino, key->ino, memory_order_relaxed);
+    atomic_store_explicit(&e->size, key->size, memory_order_relaxed);
+    atomic_store_explicit(&e->mtime_ns, key->mtime_ns, memory_order_relaxed);
+    atomic_store_explicit(&e->ctime_ns, key->ctime_ns, memory_order_relaxed);
+    atomic_store_explicit(&e->len_unit, len_unit, memory_order_relaxed);
+    atomic_store_explicit(&e->hdr_off, hdr_off, memory_order_relaxed);
+    atomic_store_explicit(&e->unit_per_sec, unit_per_sec,
+                          memory_order_relaxed);
+    atomic_store_explicit(&e->ret, ret, memory_order_relaxed);
+    atomic_store_explicit(&e->seq, seq + 2, memory_order_release);
+}
+
+// Store a file's result in the cache.
+void mp4len_cache_put(mp4len_cache *cache, const struct mp4len_key *key,
+                      const struct mp4len_result *res)
+{
+    cache_store(cache, key, MP4LEN_OK, (unsigned int)res->unit_per_sec,
+                res->len_unit, res->hdr_off);
+}
+
+// Return 1 if probing the same contents again would always fail with ret.
+int mp4len_error_lasting(int ret)
+{
+    switch (ret) {
+    case MP4LEN_ERR_TOO_SMALL:
+    case MP4LEN_ERR_NOT_MP4:
+    case MP4LEN_ERR_NO_HEADER:
+    case MP4LEN_ERR_TIMESCALE_READ:
+    case MP4LEN_ERR_DURATION_READ:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Store the error a file failed with in the cache, if it is lasting.
+void mp4len_cache_put_error(mp4len_cache *cache, const struct mp4len_key *key,
+                            int ret)
+{
+    if (mp4len_error_lasting(ret)) {
+        cache_store(cache, key, ret, 0, 0, 0);
+    }
+}
+
+// Probe the file at path unless the cache has it, storing what is probed.
+// Return MP4LEN_OK and fill in *res if successful, or an error code.
+int mp4len_probe_cached(mp4len_ctx *ctx, mp4len_cache *cache,
+                        const char *path, struct mp4len_result *res,
+                        int *hit)
+{
+    struct mp4len_key key;
+    int ret;
+
+    *hit = 0;
+    if ((cache == NULL) || mp4len_key_path(path, &key)) {
+        // open() reports what is wrong
+        return mp4len_probe_path(ctx, path, res);
+    }
+    ret = mp4len_cache_lookup(cache, &key, res);
+    if (ret != MP4LEN_AGAIN) {
+        *hit = 1;
+        return ret;
+    }
+    ret = mp4len_probe_path_hint(ctx, path, res->hdr_off, res);
+    if (ret == MP4LEN_OK) {
+        mp4len_cache_put(cache, &key, res);
+    }
+    else {
+        mp4len_cache_put_error(cache, &key, ret);
+    }
+    return ret;
+}
+
+// Probe the file at path.
+// Return MP4LEN_OK and fill in *res if successful, or an error code.
+int mp4len_probe_path(mp4len_ctx *ctx, const char *path,
+                      struct mp4len_result *res)
+{
+    return mp4len_probe_path_hint(ctx, path, 0, res);
+}
+
+// Probe the file at path, trying the header at hdr_off first.
+// Return MP4LEN_OK and fill in *res if successful, or an error code.
+int mp4len_probe_path_hint(mp4len_ctx *ctx, const char *path,
+                           long long hdr_off, struct mp4len_result *res)
+{
+    int fd, ret;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        ctx->err = errno;
+        memset(res, 0, sizeof(*res));
+        return MP4LEN_ERR_OPEN;
+    }
+    ret = mp4len_probe_fd_hint(ctx, fd, hdr_off, res);
+    close(fd);
+    return ret;
+}
+
+// Probe an open file, first reading the magic number and the "mvhd" box
+// where an earlier probe found it, along with its size and type, in two
+// reads.  The box is only taken if the magic number is still one the
+// parser knows, the box is whole and within the file, its version is known
+// and its time scale is not 0, otherwise the file is searched as usual.
+// Return MP4LEN_OK and fill in *res if successful, or an error code.
+int mp4len_probe_fd_hint(mp4len_ctx *ctx, int fd, long long hdr_off,
+                         struct mp4len_result *res)
+{
+    struct mp4len_parser *p = &ctx->parser;
+    unsigned char box[8 + MP4LEN_HDR_SIZE]; // size, type and fields
+    unsigned char magic[8];
+    struct stat st;
+    ssize_t n_read;
+    int end_pos;
+
+    // the magic number comes first, so no header is ever that early
+    if (hdr_off < 16) {
+        return mp4len_probe_fd(ctx, fd, res);
+    }
+    ctx->err = 0;
+    memset(res, 0, sizeof(*res));
+    if (fstat(fd, &st)) {
+        ctx->err = errno;
+        return MP4LEN_ERR_MAGIC_SEEK;
+    }
+    mp4len_parser_init(p, st.st_size);
+    if ((p->state == PARSE_DONE) || (hdr_off >= st.st_size)) {
+        return mp4len_probe_fd(ctx, fd, res);
+    }
+    // a file written over with something else may still have what looks
+    // like a box there
+    n_read = ctx_pread(ctx, fd, magic, sizeof(magic), p->want_off);
+    if ((n_read != sizeof(magic))
+        || (mp4len_parser_feed(p, magic, n_read) != MP4LEN_AGAIN)) {
+        return mp4len_probe_fd(ctx, fd, res);
+    }
+
+    n_read = ctx_pread(ctx, fd, box, sizeof(box), hdr_off - 8);
+    end_pos = (n_read > 8) && (box[8] == 1) ? 32 : 20;
+    if ((n_read >= 8 + end_pos) && (memcmp(box + 4, "mvhd", 4) == 0)
+        && (box[8] <= 1) && (be32(box) >= (unsigned long)(8 + end_pos))
+        && (hdr_off - 8 + (long long)be32(box) <= st.st_size)) {
+        parser_found(p, hdr_off);
+        if ((mp4len_parser_feed(p, box + 8, n_read - 8) == MP4LEN_OK)
+            && (p->unit_per_sec > 0)) {
+            mp4len_parser_result(p, res);
+            return MP4LEN_OK;
+        }
+    }
+    // moved, or not a box at all but the search found "mvhd" in media
+    return mp4len_probe_fd(ctx, fd, res);
+}
+
+// Probe an open file descriptor, driving the parser with blocking reads
+// into the context's buffer.  The file position is not used or changed.
+// Return MP4LEN_OK and fill in *res if successful, or an error code.
+int mp4len_probe_fd(mp4len_ctx *ctx, int fd, struct mp4len_result *res)
+{
+    struct mp4len_parser *p = &ctx->parser;
+    struct stat st;
+    long long off = 0, len = 0;
+    ssize_t buf_len;
+    int ret;
+
+    ctx->err = 0;
+    memset(res, 0, sizeof(*res));
+
+    // get file size
+    if (fstat(fd, &st)) {
+        ctx->err = errno;
+        return MP4LEN_ERR_MAGIC_SEEK;
+    }
+
+    mp4len_parser_init(p, st.st_size);
+    while ((ret = mp4len_parser_want(p, &off, &len)) == MP4LEN_AGAIN) {
+        // a scratch buffer smaller than a block just takes more reads
+        if ((len > 0) && ((size_t)len > ctx->buf_len)) {
+            len = ctx->buf_len;
+        }
+        buf_len = ctx_pread(ctx, fd, ctx->buf, len, off);
+        if (buf_len < 0) {
+            // reported by the parser as a short read
+            ctx->err = errno;
+            buf_len = 0;
+        }
+        mp4len_parser_feed(p, ctx->buf, buf_len);
+    }
+    mp4len_parser_result(p, res);
+    return ret;
+}
+
+// Find the segment holding file offset off.  Return a pointer to the byte at
+// off and set *avail to the number of contiguous bytes from there, or return
+// NULL if no segment covers off.
+static const unsigned char *seg_find(const struct mp4len_segment *segs,
+                                     int n_segs, long long off,
+                                     long long *avail)
+{
+    for (int ii = 0; ii < n_segs; ii++) {
+        if ((off >= segs[ii].offset)
+            && (off < segs[ii].offset + segs[ii].len)) {
+            *avail = segs[ii].offset + segs[ii].len - off;
+            return segs[ii].data + (off - segs[ii].offset);
+        }
+    }
+    return NULL;
+}
+
+// Probe a file held in memory as one or more segments of a file fsize bytes
+// long, driving the parser from the segments.
+// Return MP4LEN_OK and fill in *res if successful.
+// Return MP4LEN_AGAIN and set *need_off/*need_len if the segments do not
+// cover the bytes required.
+// Otherwise return an error code.
+int mp4len_probe_mem(const struct mp4len_segment *segs, int n_segs,
+                     long long fsize, struct mp4len_result *res,
+                     long long *need_off, long long *need_len)
+{
+    struct mp4len_parser p;
+    const unsigned char *src;
+    long long off = 0, len = 0, avail;
+    int ret;
+
+    mp4len_parser_init(&p, fsize);
+    while ((ret = mp4len_parser_want(&p, &off, &len)) == MP4LEN_AGAIN) {
+        src = seg_find(segs, n_segs, off, &avail);
+        if (src == NULL) {
+            *need_off = off;
+            *need_len = len;
+            return MP4LEN_AGAIN;
+        }
+        mp4len_parser_feed(&p, src, avail);
+    }
+    mp4len_parser_result(&p, res);
+    return ret;
+}
+
+// Following a file as it grows.  Top level boxes are walked from where the
+// last look stopped, each one's size taken from its header, so "mdat"
+// boxes are skipped without being read.  "moov" gives each track's time
+// scale and default sample duration, and each "moof" the samples added to
+// each track, so the duration is that of the track whose last sample ends
+// latest.  A box not yet wholly written is left for the next look.
+
+#define BOX(a, b, c, d) (((unsigned long)(a) << 24) \
+                         | ((unsigned long)(b) << 16) \
+                         | ((unsigned long)(c) << 8) | (unsigned long)(d))
+#define TRUN_ENTRY_MAX 16 // largest sample entry in a "trun"
+
+// Read len bytes at off into buf.
+// Return MP4LEN_OK, MP4LEN_AGAIN if the file ends first, or
+// MP4LEN_ERR_BLOCK_READ.
+static int read_full(mp4len_ctx *ctx, int fd, long long off,
+                     unsigned char *buf, size_t len)
+{
+    ssize_t n_read;
+
+    while (len > 0) {
+        n_read = ctx_pread(ctx, fd, buf, len, off);
+        if (n_read < 0) {
+            ctx->err = errno;
+            return MP4LEN_ERR_BLOCK_READ;
+        }
+        if (n_read == 0) {
+            return MP4LEN_AGAIN;
+        }
+        buf += n_read;
+        off += n_read;
+        len -= n_read;
+    }
+    return MP4LEN_OK;
+}
+
+// Read the header of the box at off, which must end by end, setting *type,
+// *body to the offset of its contents and *box_end to the offset after it.
+// Return MP4LEN_OK, MP4LEN_AGAIN if the box runs past end, or is still
+// being written, MP4LEN_ERR_NOT_MP4 if its size is impossible, or
+// MP4LEN_ERR_BLOCK_READ.
+static int box_at(mp4len_ctx *ctx, int fd, long long off, long long end,
+                  unsigned long *type, long long *body, long long *box_end)
+{
+    unsigned char hdr[16];
+    unsigned long long size;
+    int ret;
+
+    if (off + 8 > end) {
+        return MP4LEN_AGAIN;
+    }
+    ret = read_full(ctx, fd, off, hdr, 8);
+    if (ret) {
+        return ret;
+    }
+    size = be32(hdr);
+    *type = be32(hdr + 4);
+    *body = off + 8;
+    if (size == 0) {
+        // runs to the end of the file, wherever that ends up
+        return MP4LEN_AGAIN;
+    }
+    if (size == 1) {
+        // 64 bit size after the type
+        if (off + 16 > end) {
+            return MP4LEN_AGAIN;
+        }
+        ret = read_full(ctx, fd, off + 8, hdr + 8, 8);
+        if (ret) {
+            return ret;
+        }
+        size = be64(hdr + 8);
+        *body = off + 16;
+    }
+    if (size < (unsigned long long)(*body - off)) {
+        return MP4LEN_ERR_NOT_MP4;
+    }
+    if (size > (unsigned long long)(end - off)) {
+        return MP4LEN_AGAIN;
+    }
+    *box_end = off + (long long)size;
+    return MP4LEN_OK;
+}
+
+// Read the start of the full box whose contents run from body to box_end
+// into buf, v0_len bytes of it for version 0 or v1_len (no more than 32)
+// for version 1, and set *version.
+// Return MP4LEN_OK, MP4LEN_ERR_NOT_MP4 if the box is too short, or
+// MP4LEN_ERR_BLOCK_READ.
+static int full_box(mp4len_ctx *ctx, int fd, long long body,
+                    long long box_end, unsigned char *buf, int v0_len,
+                    int v1_len, int *version)
+{
+    long long len = box_end - body;
+    int ret;
+
+    len = (len > v1_len) ? v1_len : len;
+    if (len < 1) {
+        return MP4LEN_ERR_NOT_MP4;
+    }
+    ret = read_full(ctx, fd, body, buf, len);
+    if (ret) {
+        return (ret == MP4LEN_AGAIN) ? MP4LEN_ERR_NOT_MP4 : ret;
+    }
+    *version = buf[0];
+    return (len < ((*version == 1) ? v1_len : v0_len)) ? MP4LEN_ERR_NOT_MP4
+                                                         : MP4LEN_OK;
+}
+
+// Return the state of track id, adding it if new, or NULL if there are
+// already MP4LEN_FOLLOW_TRACKS others.
+static struct mp4len_follow_track *follow_track(struct mp4len_follow *f,
+                                                unsigned long id)
+{
+    struct mp4len_follow_track *t;
+
+    for (int ii = 0; ii < f->n_tracks; ii++) {
+        if (f->tracks[ii].id == id) {
+            return &f->tracks[ii];
+        }
+    }
+    if (f->n_tracks == MP4LEN_FOLLOW_TRACKS) {
+        return NULL;
+    }
+    t = &f->tracks[f->n_tracks++];
+    memset(t, 0, sizeof(*t));
+    t->id = id;
+    return t;
+}
+
+// Walk the boxes from off to end inside "moov", noting the movie header,
+// and each track's ID, time scale and default sample duration.  *track is
+// the track whose "trak" is being walked, or NULL.
+// Return MP4LEN_OK, or an error code.
+static int follow_moov(mp4len_ctx *ctx, struct mp4len_follow *f, int fd,
+                       long long off, long long end,
+                       struct mp4len_follow_track **track)
+{
+    struct mp4len_follow_track *t;
+    unsigned char buf[32];
+    unsigned long type;
+    long long body, box_end;
+    int ret = MP4LEN_OK, version;
+
+    for (; (ret == MP4LEN_OK) && (off < end); off = box_end) {
+        ret = box_at(ctx, fd, off, end, &type, &body, &box_end);
+        if (ret) {
+            // inside a whole box, so nothing is still to come
+            return (ret == MP4LEN_AGAIN) ? MP4LEN_ERR_NOT_MP4 : ret;
+        }
+        switch (type) {
+        case BOX('t', 'r', 'a', 'k'):
+            t = NULL;
+            ret = follow_moov(ctx, f, fd, body, box_end, &t);
+            break;
+        case BOX('m', 'v', 'e', 'x'):
+            f->fragmented = 1;
+            ret = follow_moov(ctx, f, fd, body, box_end, track);
+            break;
+        case BOX('m', 'd', 'i', 'a'):
+            ret = follow_moov(ctx, f, fd, body, box_end, track);
+            break;
+        case BOX('m', 'v', 'h', 'd'):
+            // as the parser reads it
+            ret = full_box(ctx, fd, body, box_end, buf, 20, 32, &version);
+            if (ret == MP4LEN_OK) {
+                f->unit_per_sec = be32(buf + ((version == 1) ? 20 : 12));
+                f->len_unit = (version == 1) ? be64(buf + 24) : be32(buf + 16);
+                f->hdr_off = body;
+            }
+            break;
+        case BOX('t', 'k', 'h', 'd'):
+            ret = full_box(ctx, fd, body, box_end, buf, 16, 24, &version);
+            if ((ret == MP4LEN_OK) && (track != NULL)) {
+                *track = follow_track(f, be32(buf + ((version == 1) ? 20
+                                                                     : 12)));
+            }
+            break;
+        case BOX('m', 'd', 'h', 'd'):
+            ret = full_box(ctx, fd, body, box_end, buf, 16, 24, &version);
+            if ((ret == MP4LEN_OK) && (track != NULL) && (*track != NULL)) {
+                (*track)->timescale = be32(buf + ((version == 1) ? 20 : 12));
+            }
+            break;
+        case BOX('t', 'r', 'e', 'x'):
+            ret = full_box(ctx, fd, body, box_end, buf, 16, 16, &version);
+            if ((ret == MP4LEN_OK) && ((t = follow_track(f, be32(buf + 4)))
+                                       != NULL)) {
+                t->default_dur = be32(buf + 12);
+            }
+            break;
+        }
+    }
+    return ret;
+}
+
+// Add up the sample durations of the "trun" box from body to box_end into
+// *sum, each being dflt unless given.
+// Return MP4LEN_OK, or an error code.
+static int follow_trun(mp4len_ctx *ctx, int fd, long long body,
+                       long long box_end, unsigned long dflt,
+                       unsigned long long *sum)
+{
+    unsigned char buf[TRUN_ENTRY_MAX], *samples = ctx->buf;
+    unsigned long flags, count;
+    long long off, entry, chunk, n;
+    int ret, version;
+
+    ret = full_box(ctx, fd, body, box_end, buf, 8, 8, &version);
+    if (ret) {
+        return ret;
+    }
+    flags = be32(buf) & 0xFFFFFF;
+    count = be32(buf + 4);
+    if (!(flags & 0x100)) {
+        // every sample takes the default
+        *sum += (unsigned long long)count * dflt;
+        return MP4LEN_OK;
+    }
+
+    // data offset and first sample flags, then the entries, each with
+    // whichever of duration (first), size, flags and composition offset
+    // are present
+    off = body + 8 + ((flags & 0x1) ? 4 : 0) + ((flags & 0x4) ? 4 : 0);
+    entry = 4 * (!!(flags & 0x100) + !!(flags & 0x200) + !!(flags & 0x400)
+                 + !!(flags & 0x800));
+    if (off + (long long)count * entry > box_end) {
+        return MP4LEN_ERR_NOT_MP4;
+    }
+    chunk = (long long)ctx->buf_len / entry;
+    if (chunk == 0) {
+        // a scratch buffer smaller than one entry
+        samples = buf;
+        chunk = 1;
+    }
+    while (count > 0) {
+        n = ((long long)count < chunk) ? (long long)count : chunk;
+        ret = read_full(ctx, fd, off, samples, n * entry);
+        if (ret) {
+            return (ret == MP4LEN_AGAIN) ? MP4LEN_ERR_NOT_MP4 : ret;
+        }
+        for (long long ii = 0; ii < n; ii++) {
+            *sum += be32(samples + ii * entry);
+        }
+        off += n * entry;
+        count -= n;
+    }
+    return MP4LEN_OK;
+}
+
+// Walk the "traf" box from off to end, moving its track's end on past the
+// samples it adds.
+// Return MP4LEN_OK, or an error code.
+static int follow_traf(mp4len_ctx *ctx, struct mp4len_follow *f, int fd,
+                       long long off, long long end)
+{
+    struct mp4len_follow_track *t = NULL;
+    unsigned char buf[24];
+    unsigned long type, flags, dflt = 0;
+    unsigned long long base = 0, sum = 0;
+    long long body, box_end, pos;
+    int ret = MP4LEN_OK, version, has_base = 0;
+
+    for (; (ret == MP4LEN_OK) && (off < end); off = box_end) {
+        ret = box_at(ctx, fd, off, end, &type, &body, &box_end);
+        if (ret) {
+            return (ret == MP4LEN_AGAIN) ? MP4LEN_ERR_NOT_MP4 : ret;
+        }
+        if (type == BOX('t', 'f', 'h', 'd')) {
+            // track ID, then whichever of base data offset, sample
+            // description index and default duration are present
+            ret = full_box(ctx, fd, body, box_end, buf, 8, 8, &version);
+            if (ret) {
+                return ret;
+            }
+            flags = be32(buf) & 0xFFFFFF;
+            t = follow_track(f, be32(buf + 4));
+            if (t == NULL) {
+                // a track beyond those followed
+                return MP4LEN_OK;
+            }
+            dflt = t->default_dur;
+            pos = 8 + ((flags & 0x1) ? 8 : 0) + ((flags & 0x2) ? 4 : 0);
+            if (flags & 0x8) {
+                ret = full_box(ctx, fd, body, box_end, buf, pos + 4, pos + 4,
+                               &version);
+                dflt = (ret == MP4LEN_OK) ? be32(buf + pos) : dflt;
+            }
+        }
+        else if (type == BOX('t', 'f', 'd', 't')) {
+            ret = full_box(ctx, fd, body, box_end, buf, 8, 12, &version);
+            if (ret == MP4LEN_OK) {
+                base = (version == 1) ? be64(buf + 4) : be32(buf + 4);
+                has_base = 1;
+            }
+        }
+        else if ((type == BOX('t', 'r', 'u', 'n')) && (t != NULL)) {
+            ret = follow_trun(ctx, fd, body, box_end, dflt, &sum);
+        }
+    }
+    if ((ret == MP4LEN_OK) && (t != NULL)) {
+        if (!t->begun) {
+            // a live capture joined midway starts well after zero
+            t->start = has_base ? base : t->end;
+            t->begun = 1;
+        }
+        t->end = (has_base ? base : t->end) + sum;
+    }
+    return ret;
+}
+
+// Walk the "moof" box from off to end, following each "traf" in it.
+// Return MP4LEN_OK, or an error code.
+static int follow_moof(mp4len_ctx *ctx, struct mp4len_follow *f, int fd,
+                       long long off, long long end)
+{
+    unsigned long type;
+    long long body, box_end;
+    int ret = MP4LEN_OK;
+
+    for (; (ret == MP4LEN_OK) && (off < end); off = box_end) {
+        ret = box_at(ctx, fd, off, end, &type, &body, &box_end);
+        if (ret) {
+            return (ret == MP4LEN_AGAIN) ? MP4LEN_ERR_NOT_MP4 : ret;
+        }
+        if (type == BOX('t', 'r', 'a', 'f')) {
+            ret = follow_traf(ctx, f, fd, body, box_end);
+        }
+    }
+    return ret;
+}
+
+// Reset following state for a new file.
+void mp4len_follow_init(struct mp4len_follow *f)
+{
+    memset(f, 0, sizeof(*f));
+}
+
+// Parse the whole top level boxes added to the file since the last call,
+// and fill in *res with the duration so far.
+// Return MP4LEN_OK, MP4LEN_AGAIN if no "moov" box has been written yet, or
+// an error code.
+int mp4len_follow_fd(mp4len_ctx *ctx, struct mp4len_follow *f, int fd,
+                     struct mp4len_result *res)
+{
+    const struct mp4len_follow_track *t, *best = NULL;
+    unsigned char magic[4];
+    unsigned long type;
+    long long body, box_end;
+    struct stat st;
+    int ret;
+
+    ctx->err = 0;
+    memset(res, 0, sizeof(*res));
+    if (fstat(fd, &st)) {
+        ctx->err = errno;
+        return MP4LEN_ERR_MAGIC_SEEK;
+    }
+    if (st.st_size < f->fsize) {
+        // written again from the start
+        mp4len_follow_init(f);
+    }
+    f->fsize = st.st_size;
+    res->fsize = st.st_size;
+    if (f->next_off == 0) {
+        // any brand, live recorders use many
+        ret = read_full(ctx, fd, 4, magic, 4);
+        if (ret) {
+            return (ret == MP4LEN_AGAIN) ? MP4LEN_AGAIN : MP4LEN_ERR_MAGIC_READ;
+        }
+        if (memcmp(magic, "ftyp", 4)) {
+            return MP4LEN_ERR_NOT_MP4;
+        }
+    }
+
+    while (f->next_off < f->fsize) {
+        ret = box_at(ctx, fd, f->next_off, f->fsize, &type, &body, &box_end);
+        if (ret == MP4LEN_AGAIN) {
+            break;
+        }
+        if ((ret == MP4LEN_OK) && (type == BOX('m', 'o', 'o', 'v'))) {
+            ret = follow_moov(ctx, f, fd, body, box_end, NULL);
+            f->have_moov = 1;
+        }
+        else if ((ret == MP4LEN_OK) && (type == BOX('m', 'o', 'o', 'f'))) {
+            ret = follow_moof(ctx, f, fd, body, box_end);
+            f->fragments += 1;
+        }
+        if (ret) {
+            return ret;
+        }
+        f->next_off = box_end;
+    }
+    if (!f->have_moov) {
+        return MP4LEN_AGAIN;
+    }
+
+    for (int ii = 0; ii < f->n_tracks; ii++) {
+        t = &f->tracks[ii];
+        if ((t->timescale > 0) && (t->end > t->start) && ((best == NULL)
+            || ((double)(t->end - t->start) / t->timescale
+                > (double)(best->end - best->start) / best->timescale))) {
+            best = t;
+        }
+    }
+    if (f->fragmented && (best != NULL)) {
+        res->unit_per_sec = best->timescale;
+        res->len_unit = best->end - best->start;
+    }
+    else {
+        res->unit_per_sec = f->unit_per_sec;
+        res->len_unit = f->len_unit;
+    }
+    if (res->unit_per_sec > 0) {
+        res->len_sec = (double)res->len_unit / (float)res->unit_per_sec;
+    }
+    res->hdr_off = f->hdr_off;
+    return MP4LEN_OK;
+}
+
+// Message for a result code.
+const char *mp4len_strerror(int code)
+{
+    switch (code) {
+    case MP4LEN_AGAIN:
+        return "more data needed";
+    case MP4LEN_OK:
+        return "success";
+    case MP4LEN_ERR_USAGE:
+        return "missing argument";
+    case MP4LEN_ERR_OPEN:
+        return "no such file";
+    case MP4LEN_ERR_TOO_SMALL:
+        return "file size too small";
+    case MP4LEN_ERR_NOT_MP4:
+        return "MP4 file format not valid";
+    case MP4LEN_ERR_SOME_FAILED:
+        return "one or more files failed";
+    case MP4LEN_ERR_NOT_INDEXED:
+        return "not in index";
+    case MP4LEN_ERR_TIMEOUT:
+        return "timed out";
+    case MP4LEN_ERR_MAGIC_SEEK:
+    case MP4LEN_ERR_BLOCK_SEEK_END:
+    case MP4LEN_ERR_BLOCK_SEEK:
+    case MP4LEN_ERR_HEADER_SEEK:
+    case MP4LEN_ERR_VERSION_SEEK:
+    case MP4LEN_ERR_DATE_SEEK:
+        return "problem accessing file";
+    case MP4LEN_ERR_MAGIC_READ:
+    case MP4LEN_ERR_BLOCK_READ:
+    case MP4LEN_ERR_TIMESCALE_READ:
+    case MP4LEN_ERR_DURATION_READ:
+        return "problem reading file";
+    case MP4LEN_ERR_NOMEM:
+        return "could not allocate memory";
+    case MP4LEN_ERR_NO_HEADER:
+        return "could not find header";
+    }
+    return "unknown error";
+}
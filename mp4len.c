@@ -1,9 +1,20 @@
 /* mp4len
-   Takes an MP4 file in as a command line argument and returns the time
-   duration of the video in seconds.
+   Takes MP4 files in as command line arguments and returns the time
+   duration of each video in seconds.
 
    Usage:
-   mp4len VIDEO_FILE
+   mp4len [OPTION...] VIDEO_FILE [VIDEO_FILE...]
+   mp4len -r [OPTION...] DIRECTORY [DIRECTORY...]
+   mp4len -r --checkpoint=FILE [--resume] [OPTION...] DIRECTORY [DIRECTORY...]
+   mp4len --files-from=LIST [-0] [OPTION...]
+   mp4len --serve-stdio [--ids] [-0] [OPTION...]
+   mp4len --serve-socket=SOCKET [-j JOBS] [--window=N]
+   mp4len --client=SOCKET VIDEO_FILE [VIDEO_FILE...]
+   mp4len --follow[=SECS] VIDEO_FILE [VIDEO_FILE...]
+   mp4len --index=INDEX --index-build [OPTION...] DIRECTORY [DIRECTORY...]
+   mp4len --index=INDEX --index-query VIDEO_FILE [VIDEO_FILE...]
+   mp4len --index=INDEX --index-watch [OPTION...] DIRECTORY [DIRECTORY...]
+   mp4len --index=INDEX --index-merge PART_INDEX [PART_INDEX...]
 
    Nicholas A. Masluk
    nick@randombytes.net
@@ -11,284 +22,1360 @@
    Mozilla Public License Version 2.0
 */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <time.h>
+#include <unistd.h>
 
-#define VERSION "2023-09-05"
-#define MIN_SIZE 51 // minimum file size
-#define BLOCK_SIZE 16384 // number of bytes to read from file at once
-
-// Make sure the file contains an MP4 magic number at offset of 4 bytes:
-//   "ftypisom" for ISO base media file MPEG-4, MP4
-//   66 74 79 70 69 73 6F 6D
-//
-//   "ftypmp42" for QuickTime MPEG-4, M4V
-//   66 74 79 70 6D 70 34 32
-//
-// Return 0 for not mp4
-// Return 1 for is mp4
-int has_mp4_magic(FILE *fptr)
+#include "agg.h"
+#include "batch.h"
+#include "checkpoint.h"
+#include "index.h"
+#include "mp4len.h"
+#include "serve.h"
+#include "walk.h"
+#include "watch.h"
+
+#define DEFAULT_EXTS "mp4,m4v" // files looked at in directories by default
+#define DEFAULT_CACHE_SIZE (1ULL << 22) // files a new cache file holds
+#define DEFAULT_FOLLOW 2.0 // seconds between looks at growing files
+
+// Command line settings
+struct options {
+    const char *prog;
+    int jobs; // worker threads, 0 for default
+    int recursive; // walk directories given
+    int filtered; // --ext or --include given
+    const char *files_from; // file listing paths, "-" for standard input
+    int null_sep; // paths in list end with '\0' rather than newline
+    int order; // BATCH_ORDER_*
+    size_t window; // reorder window, 0 for default
+    int stats; // print statistics at the end
+    int schedule; // BATCH_SCHED_*
+    struct batch_dev_limit *dev_limits; // --device-jobs for given paths
+    size_t n_dev_limits;
+    int dev_default; // --device-jobs for other devices, 0 if not given
+    int aggregate; // print totals instead of each file
+    int serve; // flush each result as it is printed
+    int ids; // listed paths follow an ID and a tab, echoed back instead
+    int order_set; // --order given
+    const char *serve_socket; // socket to answer requests on
+    const char *client; // socket to send requests to
+    int multi; // more than one file, for the client
+    unsigned long long failed; // files that failed, for the client
+    int single_ret; // error code of the one file, for the client
+    const char *cache_path; // results cache file
+    const char *cache_shm; // results cache shared memory name
+    unsigned long long cache_size; // files a new cache file holds
+    mp4len_cache *cache;
+    int recheck; // probe files found in the cache again at their header
+    double follow; // seconds between looks at growing files, or 0
+    double timeout; // seconds a file may take to probe, or 0
+    double hedge; // probe time quantile to probe again past, or 0
+    double fault_delay; // seconds to hold up reads by, for testing
+    double fault_rate; // share of reads held up
+    const char *index_file; // index to build or query
+    int index_build; // probe into a new index rather than printing
+    int index_query; // answer from the index rather than probing
+    int index_watch; // keep the index up to date with changes
+    int index_merge; // merge the indexes given into the index
+    unsigned int shard; // of n_shards, from 1, this process probes
+    unsigned int n_shards; // 0 to probe every file
+    const char *checkpoint_file; // progress is recorded to
+    int resume; // pass over the files finished in the checkpoint
+    struct checkpoint *checkpoint; // open while probing
+    size_t resumed; // files finished before resuming
+    struct index_build ib;
+    struct index *index; // open while querying
+    char cwd[PATH_MAX]; // relative paths are queried or sharded from here
+    struct agg agg;
+    struct walk_filter filter;
+    unsigned long long skipped; // files the walk filter passed over
+    char **roots; // directories to walk together once all are given
+    int n_roots;
+    int roots_cap;
+    struct batch *batch;
+};
+
+static void usage(const char *prog)
 {
-    union {
-        unsigned long long ull;
-        char c[8];
-    } magic;
-
-    // read in 8 bytes where the magic number should be
-    if (fseek(fptr, 4L, SEEK_SET)) {
-        fputs("Problem accessing file\n", stderr);
-        exit(10);
-    }
-    if (fread(magic.c, 1, 8, fptr) != 8) {
-        // we did not complete a full read
-        fputs("Problem reading file\n", stderr);
-        exit(11);
-    }
-
-    // At this point our char array is essentially a long long, and
-    // x86 is little endian so our magic number looks like
-    // 6D 6F 73 69 70 79 74 66 for ISO base media file MPEG-4
-    // 32 34 70 6D 70 79 74 66 for QuickTime MPEG-4
-
-    // check magic number
-    if (   (magic.ull == 0x6D6F736970797466LL)
-        || (magic.ull == 0x3234706D70797466LL)) {
-        // mp4 magic number is present
-        return 1;
+    fputs("\n", stderr);
+    fputs("Prints the length of mp4 videos in seconds.\n", stderr);
+    fprintf(stderr, "Usage: %s [OPTION...] VIDEO_FILE [VIDEO_FILE...]\n",
+            prog);
+    fprintf(stderr, "       %s -r [OPTION...] DIRECTORY [DIRECTORY...]\n",
+            prog);
+    fprintf(stderr, "       %s -r --checkpoint=FILE [--resume] [OPTION...] "
+            "DIRECTORY [DIRECTORY...]\n", prog);
+    fprintf(stderr, "       %s --files-from=LIST [-0] [OPTION...]\n", prog);
+    fprintf(stderr, "       %s --serve-stdio [--ids] [-0] [OPTION...]\n",
+            prog);
+    fprintf(stderr, "       %s --serve-socket=SOCKET [-j JOBS] [--window=N]\n",
+            prog);
+    fprintf(stderr, "       %s --client=SOCKET VIDEO_FILE [VIDEO_FILE...]\n",
+            prog);
+    fprintf(stderr, "       %s --follow[=SECS] VIDEO_FILE [VIDEO_FILE...]\n",
+            prog);
+    fprintf(stderr, "       %s --index=INDEX --index-build [OPTION...] "
+            "DIRECTORY [DIRECTORY...]\n", prog);
+    fprintf(stderr, "       %s --index=INDEX --index-query VIDEO_FILE "
+            "[VIDEO_FILE...]\n", prog);
+    fprintf(stderr, "       %s --index=INDEX --index-watch [OPTION...] "
+            "DIRECTORY [DIRECTORY...]\n", prog);
+    fprintf(stderr, "       %s --index=INDEX --index-merge PART_INDEX "
+            "[PART_INDEX...]\n", prog);
+    fputs("  -j, --jobs=JOBS     probe JOBS files at once\n", stderr);
+    fputs("  -r, --recursive     probe files in directories and below\n",
+          stderr);
+    fputs("  --ext=EXT[,EXT...]  only probe files in directories with these\n"
+          "                      extensions (default "DEFAULT_EXTS")\n",
+          stderr);
+    fputs("  --include=GLOB      only probe files in directories with names\n"
+          "                      matching GLOB, may be repeated\n", stderr);
+    fputs("  --min-size=BYTES    only probe files in directories at least\n"
+          "                      BYTES long\n", stderr);
+    fputs("  --files-from=LIST   also probe each path listed in file LIST,\n"
+          "                      one per line, or standard input for -\n",
+          stderr);
+    fputs("  -0, --null          paths in LIST end with a null character\n",
+          stderr);
+    fputs("  --order=ORDER       print results in input order (default), or\n"
+          "                      in completion order as soon as each is done\n",
+          stderr);
+    fputs("  --window=N          hold at most N files in flight or waiting\n"
+          "                      to be printed in input order\n", stderr);
+    fputs("  --stats             print statistics to standard error at the\n"
+          "                      end\n", stderr);
+    fputs("  --schedule=SCHED    probe files one by one in input order\n"
+          "                      (fifo, default), or in groups reading in\n"
+          "                      order of place on disk (physical)\n", stderr);
+    fputs("  --device-jobs=[PATH=]N\n"
+          "                      probe at most N files at once on the device\n"
+          "                      holding PATH, or every other device, may be\n"
+          "                      repeated; N may be auto to tune it from\n"
+          "                      probe times\n", stderr);
+    fputs("  --aggregate         print the count, total, minimum, maximum, mean\n"
+          "                      and percentiles of lengths instead of each\n"
+          "                      file\n", stderr);
+    fputs("  --serve-stdio       probe each path read from standard input,\n"
+          "                      printing each result as soon as it is in\n"
+          "                      order\n", stderr);
+    fputs("  --ids               each listed path follows an ID and a tab, and\n"
+          "                      results give the ID in place of the path,\n"
+          "                      in completion order unless --order is given\n",
+          stderr);
+    fputs("  --serve-socket=SOCKET\n"
+          "                      answer requests on Unix socket SOCKET until\n"
+          "                      interrupted or terminated\n", stderr);
+    fputs("  --client=SOCKET     have the server on SOCKET probe the files\n",
+          stderr);
+    fputs("  --cache-path=FILE   look files up in cache FILE before probing,\n"
+          "                      and keep what is probed there\n", stderr);
+    fputs("  --cache-shm=NAME    use the cache in POSIX shared memory NAME,\n"
+          "                      shared by every process on the host\n",
+          stderr);
+    fputs("  --cache-size=N      make a new cache FILE hold N files (default\n"
+          "                      4194304)\n", stderr);
+    fputs("  --recheck           probe files found in the cache again, reading\n"
+          "                      just the header where it was found before\n",
+          stderr);
+    fputs("  --timeout=SECS      give up on a file still being probed after\n"
+          "                      SECS seconds, as error 7\n", stderr);
+    fputs("  --hedge=QUANTILE    probe a file again on another thread once it\n"
+          "                      takes longer than QUANTILE (such as 0.95) of\n"
+          "                      recent files, taking whichever finishes first\n",
+          stderr);
+    fputs("  --fault-delay=SECS[,SHARE]\n"
+          "                      hold up a random SHARE (default 1) of reads\n"
+          "                      by SECS seconds, to test the above\n", stderr);
+    fputs("  --follow[=SECS]     look at files still being written every SECS\n"
+          "                      seconds (default 2), printing each length\n"
+          "                      as it grows, until interrupted\n", stderr);
+    fputs("  --index=INDEX       index file to build or query\n", stderr);
+    fputs("  --index-build       probe the files and directories into INDEX,\n"
+          "                      replacing it, instead of printing them\n",
+          stderr);
+    fputs("  --index-query       print lengths from INDEX without reading the\n"
+          "                      files\n", stderr);
+    fputs("  --index-watch       keep INDEX up to date with files changed in the\n"
+          "                      directories until interrupted or terminated\n",
+          stderr);
+    fputs("  --index-merge       merge the PART_INDEX files into INDEX,\n"
+          "                      replacing it\n", stderr);
+    fputs("  --shard=I/N         probe only the files falling in share I of N,\n"
+          "                      by path, or by directory for files found\n"
+          "                      in directories\n", stderr);
+    fputs("  --checkpoint=FILE   record the files finished in FILE every\n"
+          "                      second, to resume from if stopped\n", stderr);
+    fputs("  --resume            carry on from the checkpoint, passing over\n"
+          "                      the files it has finished\n", stderr);
+    fputs("mp4len version "MP4LEN_VERSION"\n", stderr);
+    fputs("Copyright (C) 2023 Nicholas A. Masluk, nick@randombytes.net\n",
+          stderr);
+}
+
+// Print the error, if any, from probing one file to standard error.
+static void report_error(const char *prog, const char *path, int ret,
+                         const struct mp4len_result *res)
+{
+    if (ret == MP4LEN_ERR_TOO_SMALL) {
+        fprintf(stderr, "%s: %s: file size too small, %lld bytes\n",
+                prog, path, res->fsize);
+    }
+    else if (ret) {
+        fprintf(stderr, "%s: %s: %s\n", prog, path, mp4len_strerror(ret));
     }
-    // not a valid mp4 file
-    return 0;
 }
 
-// Move file position to just after mvhd header.
-// Return 0 if successful.
-// Return 1 if header could not be found.
-int move_to_header(FILE *fptr, long long fsize)
+// Print "name<TAB>length", or "name<TAB>error CODE" for a file that failed.
+static void report_line(const char *name, int ret,
+                        const struct mp4len_result *res)
 {
-    char *buf;
-    long n_blocks;
-
-    buf = (char*)malloc(BLOCK_SIZE * sizeof(char));
-    if (buf == NULL) {
-        fputs("Could not allocate memory.\n", stderr);
-        exit(20);
-    }
-
-    // number of blocks to cover file
-    n_blocks = fsize / BLOCK_SIZE;
-    if (fsize % BLOCK_SIZE > 0) {
-        n_blocks += 1;
-    }
-
-    // Search file for "mvhd" header atom string in blocks.  Since header will
-    // be at the beginning or end of the file, we will search alternately in
-    // both directions.  Even iterations at beginning of file, odd at end, and
-    // work our way inwards.
-    int buf_len;
-    unsigned long ii;
-    for (unsigned long xx = 0; xx < n_blocks; xx++) {
-        // move file position to start of current block
-        if (xx % 2) {
-            // odd iteration, work at end of file
-            ii = n_blocks - 1 - (xx - 1) / 2;
-            if (fseek(fptr, (ii - n_blocks) * BLOCK_SIZE, SEEK_END)) {
-                fputs("Problem accessing file\n", stderr);
-                exit(21);
-            }
+    if (ret == 0) {
+        printf("%s\t%f\n", name, res->len_sec);
+    }
+    else {
+        printf("%s\terror %d\n", name, ret);
+    }
+}
+
+// Report the result of probing one file.  A single file prints just its
+// length, more than one prints "path<TAB>length" lines, or
+// "path<TAB>error CODE" lines for files that failed.
+static void report(const char *prog, const char *path, int ret,
+                   const struct mp4len_result *res, int multi)
+{
+    report_error(prog, path, ret, res);
+    if (!multi) {
+        if (ret == 0) {
+            printf("%f\n", res->len_sec);
+        }
+    }
+    else {
+        report_line(path, ret, res);
+    }
+}
+
+// Note a finished file in the checkpoint, writing it out every so often
+// after what has been printed has reached the disk, so that a file in the
+// checkpoint has always been printed.
+static void checkpoint_job(const struct options *opt,
+                           const struct batch_job *job)
+{
+    if (checkpoint_add(opt->checkpoint, job->path,
+                       job->keyed ? &job->key : NULL, job->ret, &job->res)) {
+        fprintf(stderr, "%s: %s: %s\n", opt->prog, opt->checkpoint_file,
+                mp4len_strerror(MP4LEN_ERR_NOMEM));
+    }
+    if (checkpoint_due(opt->checkpoint)) {
+        // fails harmlessly for pipes and terminals
+        fflush(stdout);
+        fdatasync(STDOUT_FILENO);
+        if (checkpoint_write(opt->checkpoint)) {
+            fprintf(stderr, "%s: %s: %s\n", opt->prog, opt->checkpoint_file,
+                    strerror(errno));
+        }
+    }
+}
+
+// Batch callback, report each file as it comes out, or just add it to the
+// totals with --aggregate.  A job with an ID reports under its ID.
+static void emit_report(void *arg, const struct batch_job *job)
+{
+    struct options *opt = (struct options*)arg;
+
+    if (opt->index_build) {
+        report_error(opt->prog, job->path, job->ret, &job->res);
+        if (index_build_add(&opt->ib, job->path,
+                            job->keyed ? &job->key : NULL, job->ret,
+                            &job->res)) {
+            fprintf(stderr, "%s: %s: %s\n", opt->prog, job->path,
+                    mp4len_strerror(MP4LEN_ERR_NOMEM));
+        }
+    }
+    else if (!opt->aggregate && (job->arg != NULL)) {
+        report_error(opt->prog, job->path, job->ret, &job->res);
+        report_line((const char*)job->arg, job->ret, &job->res);
+    }
+    else if (!opt->aggregate) {
+        report(opt->prog, job->path, job->ret, &job->res, 1);
+    }
+    else if (job->ret) {
+        report_error(opt->prog, job->path, job->ret, &job->res);
+    }
+    else {
+        agg_add(&opt->agg, job->res.len_sec);
+    }
+    free(job->arg);
+    if (opt->serve) {
+        // the other end is waiting for it
+        fflush(stdout);
+    }
+    if (opt->checkpoint != NULL) {
+        checkpoint_job(opt, job);
+    }
+}
+
+// Print the --aggregate totals, the number of files that failed included.
+static void print_aggregate(const struct agg *agg, unsigned long long failed)
+{
+    printf("count\t%llu\n", agg->count);
+    printf("failed\t%llu\n", failed);
+    printf("total\t%f\n", agg->sum);
+    printf("min\t%f\n", agg->min);
+    printf("max\t%f\n", agg->max);
+    printf("mean\t%f\n", agg->count ? agg->sum / agg->count : 0);
+    printf("p50\t%f\n", agg_quantile(agg, 0.50));
+    printf("p90\t%f\n", agg_quantile(agg, 0.90));
+    printf("p99\t%f\n", agg_quantile(agg, 0.99));
+}
+
+// Batch callback for a single file, keep its result to report.
+static void emit_single(void *arg, const struct batch_job *job)
+{
+    struct batch_job *out = (struct batch_job*)arg;
+
+    out->ret = job->ret;
+    out->res = job->res;
+}
+
+// Probe a single file in a batch of one, for the watchdog that comes with
+// a batch to enforce --timeout.
+static int run_single_batch(const struct options *opt, const char *path)
+{
+    struct batch_opts bopt = {0};
+    struct batch_job out = {0};
+    struct batch *b;
+
+    bopt.jobs = 1;
+    bopt.cache = opt->cache;
+    bopt.recheck = opt->recheck;
+    bopt.timeout = opt->timeout;
+    bopt.fault_delay = opt->fault_delay;
+    bopt.fault_rate = opt->fault_rate;
+    bopt.emit = emit_single;
+    bopt.emit_arg = &out;
+    b = batch_start(&bopt);
+    if ((b == NULL) || batch_submit(b, path, NULL)) {
+        out.ret = MP4LEN_ERR_NOMEM;
+    }
+    if (b != NULL) {
+        batch_finish(b, NULL);
+    }
+    report(opt->prog, path, out.ret, &out.res, 0);
+    return out.ret;
+}
+
+// Probe a single file, exiting with its own error code.
+static int run_single(const struct options *opt, const char *path)
+{
+    mp4len_ctx *ctx;
+    struct mp4len_result res;
+    struct mp4len_key key;
+    int ret, hit;
+
+    if ((opt->timeout > 0) || (opt->fault_delay > 0)) {
+        return run_single_batch(opt, path);
+    }
+    ctx = mp4len_ctx_new();
+    if (ctx == NULL) {
+        fprintf(stderr, "%s: %s\n", opt->prog,
+                mp4len_strerror(MP4LEN_ERR_NOMEM));
+        return MP4LEN_ERR_NOMEM;
+    }
+    if (opt->recheck && (opt->cache != NULL)
+        && (mp4len_key_path(path, &key) == 0)) {
+        // where the header was, whether or not the file has changed
+        mp4len_cache_get(opt->cache, &key, &res);
+        ret = mp4len_probe_path_hint(ctx, path, res.hdr_off, &res);
+        if (ret == MP4LEN_OK) {
+            mp4len_cache_put(opt->cache, &key, &res);
         }
         else {
-            // even iteration, work at beginning of file
-            ii = xx / 2;
-            if (fseek(fptr, ii * BLOCK_SIZE, SEEK_SET)) {
-                fputs("Problem accessing file\n", stderr);
-                exit(22);
-            }
+            mp4len_cache_put_error(opt->cache, &key, ret);
         }
+    }
+    else {
+        ret = mp4len_probe_cached(ctx, opt->cache, path, &res, &hit);
+    }
+    mp4len_ctx_free(ctx);
+    report(opt->prog, path, ret, &res, 0);
+    return ret;
+}
 
-        // read in block
-        buf_len = fread(buf, 1, BLOCK_SIZE, fptr);
-        if ((buf_len < BLOCK_SIZE) && (buf_len < fsize)) {
-            // we did not complete a full read
-            fputs("Problem reading file\n", stderr);
-            exit(23);
-        }
-
-        // search the block for header
-        char hdr[4] = {'m', 'v', 'h', 'd'}; // header to find
-        int chars_matching = 0; // streak of characters matching header
-        for (int jj = 0; jj < buf_len; jj++) {
-            if (buf[jj] == hdr[chars_matching]) {
-                chars_matching += 1;
-                if (chars_matching == 4) {
-                    // we found 'mvhd', move file position right after it
-                    if (fseek(fptr, -buf_len + jj + 1, SEEK_CUR)) {
-                        fputs("Problem accessing file\n", stderr);
-                        exit(24);
-                    }
-                    free(buf);
-                    return 0;
-                }
+// Client callback, report each reply.
+static void client_report(void *arg, const char *path, int ret,
+                          const struct mp4len_result *res)
+{
+    struct options *opt = (struct options*)arg;
+
+    report(opt->prog, path, ret, res, opt->multi);
+    if (ret) {
+        opt->failed += 1;
+        opt->single_ret = ret;
+    }
+}
+
+// Have the server probe the files, exiting as if they had been probed here.
+static int run_client(struct options *opt, char **paths, int n_paths)
+{
+    int ret;
+
+    opt->multi = (n_paths > 1);
+    ret = serve_client(opt->prog, opt->client, paths, n_paths,
+                       client_report, opt);
+    if (ret) {
+        return ret;
+    }
+    if (!opt->multi) {
+        return opt->single_ret;
+    }
+    return (opt->failed > 0) ? MP4LEN_ERR_SOME_FAILED : 0;
+}
+
+// A file being followed.
+struct follow_file {
+    int fd; // -1 once it has failed
+    int ret; // result last printed, MP4LEN_AGAIN for none yet
+    unsigned long long len_unit; // length last printed
+    struct mp4len_follow state;
+};
+
+// Look at each file every opt->follow seconds, parsing only what has been
+// added since, and print its length whenever it changes.  Runs until
+// interrupted, or every file has failed.
+// Return the error code of the one file, or MP4LEN_ERR_SOME_FAILED.
+static int run_follow(const struct options *opt, char **paths, int n_paths)
+{
+    struct follow_file *files, *f;
+    struct mp4len_result res;
+    struct timespec ts;
+    mp4len_ctx *ctx;
+    int multi = (n_paths > 1), n_open = n_paths, ret;
+
+    ctx = mp4len_ctx_new();
+    files = (struct follow_file*)calloc(n_paths, sizeof(struct follow_file));
+    if ((ctx == NULL) || (files == NULL)) {
+        fprintf(stderr, "%s: %s\n", opt->prog,
+                mp4len_strerror(MP4LEN_ERR_NOMEM));
+        mp4len_ctx_free(ctx);
+        free(files);
+        return MP4LEN_ERR_NOMEM;
+    }
+    ts.tv_sec = (time_t)opt->follow;
+    ts.tv_nsec = (long)((opt->follow - ts.tv_sec) * 1e9);
+
+    for (int ii = 0; ii < n_paths; ii++) {
+        f = &files[ii];
+        mp4len_follow_init(&f->state);
+        f->ret = MP4LEN_AGAIN;
+        f->fd = open(paths[ii], O_RDONLY | O_CLOEXEC);
+        if (f->fd < 0) {
+            memset(&res, 0, sizeof(res));
+            report(opt->prog, paths[ii], MP4LEN_ERR_OPEN, &res, multi);
+            f->ret = MP4LEN_ERR_OPEN;
+            n_open -= 1;
+        }
+    }
+    fflush(stdout);
+    while (n_open > 0) {
+        for (int ii = 0; ii < n_paths; ii++) {
+            f = &files[ii];
+            if (f->fd < 0) {
+                continue;
             }
-            else {
-                // no match
-                chars_matching = 0;
+            ret = mp4len_follow_fd(ctx, &f->state, f->fd, &res);
+            if ((ret == MP4LEN_AGAIN)
+                || ((ret == f->ret) && (res.len_unit == f->len_unit))) {
+                continue;
             }
-        }
-
-        if (chars_matching > 0) {
-            // we might have a match that flows into neighboring block
-            // check remaining characters
-            while ((chars_matching != 0) && (chars_matching != 4)) {
-                if (fgetc(fptr) == hdr[chars_matching]) {
-                    chars_matching += 1;
-                }
-                else {
-                    chars_matching = 0;
-                    break;
-                }
-                // If chars_matching == 4 at this point, loop will end with
-                // fptr indexed right after the header.
+            report(opt->prog, paths[ii], ret, &res, multi);
+            f->ret = ret;
+            f->len_unit = res.len_unit;
+            if (ret) {
+                close(f->fd);
+                f->fd = -1;
+                n_open -= 1;
             }
         }
-        if (chars_matching == 4) {
-            // we found the header, and fptr is indexed right after it
-            free(buf);
-            return 0;
+        fflush(stdout);
+        if (n_open > 0) {
+            nanosleep(&ts, NULL);
         }
-        // no match, try next block
     }
-    // no match found in file
-    free(buf);
-    return 1;
+
+    ret = multi ? MP4LEN_ERR_SOME_FAILED : files[0].ret;
+    mp4len_ctx_free(ctx);
+    free(files);
+    return ret;
 }
 
-// Get the time duration of video file in seconds.
-double get_mp4_len(FILE *fptr, long long fsize) 
+// Print batch statistics to standard error.
+static void print_stats(const struct batch_stats *st)
 {
-    int version;
-    unsigned char buf[8];
-    unsigned long unit_per_sec = 0; // units per second
-    unsigned long long len_unit = 0; // time length in units
-    double len_sec; // time length in seconds
+    double elapsed = (st->elapsed > 0) ? st->elapsed : 1e-9;
 
-    // move file positon to just after movie header atom "mvhd"
-    if (move_to_header(fptr, fsize)) {
-        fputs("Could not find header.\n", stderr);
-        exit(30);
+    fprintf(stderr, "files: %llu\n", st->files);
+    fprintf(stderr, "failed: %llu\n", st->failed);
+    fprintf(stderr, "elapsed: %.3f s\n", st->elapsed);
+    fprintf(stderr, "files per second: %.1f\n", st->files / elapsed);
+    fprintf(stderr, "reorder window: %zu\n", st->window);
+    fprintf(stderr, "reorder held files: %llu\n", st->held_jobs);
+    fprintf(stderr, "reorder occupancy mean: %.2f\n",
+            st->held_time / elapsed);
+    fprintf(stderr, "reorder occupancy max: %zu\n", st->held_max);
+    fprintf(stderr, "input stalls: %llu\n", st->stalls);
+    fprintf(stderr, "input stall time: %.3f s\n", st->stall_time);
+    for (int ii = 0; ii < st->n_devs; ii++) {
+        fprintf(stderr, "device %u:%u: %llu files, %.3f ms each, ",
+                major(st->dev[ii].dev), minor(st->dev[ii].dev),
+                st->dev[ii].files, st->dev[ii].latency * 1000);
+        if (st->dev[ii].limit == 0) {
+            fputs("no limit\n", stderr);
+        }
+        else if (st->dev[ii].tuned) {
+            fprintf(stderr, "limit %d (auto, up to %d)\n", st->dev[ii].limit,
+                    st->dev[ii].limit_max);
+        }
+        else {
+            fprintf(stderr, "limit %d\n", st->dev[ii].limit);
+        }
+    }
+    if (st->cache_lookups > 0) {
+        fprintf(stderr, "cache hits: %llu of %llu (%.1f%%)\n",
+                st->cache_hits, st->cache_lookups,
+                100.0 * st->cache_hits / st->cache_lookups);
+        fprintf(stderr, "cache hits on failed files: %llu\n",
+                st->cache_negative);
+        fprintf(stderr, "probed at a remembered header: %llu\n",
+                st->hinted);
     }
+    if ((st->timeouts > 0) || (st->replaced > 0)) {
+        fprintf(stderr, "timed out: %llu\n", st->timeouts);
+        fprintf(stderr, "stuck workers replaced: %llu\n", st->replaced);
+    }
+    if (st->hedges > 0) {
+        fprintf(stderr, "hedged: %llu, answered by the hedge: %llu\n",
+                st->hedges, st->hedge_wins);
+    }
+    if (st->sched_reads > 0) {
+        fprintf(stderr, "scheduled reads: %llu\n", st->sched_reads);
+        // worked out from FIEMAP, the disk's own caching and queueing
+        // unknown
+        fprintf(stderr, "modelled seek distance: %.1f MiB\n",
+                st->seek / 1048576.0);
+        fprintf(stderr, "modelled seek distance in file order: %.1f MiB\n",
+                st->seek_file_order / 1048576.0);
+    }
+}
 
-    // get version (if version 1, date and duration values are 8 bytes, not 4)
-    version = fgetc(fptr);
+// Parse a --device-jobs argument, "[PATH=]N" or "[PATH=]auto", setting the
+// limit for the device holding PATH, or the default for the rest.
+// Return 0 if successful, or the error code to exit with.
+static int add_dev_limit(struct options *opt, char *arg)
+{
+    struct batch_dev_limit *limits;
+    struct stat st;
+    char *value, *end;
+    int limit;
 
-    // we must now skip over:
-    //   3 bytes of hex flags
-    //   4 bytes creation date, (8 bytes if version 1)
-    //   4 bytes modified date, (8 bytes if version 1)
-    if (version == 1) {
-        if (fseek(fptr, 19L, SEEK_CUR)) {
-            fputs("Problem accessing file\n", stderr);
-            exit(31);
-        }
+    // paths may hold '=', numbers never do
+    value = strrchr(arg, '=');
+    value = (value == NULL) ? arg : value + 1;
+    if (strcmp(value, "auto") == 0) {
+        limit = BATCH_DEV_AUTO;
     }
     else {
-        if (fseek(fptr, 11L, SEEK_CUR)) {
-            fputs("Problem accessing file\n", stderr);
-            exit(32);
+        limit = (int)strtol(value, &end, 10);
+        if ((*end != '\0') || (limit < 1)) {
+            fprintf(stderr, "%s: invalid device jobs: %s\n", opt->prog, arg);
+            return MP4LEN_ERR_USAGE;
         }
     }
+    if (value == arg) {
+        opt->dev_default = limit;
+        return 0;
+    }
 
-    // read units per second, a big endian unsigned long
-    if (fread(buf, 1, 4, fptr) != 4) {
-        // we did not complete a full read
-        fputs("Problem reading file\n", stderr);
-        exit(33);
+    value[-1] = '\0';
+    if (stat(arg, &st)) {
+        fprintf(stderr, "%s: %s: %s\n", opt->prog, arg,
+                mp4len_strerror(MP4LEN_ERR_OPEN));
+        return MP4LEN_ERR_USAGE;
+    }
+    limits = (struct batch_dev_limit*)realloc(opt->dev_limits,
+        (opt->n_dev_limits + 1) * sizeof(struct batch_dev_limit));
+    if (limits == NULL) {
+        return MP4LEN_ERR_NOMEM;
     }
-    // move buffer into long int
-    unit_per_sec = buf[3] + (buf[2]<<8) + (buf[1]<<16) + (buf[0]<<24);
+    opt->dev_limits = limits;
+    limits[opt->n_dev_limits].dev = st.st_dev;
+    limits[opt->n_dev_limits].limit = limit;
+    opt->n_dev_limits += 1;
+    return 0;
+}
 
-    // read time length
-    if (version == 1) {
-        // unsigned long long
-        if (fread(buf, 1, 8, fptr) != 8) {
-            // we did not complete a full read
-            fputs("Problem reading file\n", stderr);
-            exit(34);
-        }
+// Queue a file to probe, reporting it under ID if not NULL.
+static void submit_file(const struct options *opt, const char *path,
+                        const char *id)
+{
+    char *copy = NULL;
+
+    if ((id != NULL) && ((copy = strdup(id)) == NULL)) {
+        fprintf(stderr, "%s: %s: %s\n", opt->prog, path,
+                mp4len_strerror(MP4LEN_ERR_NOMEM));
+        printf("%s\terror %d\n", id, MP4LEN_ERR_NOMEM);
+        return;
+    }
+    if (batch_submit(opt->batch, path, copy)) {
+        fprintf(stderr, "%s: %s: %s\n", opt->prog, path,
+                mp4len_strerror(MP4LEN_ERR_NOMEM));
+        printf("%s\terror %d\n", copy ? copy : path, MP4LEN_ERR_NOMEM);
+        free(copy);
     }
-    else {
-        // unsigned long, but fill buffer as if a long long
-        if (fread(buf + 4, 1, 4, fptr) != 4) {
-            // we did not complete a full read
-            fputs("Problem reading file\n", stderr);
-            exit(34);
-        }
-        // fill start of buffer with zeros
-        buf[0] = 0;
-        buf[1] = 0;
-        buf[2] = 0;
-        buf[3] = 0;
-    }
-    // move buffer into long long int, length in "units"
-    len_unit = buf[7] + (buf[6]<<8) + (buf[5]<<16) + (buf[4]<<24)
-             + ((unsigned long long)buf[3]<<32)
-             + ((unsigned long long)buf[2]<<40)
-             + ((unsigned long long)buf[1]<<48)
-             + ((unsigned long long)buf[0]<<56);
-
-    // get length in seconds
-    len_sec = (double)len_unit / (float)unit_per_sec;
-    return len_sec;
 }
 
-int main (int argc, char *argv[])
+// Return true if the path falls in this process's shard.  The same path
+// falls in the same shard on every host where it is reached the same way.
+// By directory, every file in a directory falls in the same shard, so each
+// process reads whole directories.
+static int in_shard(const struct options *opt, const char *path, int by_dir)
 {
-    FILE *fptr;
-    long long fsize;
-    double vlen;
+    char dir[PATH_MAX];
+    const char *slash;
+    size_t len;
 
-    if (argc < 2) {
-        fprintf(stderr, "%s: missing argument\n", argv[0]);
-        fputs("\n", stderr);
-        fputs("Prints the length of an mp4 video in seconds.\n", stderr);
-        fputs("mp4len version "VERSION"\n", stderr);
-        fputs("Copyright (C) 2023 Nicholas A. Masluk, nick@randombytes.net\n",
-              stderr);
+    if (opt->n_shards == 0) {
         return 1;
     }
+    if (by_dir) {
+        slash = strrchr(path, '/');
+        len = (slash == NULL) ? 0 : (slash == path) ? 1 : slash - path;
+        if (len >= sizeof(dir)) {
+            len = sizeof(dir) - 1;
+        }
+        memcpy(dir, path, len);
+        dir[len] = '\0';
+        path = (len == 0) ? "." : dir;
+    }
+    return index_hash(opt->cwd, path) % opt->n_shards == opt->shard - 1;
+}
+
+// Return true if the path is to be probed: it falls in this process's
+// shard, and was not finished before resuming.
+static int wanted(const struct options *opt, const char *path, int by_dir)
+{
+    return in_shard(opt, path, by_dir)
+        && ((opt->checkpoint == NULL)
+            || (checkpoint_find(opt->checkpoint, path) == NULL));
+}
 
-    // open video file for reading
-    fptr = fopen(argv[1], "rb");
-    if (!fptr) {
-        fprintf(stderr, "%s: %s: no such file\n", argv[0], argv[1]);
-        return 2;
+// Walker callback, queue each file found that is wanted.
+static void walk_submit(void *arg, const char *path)
+{
+    const struct options *opt = (const struct options*)arg;
+
+    if (wanted(opt, path, 1)) {
+        submit_file(opt, path, NULL);
     }
+}
+
+// Walk the directories gathered by submit_path(), all in the one set of
+// walker threads, queueing the files found.
+// Return the number of directories that could not be read.
+static unsigned long long walk_roots(struct options *opt)
+{
+    struct walk_opts wopt = {0};
+    unsigned long long errors, skipped = 0;
 
-    // get file size
-    if (fseek(fptr, 0L, SEEK_END)) {
-        fprintf(stderr, "%s: %s: problem accessing file\n", argv[0], argv[1]);
+    if (opt->n_roots == 0) {
+        return 0;
     }
-    fsize = ftell(fptr);
-    // check file size
-    if (fsize < MIN_SIZE) {
-        fclose(fptr);
-        fprintf(stderr, "%s: %s: file size too small, %lld bytes\n",
-                argv[0], argv[1], fsize);
-        return 3;
+    wopt.prog = opt->prog;
+    wopt.filter = &opt->filter;
+    wopt.file = walk_submit;
+    wopt.file_arg = (void*)opt;
+    wopt.skipped = &skipped;
+    errors = walk_trees(opt->roots, opt->n_roots, &wopt);
+    opt->skipped += skipped;
+    for (int ii = 0; ii < opt->n_roots; ii++) {
+        free(opt->roots[ii]);
+    }
+    opt->n_roots = 0;
+    return errors;
+}
+
+// Queue a path given as input, or if it is a directory and -r was given,
+// keep it to be walked by walk_roots() along with the others.  When serving,
+// each directory is walked as soon as it is read.
+// Return the number of paths or directories that could not be read.
+static unsigned long long submit_path(struct options *opt, const char *path)
+{
+    struct stat st;
+    char **roots;
+    int cap;
+
+    if (opt->recursive && (stat(path, &st) == 0) && S_ISDIR(st.st_mode)) {
+        if (opt->n_roots == opt->roots_cap) {
+            cap = opt->roots_cap ? 2 * opt->roots_cap : 16;
+            roots = (char**)realloc(opt->roots, cap * sizeof(char*));
+            if (roots == NULL) {
+                fprintf(stderr, "%s: %s: %s\n", opt->prog, path,
+                        mp4len_strerror(MP4LEN_ERR_NOMEM));
+                return 1;
+            }
+            opt->roots = roots;
+            opt->roots_cap = cap;
+        }
+        opt->roots[opt->n_roots] = strdup(path);
+        if (opt->roots[opt->n_roots] == NULL) {
+            fprintf(stderr, "%s: %s: %s\n", opt->prog, path,
+                    mp4len_strerror(MP4LEN_ERR_NOMEM));
+            return 1;
+        }
+        opt->n_roots += 1;
+        return opt->serve ? walk_roots(opt) : 0;
     }
+    if (wanted(opt, path, 0)) {
+        submit_file(opt, path, NULL);
+    }
+    return 0;
+}
+
+// Report a path from the index, or as not indexed if it is not there.
+// Return the error code it was reported with.
+static int query_path(const struct options *opt, const char *path, int multi)
+{
+    const struct index_rec *rec;
+    struct mp4len_result res = {0};
+    int ret = MP4LEN_ERR_NOT_INDEXED;
 
-    // check for magic number matching MP4 file
-    if (!has_mp4_magic(fptr)) {
+    rec = index_find(opt->index, index_hash(opt->cwd, path));
+    if (rec != NULL) {
+        ret = index_result(rec, &res);
+    }
+    report(opt->prog, path, ret, &res, multi);
+    return ret;
+}
+
+// Queue each path in the --files-from list as it is read, so the list is
+// never held in memory and probing starts with the first path.  With --ids
+// each path is taken as a single file, after its ID and a tab.
+// Return the number of paths or directories that could not be read.
+static unsigned long long submit_list(struct options *opt)
+{
+    FILE *fptr;
+    char *line = NULL, *path;
+    size_t line_cap = 0;
+    ssize_t len;
+    unsigned long long failed = 0;
+    int sep = opt->null_sep ? '\0' : '\n';
+
+    if (strcmp(opt->files_from, "-") == 0) {
+        fptr = stdin;
+    }
+    else {
+        fptr = fopen(opt->files_from, "r");
+        if (fptr == NULL) {
+            fprintf(stderr, "%s: %s: %s\n", opt->prog, opt->files_from,
+                    mp4len_strerror(MP4LEN_ERR_OPEN));
+            return 1;
+        }
+    }
+
+    while ((len = getdelim(&line, &line_cap, sep, fptr)) > 0) {
+        if (line[len - 1] == sep) {
+            line[--len] = '\0';
+        }
+        if (!opt->null_sep && (len > 0) && (line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+        if (opt->index_query) {
+            failed += (query_path(opt, line, 1) != 0);
+        }
+        else if (!opt->ids) {
+            failed += submit_path(opt, line);
+        }
+        else if ((path = strchr(line, '\t')) != NULL) {
+            *path++ = '\0';
+            if (wanted(opt, path, 0)) {
+                submit_file(opt, path, line);
+            }
+        }
+        else {
+            fprintf(stderr, "%s: %s: missing ID\n", opt->prog, line);
+            printf("%s\terror %d\n", line, MP4LEN_ERR_USAGE);
+            if (opt->serve) {
+                fflush(stdout);
+            }
+            failed += 1;
+        }
+    }
+    if (ferror(fptr)) {
+        fprintf(stderr, "%s: %s: %s\n", opt->prog, opt->files_from,
+                mp4len_strerror(MP4LEN_ERR_BLOCK_READ));
+        failed += 1;
+    }
+    free(line);
+    if (fptr != stdin) {
         fclose(fptr);
-        fprintf(stderr, "%s: %s: MP4 file format not valid\n", argv[0],
-                argv[1]);
-        return 4;
     }
+    return failed;
+}
 
-    // get video length
-    vlen = get_mp4_len(fptr, fsize);
-    // print length
-    printf("%f\n", vlen);
-    // close file
-    fclose(fptr);
+// Answer the files from the index without opening them, exiting as if they
+// had been probed.
+static int run_query(struct options *opt, char **paths, int n_paths)
+{
+    unsigned long long failed = 0;
+    int multi = (n_paths > 1) || (opt->files_from != NULL);
+    int ret = 0;
+
+    opt->index = index_open(opt->index_file);
+    if (opt->index == NULL) {
+        fprintf(stderr, "%s: %s: %s\n", opt->prog, opt->index_file,
+                strerror(errno));
+        return MP4LEN_ERR_OPEN;
+    }
+    if (getcwd(opt->cwd, sizeof(opt->cwd)) == NULL) {
+        strcpy(opt->cwd, "/");
+    }
+    for (int ii = 0; ii < n_paths; ii++) {
+        ret = query_path(opt, paths[ii], multi);
+        failed += (ret != 0);
+    }
+    if (opt->files_from != NULL) {
+        failed += submit_list(opt);
+    }
+    index_close(opt->index);
+    if (!multi) {
+        return ret;
+    }
+    return (failed > 0) ? MP4LEN_ERR_SOME_FAILED : 0;
+}
+
+// Count in the files finished before resuming as they were when probed,
+// without printing them again.
+// Return the number of them that failed.
+static unsigned long long add_resumed(struct options *opt)
+{
+    const struct index_rec *done;
+    struct mp4len_result res;
+    unsigned long long failed = 0;
+
+    done = checkpoint_done(opt->checkpoint, &opt->resumed);
+    for (size_t ii = 0; ii < opt->resumed; ii++) {
+        if (opt->index_build && index_build_push(&opt->ib, &done[ii])) {
+            fprintf(stderr, "%s: %s: %s\n", opt->prog, opt->index_file,
+                    mp4len_strerror(MP4LEN_ERR_NOMEM));
+            return failed + 1;
+        }
+        if (index_result(&done[ii], &res)) {
+            failed += 1;
+        }
+        else if (opt->aggregate) {
+            agg_add(&opt->agg, res.len_sec);
+        }
+    }
+    return failed;
+}
+
+// Merge the part indexes into the index.
+// Return 0 if successful, or MP4LEN_ERR_OPEN.
+static int run_merge(const struct options *opt, char **paths, int n_paths)
+{
+    const char *bad;
+
+    if (index_merge(paths, n_paths, opt->index_file, &bad)) {
+        fprintf(stderr, "%s: %s: %s\n", opt->prog, bad, strerror(errno));
+        return MP4LEN_ERR_OPEN;
+    }
     return 0;
 }
+
+// Probe several files on worker threads, carrying on past any that fail.
+// With -r, directories are walked for files, all together once the files
+// named have been queued.
+static int run_batch(struct options *opt, char **paths, int n_paths)
+{
+    struct batch_opts bopt = {0};
+    struct batch_stats stats;
+    unsigned long long failed = 0;
+
+    bopt.jobs = opt->jobs;
+    if ((bopt.jobs == 0) && ((opt->n_dev_limits > 0) || opt->dev_default)) {
+        // each device keeps to its own limit
+        bopt.jobs = BATCH_DEV_JOBS;
+    }
+    else if (bopt.jobs == 0) {
+        bopt.jobs = batch_default_jobs((n_paths > 0) ? paths[0] : ".");
+    }
+    bopt.order = opt->order;
+    bopt.schedule = opt->schedule;
+    bopt.window = opt->window;
+    bopt.dev_limits = opt->dev_limits;
+    bopt.n_dev_limits = opt->n_dev_limits;
+    bopt.dev_default = opt->dev_default;
+    bopt.cache = opt->cache;
+    bopt.keys = opt->index_build;
+    bopt.recheck = opt->recheck;
+    bopt.timeout = opt->timeout;
+    bopt.hedge = opt->hedge;
+    bopt.fault_delay = opt->fault_delay;
+    bopt.fault_rate = opt->fault_rate;
+    bopt.emit = emit_report;
+    bopt.emit_arg = (void*)opt;
+
+    if (opt->checkpoint_file != NULL) {
+        opt->checkpoint = checkpoint_open(opt->checkpoint_file, opt->resume);
+        if (opt->checkpoint == NULL) {
+            fprintf(stderr, "%s: %s: %s\n", opt->prog, opt->checkpoint_file,
+                    strerror(errno));
+            return MP4LEN_ERR_OPEN;
+        }
+        failed += add_resumed(opt);
+    }
+    opt->batch = batch_start(&bopt);
+    if (opt->batch == NULL) {
+        fprintf(stderr, "%s: %s\n", opt->prog,
+                mp4len_strerror(MP4LEN_ERR_NOMEM));
+        if (opt->checkpoint != NULL) {
+            checkpoint_close(opt->checkpoint);
+        }
+        return MP4LEN_ERR_NOMEM;
+    }
+    for (int ii = 0; ii < n_paths; ii++) {
+        failed += submit_path(opt, paths[ii]);
+    }
+    if (opt->files_from != NULL) {
+        failed += submit_list(opt);
+    }
+    failed += walk_roots(opt);
+    free(opt->roots);
+    opt->roots = NULL;
+    opt->roots_cap = 0;
+    failed += batch_finish(opt->batch, &stats);
+    if (opt->checkpoint != NULL) {
+        fflush(stdout);
+        fdatasync(STDOUT_FILENO);
+        if (checkpoint_close(opt->checkpoint)) {
+            fprintf(stderr, "%s: %s: %s\n", opt->prog, opt->checkpoint_file,
+                    strerror(errno));
+        }
+        opt->checkpoint = NULL;
+    }
+    if (opt->aggregate) {
+        print_aggregate(&opt->agg, failed);
+    }
+    if (opt->index_build && index_build_write(&opt->ib, opt->index_file)) {
+        fprintf(stderr, "%s: %s: %s\n", opt->prog, opt->index_file,
+                strerror(errno));
+        return MP4LEN_ERR_OPEN;
+    }
+    if (opt->stats) {
+        print_stats(&stats);
+        if (opt->recursive) {
+            fprintf(stderr, "files skipped by filter: %llu\n", opt->skipped);
+        }
+        if (opt->checkpoint_file != NULL) {
+            fprintf(stderr, "files finished before resuming: %zu\n",
+                    opt->resumed);
+        }
+    }
+    return (failed > 0) ? MP4LEN_ERR_SOME_FAILED : 0;
+}
+
+int main (int argc, char *argv[])
+{
+    enum {
+        OPT_EXT = 256,
+        OPT_INCLUDE,
+        OPT_MIN_SIZE,
+        OPT_FILES_FROM,
+        OPT_ORDER,
+        OPT_WINDOW,
+        OPT_STATS,
+        OPT_SCHEDULE,
+        OPT_DEVICE_JOBS,
+        OPT_AGGREGATE,
+        OPT_SERVE_STDIO,
+        OPT_IDS,
+        OPT_SERVE_SOCKET,
+        OPT_CLIENT,
+        OPT_CACHE_PATH,
+        OPT_CACHE_SIZE,
+        OPT_CACHE_SHM,
+        OPT_RECHECK,
+        OPT_FOLLOW,
+        OPT_TIMEOUT,
+        OPT_HEDGE,
+        OPT_FAULT_DELAY,
+        OPT_INDEX,
+        OPT_INDEX_BUILD,
+        OPT_INDEX_QUERY,
+        OPT_INDEX_WATCH,
+        OPT_INDEX_MERGE,
+        OPT_SHARD,
+        OPT_CHECKPOINT,
+        OPT_RESUME
+    };
+    static const struct option long_opts[] = {
+        {"jobs", required_argument, NULL, 'j'},
+        {"recursive", no_argument, NULL, 'r'},
+        {"ext", required_argument, NULL, OPT_EXT},
+        {"include", required_argument, NULL, OPT_INCLUDE},
+        {"min-size", required_argument, NULL, OPT_MIN_SIZE},
+        {"files-from", required_argument, NULL, OPT_FILES_FROM},
+        {"null", no_argument, NULL, '0'},
+        {"order", required_argument, NULL, OPT_ORDER},
+        {"window", required_argument, NULL, OPT_WINDOW},
+        {"stats", no_argument, NULL, OPT_STATS},
+        {"schedule", required_argument, NULL, OPT_SCHEDULE},
+        {"device-jobs", required_argument, NULL, OPT_DEVICE_JOBS},
+        {"aggregate", no_argument, NULL, OPT_AGGREGATE},
+        {"serve-stdio", no_argument, NULL, OPT_SERVE_STDIO},
+        {"ids", no_argument, NULL, OPT_IDS},
+        {"serve-socket", required_argument, NULL, OPT_SERVE_SOCKET},
+        {"client", required_argument, NULL, OPT_CLIENT},
+        {"cache-path", required_argument, NULL, OPT_CACHE_PATH},
+        {"cache-size", required_argument, NULL, OPT_CACHE_SIZE},
+        {"cache-shm", required_argument, NULL, OPT_CACHE_SHM},
+        {"recheck", no_argument, NULL, OPT_RECHECK},
+        {"follow", optional_argument, NULL, OPT_FOLLOW},
+        {"timeout", required_argument, NULL, OPT_TIMEOUT},
+        {"hedge", required_argument, NULL, OPT_HEDGE},
+        {"fault-delay", required_argument, NULL, OPT_FAULT_DELAY},
+        {"index", required_argument, NULL, OPT_INDEX},
+        {"index-build", no_argument, NULL, OPT_INDEX_BUILD},
+        {"index-query", no_argument, NULL, OPT_INDEX_QUERY},
+        {"index-watch", no_argument, NULL, OPT_INDEX_WATCH},
+        {"index-merge", no_argument, NULL, OPT_INDEX_MERGE},
+        {"shard", required_argument, NULL, OPT_SHARD},
+        {"checkpoint", required_argument, NULL, OPT_CHECKPOINT},
+        {"resume", no_argument, NULL, OPT_RESUME},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    struct options opt = {0};
+    char *end;
+    int ch, ret;
+
+    opt.prog = argv[0];
+    while ((ch = getopt_long(argc, argv, "j:r0h", long_opts, NULL)) != -1) {
+        switch (ch) {
+        case 'j':
+            opt.jobs = (int)strtol(optarg, &end, 10);
+            if ((*end != '\0') || (opt.jobs < 1)) {
+                fprintf(stderr, "%s: invalid number of jobs: %s\n", argv[0],
+                        optarg);
+                return MP4LEN_ERR_USAGE;
+            }
+            break;
+        case 'r':
+            opt.recursive = 1;
+            break;
+        case OPT_EXT:
+            opt.filtered = 1;
+            if (walk_add_exts(&opt.filter, optarg)) {
+                return MP4LEN_ERR_NOMEM;
+            }
+            break;
+        case OPT_INCLUDE:
+            opt.filtered = 1;
+            if (walk_add_glob(&opt.filter, optarg)) {
+                return MP4LEN_ERR_NOMEM;
+            }
+            break;
+        case OPT_MIN_SIZE:
+            opt.filter.min_size = strtoll(optarg, &end, 10);
+            if ((*end != '\0') || (opt.filter.min_size < 0)) {
+                fprintf(stderr, "%s: invalid minimum size: %s\n", argv[0],
+                        optarg);
+                return MP4LEN_ERR_USAGE;
+            }
+            break;
+        case OPT_FILES_FROM:
+            opt.files_from = optarg;
+            break;
+        case '0':
+            opt.null_sep = 1;
+            break;
+        case OPT_ORDER:
+            opt.order_set = 1;
+            if (strcmp(optarg, "input") == 0) {
+                opt.order = BATCH_ORDER_INPUT;
+            }
+            else if (strcmp(optarg, "completion") == 0) {
+                opt.order = BATCH_ORDER_COMPLETION;
+            }
+            else {
+                fprintf(stderr, "%s: invalid order: %s\n", argv[0], optarg);
+                return MP4LEN_ERR_USAGE;
+            }
+            break;
+        case OPT_WINDOW:
+            opt.window = (size_t)strtoul(optarg, &end, 10);
+            if ((*end != '\0') || (opt.window < 1)) {
+                fprintf(stderr, "%s: invalid window: %s\n", argv[0], optarg);
+                return MP4LEN_ERR_USAGE;
+            }
+            break;
+        case OPT_STATS:
+            opt.stats = 1;
+            break;
+        case OPT_SCHEDULE:
+            if (strcmp(optarg, "fifo") == 0) {
+                opt.schedule = BATCH_SCHED_FIFO;
+            }
+            else if (strcmp(optarg, "physical") == 0) {
+                opt.schedule = BATCH_SCHED_PHYSICAL;
+            }
+            else {
+                fprintf(stderr, "%s: invalid schedule: %s\n", argv[0],
+                        optarg);
+                return MP4LEN_ERR_USAGE;
+            }
+            break;
+        case OPT_DEVICE_JOBS:
+            ret = add_dev_limit(&opt, optarg);
+            if (ret) {
+                return ret;
+            }
+            break;
+        case OPT_SERVE_STDIO:
+            opt.serve = 1;
+            opt.files_from = "-";
+            break;
+        case OPT_IDS:
+            opt.ids = 1;
+            break;
+        case OPT_SERVE_SOCKET:
+            opt.serve_socket = optarg;
+            break;
+        case OPT_CLIENT:
+            opt.client = optarg;
+            break;
+        case OPT_CACHE_PATH:
+            opt.cache_path = optarg;
+            break;
+        case OPT_CACHE_SHM:
+            opt.cache_shm = optarg;
+            break;
+        case OPT_RECHECK:
+            opt.recheck = 1;
+            break;
+        case OPT_FOLLOW:
+            opt.follow = DEFAULT_FOLLOW;
+            if (optarg != NULL) {
+                opt.follow = strtod(optarg, &end);
+                if ((*end != '\0') || !(opt.follow > 0)) {
+                    fprintf(stderr, "%s: invalid interval: %s\n", argv[0],
+                            optarg);
+                    return MP4LEN_ERR_USAGE;
+                }
+            }
+            break;
+        case OPT_TIMEOUT:
+            opt.timeout = strtod(optarg, &end);
+            if ((*end != '\0') || !(opt.timeout > 0)) {
+                fprintf(stderr, "%s: invalid timeout: %s\n", argv[0], optarg);
+                return MP4LEN_ERR_USAGE;
+            }
+            break;
+        case OPT_HEDGE:
+            opt.hedge = strtod(optarg, &end);
+            if ((*end != '\0') || !(opt.hedge > 0) || !(opt.hedge < 1)) {
+                fprintf(stderr, "%s: invalid quantile: %s\n", argv[0],
+                        optarg);
+                return MP4LEN_ERR_USAGE;
+            }
+            break;
+        case OPT_FAULT_DELAY:
+            opt.fault_delay = strtod(optarg, &end);
+            opt.fault_rate = 1;
+            if (*end == ',') {
+                opt.fault_rate = strtod(end + 1, &end);
+            }
+            if ((*end != '\0') || !(opt.fault_delay > 0)
+                || !(opt.fault_rate >= 0) || !(opt.fault_rate <= 1)) {
+                fprintf(stderr, "%s: invalid fault delay: %s\n", argv[0],
+                        optarg);
+                return MP4LEN_ERR_USAGE;
+            }
+            break;
+        case OPT_INDEX:
+            opt.index_file = optarg;
+            break;
+        case OPT_INDEX_BUILD:
+            opt.index_build = 1;
+            // directories given are indexed whole
+            opt.recursive = 1;
+            break;
+        case OPT_INDEX_QUERY:
+            opt.index_query = 1;
+            break;
+        case OPT_INDEX_WATCH:
+            opt.index_watch = 1;
+            break;
+        case OPT_INDEX_MERGE:
+            opt.index_merge = 1;
+            break;
+        case OPT_SHARD:
+            opt.shard = (unsigned int)strtoul(optarg, &end, 10);
+            if (*end == '/') {
+                opt.n_shards = (unsigned int)strtoul(end + 1, &end, 10);
+            }
+            if ((*end != '\0') || (opt.shard < 1)
+                || (opt.shard > opt.n_shards)) {
+                fprintf(stderr, "%s: invalid shard: %s\n", argv[0], optarg);
+                return MP4LEN_ERR_USAGE;
+            }
+            break;
+        case OPT_CHECKPOINT:
+            opt.checkpoint_file = optarg;
+            break;
+        case OPT_RESUME:
+            opt.resume = 1;
+            break;
+        case OPT_CACHE_SIZE:
+            opt.cache_size = strtoull(optarg, &end, 10);
+            if ((*end != '\0') || (opt.cache_size < 1)) {
+                fprintf(stderr, "%s: invalid cache size: %s\n", argv[0],
+                        optarg);
+                return MP4LEN_ERR_USAGE;
+            }
+            break;
+        case OPT_AGGREGATE:
+            opt.aggregate = 1;
+            agg_init(&opt.agg);
+            break;
+        default:
+            usage(argv[0]);
+            return MP4LEN_ERR_USAGE;
+        }
+    }
+    if (opt.ids && !opt.order_set) {
+        // no need to wait for earlier requests
+        opt.order = BATCH_ORDER_COMPLETION;
+    }
+    if (!opt.filtered && walk_add_exts(&opt.filter, DEFAULT_EXTS)) {
+        return MP4LEN_ERR_NOMEM;
+    }
+
+    if ((opt.index_build || opt.index_query || opt.index_watch
+         || opt.index_merge) && (opt.index_file == NULL)) {
+        fprintf(stderr, "%s: --index is needed to build, query, watch or "
+                "merge\n", argv[0]);
+        return MP4LEN_ERR_USAGE;
+    }
+    if (opt.index_build + opt.index_query + opt.index_watch
+        + opt.index_merge > 1) {
+        fprintf(stderr, "%s: only one of --index-build, --index-query, "
+                "--index-watch and --index-merge may be given\n", argv[0]);
+        return MP4LEN_ERR_USAGE;
+    }
+    if (opt.resume && (opt.checkpoint_file == NULL)) {
+        fprintf(stderr, "%s: --resume needs --checkpoint\n", argv[0]);
+        return MP4LEN_ERR_USAGE;
+    }
+    if ((opt.checkpoint_file != NULL)
+        && ((opt.serve_socket != NULL) || (opt.client != NULL)
+            || (opt.follow > 0) || opt.index_query || opt.index_watch
+            || opt.index_merge)) {
+        fprintf(stderr, "%s: --checkpoint only works when probing files or "
+                "building an index\n", argv[0]);
+        return MP4LEN_ERR_USAGE;
+    }
+    if ((opt.n_shards > 0) && (getcwd(opt.cwd, sizeof(opt.cwd)) == NULL)) {
+        strcpy(opt.cwd, "/");
+    }
+    if (opt.index_build && index_build_init(&opt.ib)) {
+        return MP4LEN_ERR_NOMEM;
+    }
+    if ((opt.cache_path != NULL) && (opt.cache_shm != NULL)) {
+        fprintf(stderr, "%s: --cache-path and --cache-shm both given\n",
+                argv[0]);
+        return MP4LEN_ERR_USAGE;
+    }
+    if ((opt.cache_path != NULL) || (opt.cache_shm != NULL)) {
+        if (opt.cache_size == 0) {
+            opt.cache_size = DEFAULT_CACHE_SIZE;
+        }
+        opt.cache = opt.cache_path
+            ? mp4len_cache_open(opt.cache_path, opt.cache_size)
+            : mp4len_cache_open_shm(opt.cache_shm, opt.cache_size);
+        if (opt.cache == NULL) {
+            // slower without it, but still right
+            fprintf(stderr, "%s: %s: %s, not using cache\n", argv[0],
+                    opt.cache_path ? opt.cache_path : opt.cache_shm,
+                    strerror(errno));
+        }
+    }
+
+    if (opt.serve_socket != NULL) {
+        struct serve_opts sopt = {0};
+
+        sopt.prog = argv[0];
+        sopt.path = opt.serve_socket;
+        sopt.jobs = opt.jobs ? opt.jobs : batch_default_jobs(".");
+        sopt.window = opt.window;
+        sopt.cache = opt.cache;
+        ret = serve_socket(&sopt);
+        mp4len_cache_close(opt.cache);
+        walk_filter_free(&opt.filter);
+        free(opt.dev_limits);
+        return ret;
+    }
+
+    if ((optind >= argc) && (opt.files_from == NULL)) {
+        fprintf(stderr, "%s: missing argument\n", argv[0]);
+        usage(argv[0]);
+        return MP4LEN_ERR_USAGE;
+    }
+    if (opt.client != NULL) {
+        ret = run_client(&opt, argv + optind, argc - optind);
+    }
+    else if (opt.follow > 0) {
+        ret = run_follow(&opt, argv + optind, argc - optind);
+    }
+    else if (opt.index_merge) {
+        ret = run_merge(&opt, argv + optind, argc - optind);
+    }
+    else if (opt.index_query) {
+        ret = run_query(&opt, argv + optind, argc - optind);
+    }
+    else if (opt.index_watch) {
+        struct watch_opts wopt = {0};
+
+        wopt.prog = argv[0];
+        wopt.index_file = opt.index_file;
+        wopt.filter = &opt.filter;
+        wopt.jobs = opt.jobs ? opt.jobs
+            : batch_default_jobs((optind < argc) ? argv[optind] : ".");
+        wopt.cache = opt.cache;
+        ret = watch_index(&wopt, argv + optind, argc - optind);
+    }
+    else if ((argc - optind == 1) && !opt.recursive
+             && (opt.files_from == NULL) && !opt.aggregate
+             && (opt.n_shards == 0) && (opt.checkpoint_file == NULL)) {
+        ret = run_single(&opt, argv[optind]);
+    }
+    else {
+        ret = run_batch(&opt, argv + optind, argc - optind);
+    }
+    index_build_free(&opt.ib);
+    mp4len_cache_close(opt.cache);
+    walk_filter_free(&opt.filter);
+    free(opt.dev_limits);
+    return ret;
+}
@@ -0,0 +1,338 @@
+/* libmp4len
+   Finds the time duration of MP4 video files, without ever calling exit(),
+   so it may be used from inside long running processes.
+
+   Nicholas A. Masluk
+   nick@randombytes.net
+   Copyright 2023
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef MP4LEN_H
+#define MP4LEN_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MP4LEN_VERSION "2023-09-05"
+#define MP4LEN_MIN_SIZE 51 // minimum file size
+#define MP4LEN_BLOCK_SIZE 16384 // number of bytes to read from file at once
+#define MP4LEN_HDR_SIZE 32 // bytes after "mvhd" holding the duration
+#define MP4LEN_CACHE_LINE 64 // alignment of pooled contexts
+
+// Result codes.  Errors have the same values the mp4len command exits with.
+enum mp4len_error {
+    MP4LEN_AGAIN = -1, // parser needs more bytes
+    MP4LEN_OK = 0,
+    MP4LEN_ERR_USAGE = 1, // bad command line
+    MP4LEN_ERR_OPEN = 2, // file could not be opened
+    MP4LEN_ERR_TOO_SMALL = 3, // file smaller than MP4LEN_MIN_SIZE
+    MP4LEN_ERR_NOT_MP4 = 4, // no MP4 magic number
+    MP4LEN_ERR_SOME_FAILED = 5, // one or more of several files failed
+    MP4LEN_ERR_NOT_INDEXED = 6, // file not found in index
+    MP4LEN_ERR_TIMEOUT = 7, // probe took longer than allowed
+    MP4LEN_ERR_MAGIC_SEEK = 10, // problem accessing magic number
+    MP4LEN_ERR_MAGIC_READ = 11, // problem reading magic number
+    MP4LEN_ERR_NOMEM = 20, // could not allocate memory
+    MP4LEN_ERR_BLOCK_SEEK_END = 21, // problem accessing block at end
+    MP4LEN_ERR_BLOCK_SEEK = 22, // problem accessing block at beginning
+    MP4LEN_ERR_BLOCK_READ = 23, // problem reading block
+    MP4LEN_ERR_HEADER_SEEK = 24, // problem accessing header
+    MP4LEN_ERR_NO_HEADER = 30, // could not find "mvhd" header
+    MP4LEN_ERR_VERSION_SEEK = 31, // problem skipping version 1 dates
+    MP4LEN_ERR_DATE_SEEK = 32, // problem skipping version 0 dates
+    MP4LEN_ERR_TIMESCALE_READ = 33, // problem reading units per second
+    MP4LEN_ERR_DURATION_READ = 34 // problem reading time length
+};
+
+// Resumable parser state.  The parser never reads anything itself, it tells
+// its driver which bytes it wants next (mp4len_parser_want()) and the driver
+// hands them over as they arrive (mp4len_parser_feed()), in as many pieces
+// as is convenient.  It holds no pointers, so it may be copied or kept in
+// any storage the driver likes.  Fields are private.
+struct mp4len_parser {
+    int state;
+    int result; // 0 or error code once parsing is finished
+    long long fsize;
+    long long want_off; // next byte wanted
+    long long want_len; // number of bytes wanted from want_off
+    long long n_blocks; // number of blocks to cover file
+    long long block; // current block search iteration
+    long long blk_end; // file offset just past the current block
+    int chars_matching; // streak of characters matching header
+    long long hdr_off; // file offset just after "mvhd"
+    unsigned char buf[MP4LEN_HDR_SIZE]; // magic number or header fields
+    int buf_len;
+    unsigned long unit_per_sec; // units per second
+    unsigned long long len_unit; // time length in units
+    double len_sec; // time length in seconds
+};
+
+#define MP4LEN_FOLLOW_TRACKS 8 // most tracks of a followed file
+
+// A track of a followed file.  Fields are private.
+struct mp4len_follow_track {
+    unsigned long id;
+    unsigned long timescale; // units per second
+    unsigned long default_dur; // sample duration unless given
+    unsigned long long start; // decode time of the first sample seen
+    unsigned long long end; // decode time after the last sample seen
+    int begun; // start is known
+};
+
+// What is known of a file still being written between looks at it, see
+// mp4len_follow_fd().  Like the parser it holds no pointers.  Fields are
+// private.
+struct mp4len_follow {
+    long long next_off; // offset of the first top level box not yet parsed
+    long long fsize; // file size at the last look
+    int have_moov;
+    int fragmented; // has "mvex", the duration comes from fragments
+    unsigned long unit_per_sec; // from "mvhd"
+    unsigned long long len_unit;
+    long long hdr_off; // file offset just after "mvhd"
+    unsigned long long fragments; // "moof" boxes parsed
+    int n_tracks;
+    struct mp4len_follow_track tracks[MP4LEN_FOLLOW_TRACKS];
+};
+
+// What is known about a file after probing it.
+struct mp4len_result {
+    double len_sec; // time length in seconds
+    unsigned long unit_per_sec; // units per second
+    unsigned long long len_unit; // time length in units
+    long long fsize; // file size, also set on most errors
+    long long hdr_off; // file offset just after "mvhd"
+};
+
+// What identifies a file and its contents for mp4len_cache, see
+// mp4len_key_path().  A file renamed keeps its key, a file written to gets a
+// new one.
+struct mp4len_key {
+    unsigned long long dev; // major in the high 32 bits, minor in the low
+    unsigned long long ino;
+    long long size;
+    long long mtime_ns; // nanoseconds since the epoch
+    long long ctime_ns;
+};
+
+// A range of file bytes that the caller already holds in memory.
+struct mp4len_segment {
+    long long offset; // file offset of the first byte
+    const unsigned char *data;
+    long long len;
+};
+
+// Reads up to len bytes at file offset off of the file open on fd into buf,
+// as pread(2) does.  Returns the number of bytes read, 0 at the end of the
+// file, or -1 with errno set.
+typedef long long (*mp4len_read_fn)(void *arg, int fd, void *buf, size_t len,
+                                    long long off);
+
+// Probe context.  One context may be used for any number of files, one at a
+// time.  Separate threads need separate contexts.  Probing through a context
+// never allocates memory.
+typedef struct mp4len_ctx mp4len_ctx;
+
+// Pool of preallocated probe contexts shared by worker threads.  Checking a
+// context out and back in takes no lock and never allocates.
+typedef struct mp4len_pool mp4len_pool;
+
+// Results of earlier probes kept in a memory mapped file or POSIX shared
+// memory, safe to share between threads and processes.  Lookups and
+// updates take no lock.
+typedef struct mp4len_cache mp4len_cache;
+
+// Reset parser for a file fsize bytes long.
+void mp4len_parser_init(struct mp4len_parser *p, long long fsize);
+
+// Return MP4LEN_AGAIN and set *off/*len to the bytes the parser wants next.
+// Once parsing is finished, return MP4LEN_OK or an error code.
+int mp4len_parser_want(const struct mp4len_parser *p, long long *off,
+                       long long *len);
+
+// Hand the parser len bytes starting at the offset it wants, which may be
+// fewer than it asked for.  Bytes beyond what it asked for are ignored.  A
+// len of 0 means no more bytes could be read there.
+// Return MP4LEN_AGAIN if more bytes are wanted, see mp4len_parser_want().
+// Return MP4LEN_OK once the duration is known, or an error code.
+int mp4len_parser_feed(struct mp4len_parser *p, const unsigned char *data,
+                       long long len);
+
+// Copy the parsed values into *res, once parsing is finished.
+void mp4len_parser_result(const struct mp4len_parser *p,
+                          struct mp4len_result *res);
+
+// Allocate a probe context, along with its own MP4LEN_BLOCK_SIZE read
+// buffer.  Return NULL if out of memory.
+mp4len_ctx *mp4len_ctx_new(void);
+
+// Number of bytes of memory mp4len_ctx_init() needs for a context.
+size_t mp4len_ctx_size(void);
+
+// Set up a probe context without any heap allocation, in caller owned
+// memory of mem_len bytes (aligned for any type) and reading through a
+// caller owned scratch buffer of scratch_len bytes.  Scratch buffers smaller
+// than MP4LEN_BLOCK_SIZE work, with more reads.  Both areas must outlive the
+// context.  Return the context, or NULL if either area is too small.
+mp4len_ctx *mp4len_ctx_init(void *mem, size_t mem_len, void *scratch,
+                            size_t scratch_len);
+
+// Free a probe context from mp4len_ctx_new().  Does nothing for contexts
+// from mp4len_ctx_init().
+void mp4len_ctx_free(mp4len_ctx *ctx);
+
+// Allocate a pool of n_ctx probe contexts, each with its own read buffer.
+// Each thread keeps one returned context aside for its next checkout, so
+// allow one context per thread beyond those probing at once.
+// Return NULL if out of memory.
+mp4len_pool *mp4len_pool_new(unsigned int n_ctx);
+
+// Free a pool.  All of its contexts must have been returned.
+void mp4len_pool_free(mp4len_pool *pool);
+
+// Check a context out of the pool.  Return NULL if none is free.
+mp4len_ctx *mp4len_pool_get(mp4len_pool *pool);
+
+// Return a context to the pool it came from.
+void mp4len_pool_put(mp4len_pool *pool, mp4len_ctx *ctx);
+
+// errno from the last failed system call made through ctx, or 0.
+int mp4len_ctx_errno(const mp4len_ctx *ctx);
+
+// Return the read buffer of ctx and set *len to its size, for a caller
+// driving a parser of its own to read into while it has the context.
+unsigned char *mp4len_ctx_buf(mp4len_ctx *ctx, size_t *len);
+
+// Read files probed through ctx with read instead of pread(), such as to
+// fetch them from elsewhere or to test slow storage.  NULL goes back to
+// pread().
+void mp4len_ctx_set_read(mp4len_ctx *ctx, mp4len_read_fn read, void *arg);
+
+// Probe the file at path.
+// Return MP4LEN_OK and fill in *res if successful, or an error code.
+int mp4len_probe_path(mp4len_ctx *ctx, const char *path,
+                      struct mp4len_result *res);
+
+// Probe an open file descriptor.  The file position is not used or changed.
+// Return MP4LEN_OK and fill in *res if successful, or an error code.
+int mp4len_probe_fd(mp4len_ctx *ctx, int fd, struct mp4len_result *res);
+
+// Probe a file whose "mvhd" header an earlier probe found, hdr_off being
+// the res->hdr_off it gave.  If the file still starts with a known magic
+// number and the header is still there, it is read and checked with two
+// small preads, one for each, else (or if hdr_off is 0) the file is
+// searched as by mp4len_probe_path().  Useful to check a known result
+// again, or for a file changed without being laid out again.
+// Return MP4LEN_OK and fill in *res if successful, or an error code.
+int mp4len_probe_path_hint(mp4len_ctx *ctx, const char *path,
+                           long long hdr_off, struct mp4len_result *res);
+
+// As mp4len_probe_path_hint(), for an open file descriptor.
+int mp4len_probe_fd_hint(mp4len_ctx *ctx, int fd, long long hdr_off,
+                         struct mp4len_result *res);
+
+// Reset following state for a new file.
+void mp4len_follow_init(struct mp4len_follow *f);
+
+// Look at a file that may still be growing, such as a fragmented MP4 being
+// recorded.  Only the top level boxes written since the last call with the
+// same state are parsed, each "mdat" being skipped by its size, so each
+// call costs in proportion to what was added, not the size of the file.
+// The duration of a fragmented file is that of its longest track across
+// every "moof" so far, otherwise it is read from "mvhd".  A box still being
+// written is left for a later call, and a file that shrinks is started
+// over.  Any "ftyp" brand is accepted.
+// Return MP4LEN_OK and fill in *res with the duration so far, MP4LEN_AGAIN
+// if "moov" has not been written yet, or an error code.
+int mp4len_follow_fd(mp4len_ctx *ctx, struct mp4len_follow *f, int fd,
+                     struct mp4len_result *res);
+
+// Probe a file held in memory as one or more segments of a file fsize bytes
+// long.  No context is needed as nothing is read or allocated.
+// Return MP4LEN_OK and fill in *res if successful.
+// Return MP4LEN_AGAIN and set *need_off/*need_len if the segments do not
+// cover the bytes required, so the caller can load them and try again.
+// Otherwise return an error code.
+int mp4len_probe_mem(const struct mp4len_segment *segs, int n_segs,
+                     long long fsize, struct mp4len_result *res,
+                     long long *need_off, long long *need_len);
+
+// Open the cache file at path, creating it with room for at least
+// n_entries files if it does not exist.  Once full, files that hash close
+// together replace each other.
+// Return NULL with errno set if the file cannot be opened or created, or
+// is not a cache file (EINVAL).
+mp4len_cache *mp4len_cache_open(const char *path,
+                                unsigned long long n_entries);
+
+// Open the POSIX shared memory cache called name (a single '/' then up to
+// 254 other characters, see shm_open(3)), creating it with room for at
+// least n_entries files if it does not exist.  Every process on the host
+// opening the same name shares the same table in memory, which lasts until
+// the host restarts or it is removed with shm_unlink(3).
+// Return NULL with errno set if it cannot be opened or created, or is not
+// a cache (EINVAL).
+mp4len_cache *mp4len_cache_open_shm(const char *name,
+                                    unsigned long long n_entries);
+
+// Unmap a cache.
+void mp4len_cache_close(mp4len_cache *cache);
+
+// Fill in *key for the file at path with a single statx() call.
+// Return 0 if successful, or -1 with errno set.
+int mp4len_key_path(const char *path, struct mp4len_key *key);
+
+// Look a file up in the cache.
+// Return MP4LEN_OK and fill in *res if the cache holds a result for the
+// file with the same size, mtime and ctime.  Return the error code, with
+// res->fsize set, if it holds an error for the file as it is, see
+// mp4len_cache_put_error().  Otherwise return MP4LEN_AGAIN; if the cache
+// holds a result for the file as it was before it changed, res->hdr_off is
+// set to where its header was, for mp4len_probe_path_hint(), else 0.
+int mp4len_cache_lookup(mp4len_cache *cache, const struct mp4len_key *key,
+                        struct mp4len_result *res);
+
+// Look a file up in the cache, as mp4len_cache_lookup() but only for a
+// result.
+// Return 1 and fill in *res if the cache holds a result for the file as it
+// is, or 0, with res->hdr_off set as for mp4len_cache_lookup().
+int mp4len_cache_get(mp4len_cache *cache, const struct mp4len_key *key,
+                     struct mp4len_result *res);
+
+// Store a successful result in the cache.
+void mp4len_cache_put(mp4len_cache *cache, const struct mp4len_key *key,
+                      const struct mp4len_result *res);
+
+// Return 1 if error code ret depends only on the file's contents, so that
+// probing the same contents again would fail the same way:
+// MP4LEN_ERR_TOO_SMALL, MP4LEN_ERR_NOT_MP4, MP4LEN_ERR_NO_HEADER,
+// MP4LEN_ERR_TIMESCALE_READ or MP4LEN_ERR_DURATION_READ.  Return 0 for
+// errors that may not last, such as failing to open or read the file.
+int mp4len_error_lasting(int ret);
+
+// Store the error a file failed with in the cache, if it is lasting, see
+// mp4len_error_lasting().  Any other error is not stored.
+void mp4len_cache_put_error(mp4len_cache *cache, const struct mp4len_key *key,
+                            int ret);
+
+// Probe the file at path, or take its result or error from the cache if
+// there, and store what is probed.  A file the cache held before it changed
+// is probed at its old header first.  *hit is set to 1 if the cache had it,
+// else 0.  A NULL cache just probes.
+// Return MP4LEN_OK and fill in *res if successful, or an error code.
+int mp4len_probe_cached(mp4len_ctx *ctx, mp4len_cache *cache,
+                        const char *path, struct mp4len_result *res,
+                        int *hit);
+
+// Message for a result code.
+const char *mp4len_strerror(int code);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,313 @@
+/* sched
+   Probes a group of files together, reading in order of where their bytes
+   lie on disk, for the mp4len command.
+
+   Probing a file reads a few blocks at its beginning and end.  Probing
+   files one after another on a spinning disk sends the heads back and forth
+   between each file's first and last blocks and on to the next file.  Here
+   every file in the group has its own parser, and whichever file wants the
+   block physically next in the sweep is read next, so the heads pass over
+   the disk in one direction, then back in the other.  Reads are made a
+   whole block at a time where they fit in one, and kept, so a file's
+   magic number and first block, or last block and header, take one read.
+
+   Nicholas A. Masluk
+   nick@randombytes.net
+   Copyright 2023
+   Mozilla Public License Version 2.0
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sched.h"
+
+#define MAP_EXTENTS 16 // extents looked up at each end of a file
+#define MAP_RANGE (4 * MP4LEN_BLOCK_SIZE) // bytes mapped at each end
+#define MAX_LOG 8 // reads remembered per file, for the file order figure
+#define PHYS_UNKNOWN ULLONG_MAX
+
+struct sched_file {
+    struct batch_job *job;
+    int fd;
+    mp4len_read_fn read; // or NULL for pread()
+    void *read_arg;
+    int active; // still wants bytes
+    struct mp4len_parser parser;
+    long long want_off;
+    long long want_len;
+    unsigned char *buf; // MP4LEN_BLOCK_SIZE bytes from the last read, the
+                        // buffer of the file's context
+    long long buf_off; // file offset of buf
+    long long buf_len; // bytes held in buf
+    struct fiemap_extent ext[2 * MAP_EXTENTS];
+    unsigned int n_ext;
+    unsigned long long log_phys[MAX_LOG]; // physical offset of each read
+    long long log_len[MAX_LOG];
+    int n_log;
+};
+
+// Look up the physical extents of file bytes start to start + len.
+static void map_range(struct sched_file *f, long long start, long long len)
+{
+    struct {
+        struct fiemap fm;
+        struct fiemap_extent ext[MAP_EXTENTS];
+    } req;
+
+    memset(&req, 0, sizeof(req));
+    req.fm.fm_start = start;
+    req.fm.fm_length = len;
+    req.fm.fm_extent_count = MAP_EXTENTS;
+    if (ioctl(f->fd, FS_IOC_FIEMAP, &req.fm)) {
+        // not supported here, reads are left unordered
+        return;
+    }
+    for (unsigned int ii = 0; ii < req.fm.fm_mapped_extents; ii++) {
+        if (f->n_ext < 2 * MAP_EXTENTS) {
+            f->ext[f->n_ext++] = req.ext[ii];
+        }
+    }
+}
+
+// Physical offset of file byte off, or PHYS_UNKNOWN.
+static unsigned long long phys_of(const struct sched_file *f, long long off)
+{
+    const struct fiemap_extent *ext;
+    unsigned long long uoff = (unsigned long long)off;
+
+    for (unsigned int ii = 0; ii < f->n_ext; ii++) {
+        ext = &f->ext[ii];
+        if ((uoff >= ext->fe_logical)
+            && (uoff < ext->fe_logical + ext->fe_length)) {
+            if (ext->fe_flags & (FIEMAP_EXTENT_UNKNOWN
+                                 | FIEMAP_EXTENT_DELALLOC
+                                 | FIEMAP_EXTENT_DATA_INLINE)) {
+                return PHYS_UNKNOWN;
+            }
+            return ext->fe_physical + (uoff - ext->fe_logical);
+        }
+    }
+    return PHYS_UNKNOWN;
+}
+
+// Finish probing a file with result ret.
+static void file_done(struct sched_file *f, int ret)
+{
+    f->active = 0;
+    f->job->ret = ret;
+    mp4len_parser_result(&f->parser, &f->job->res);
+    if (f->fd >= 0) {
+        close(f->fd);
+        f->fd = -1;
+    }
+}
+
+// Open a file, start its parser and map both of its ends.
+static void file_start(struct sched_file *f)
+{
+    struct stat st;
+
+    memset(&f->job->res, 0, sizeof(f->job->res));
+    f->fd = open(f->job->path, O_RDONLY | O_CLOEXEC);
+    if (f->fd < 0) {
+        f->job->ret = MP4LEN_ERR_OPEN;
+        return;
+    }
+    if (fstat(f->fd, &st)) {
+        close(f->fd);
+        f->fd = -1;
+        f->job->ret = MP4LEN_ERR_MAGIC_SEEK;
+        return;
+    }
+    mp4len_parser_init(&f->parser, st.st_size);
+    f->active = 1;
+    if (mp4len_parser_want(&f->parser, &f->want_off, &f->want_len)
+        != MP4LEN_AGAIN) {
+        file_done(f, f->parser.result);
+        return;
+    }
+    map_range(f, 0, MAP_RANGE);
+    if (st.st_size > MAP_RANGE) {
+        map_range(f, st.st_size - MAP_RANGE, MAP_RANGE);
+    }
+}
+
+// Return 1 if f's buffer already holds the bytes it wants.
+static int in_buf(const struct sched_file *f)
+{
+    return (f->want_off >= f->buf_off)
+        && (f->want_off + f->want_len <= f->buf_off + f->buf_len);
+}
+
+// Return a pointer to the bytes f wants and set *len to how many of them
+// there are, reading them into f's buffer if it does not already hold them.
+// *phys is set to the physical offset read, or PHYS_UNKNOWN if nothing was
+// read or its place is unknown.
+static const unsigned char *file_read(struct sched_file *f, long long *len,
+                                      unsigned long long *phys)
+{
+    long long start, end;
+    ssize_t n_read;
+
+    *phys = PHYS_UNKNOWN;
+    if (in_buf(f)) {
+        *len = f->want_len;
+        return f->buf + (f->want_off - f->buf_off);
+    }
+
+    // read the whole block-aligned block if the wanted bytes fit in one
+    start = f->want_off / MP4LEN_BLOCK_SIZE * MP4LEN_BLOCK_SIZE;
+    end = start + MP4LEN_BLOCK_SIZE;
+    if (f->want_off + f->want_len > end) {
+        start = f->want_off;
+        end = f->want_off + f->want_len;
+        if (end > start + MP4LEN_BLOCK_SIZE) {
+            end = start + MP4LEN_BLOCK_SIZE;
+        }
+    }
+    if (end > f->parser.fsize) {
+        end = f->parser.fsize;
+    }
+
+    *phys = phys_of(f, start);
+    do {
+        n_read = (f->read != NULL)
+            ? (ssize_t)f->read(f->read_arg, f->fd, f->buf, end - start, start)
+            : pread(f->fd, f->buf, end - start, (off_t)start);
+    } while ((n_read < 0) && (errno == EINTR));
+    f->buf_off = start;
+    f->buf_len = (n_read < 0) ? 0 : n_read;
+    if (f->want_off - start >= f->buf_len) {
+        // reported by the parser as a short read
+        *len = 0;
+        return f->buf;
+    }
+    *len = f->buf_len - (f->want_off - start);
+    return f->buf + (f->want_off - start);
+}
+
+// Head movement from pos to phys.
+static unsigned long long distance(unsigned long long pos,
+                                   unsigned long long phys)
+{
+    return (phys > pos) ? phys - pos : pos - phys;
+}
+
+// Probe n_jobs files together, reading in elevator order.
+void sched_probe(struct batch_job **jobs, mp4len_ctx **ctxs, int n_jobs,
+                 struct sched_stats *stats, mp4len_read_fn read,
+                 void *read_arg)
+{
+    struct sched_file files[SCHED_MAX_FILES], *f;
+    size_t buf_len;
+    unsigned long long pos = PHYS_UNKNOWN; // physical end of the last read
+    unsigned long long phys, dist, best;
+    const unsigned char *data;
+    int up = 1; // sweeping towards higher offsets
+    int pick, pick_unknown;
+    long long len;
+    int ret;
+
+    memset(files, 0, n_jobs * sizeof(struct sched_file));
+    for (int ii = 0; ii < n_jobs; ii++) {
+        files[ii].job = jobs[ii];
+        files[ii].fd = -1;
+        files[ii].read = read;
+        files[ii].read_arg = read_arg;
+        files[ii].buf = mp4len_ctx_buf(ctxs[ii], &buf_len);
+        file_start(&files[ii]);
+    }
+
+    for (;;) {
+        // bytes already read first, then the nearest read in the direction
+        // of the sweep, turning round when there are none left that way,
+        // else one whose place is unknown
+        pick = pick_unknown = -1;
+        for (int ii = 0; (ii < n_jobs) && (pick < 0); ii++) {
+            if (files[ii].active && in_buf(&files[ii])) {
+                pick = ii;
+            }
+        }
+        for (int turn = 0; (turn < 2) && (pick < 0); turn++) {
+            best = PHYS_UNKNOWN;
+            for (int ii = 0; ii < n_jobs; ii++) {
+                if (!files[ii].active) {
+                    continue;
+                }
+                phys = phys_of(&files[ii], files[ii].want_off);
+                if (phys == PHYS_UNKNOWN) {
+                    if (pick_unknown < 0) {
+                        pick_unknown = ii;
+                    }
+                    continue;
+                }
+                if (pos == PHYS_UNKNOWN) {
+                    dist = phys;
+                }
+                else if (up ? (phys >= pos) : (phys <= pos)) {
+                    dist = distance(pos, phys);
+                }
+                else {
+                    continue;
+                }
+                if (dist < best) {
+                    best = dist;
+                    pick = ii;
+                }
+            }
+            if (pick < 0) {
+                up = !up;
+            }
+        }
+        if (pick < 0) {
+            pick = pick_unknown;
+        }
+        if (pick < 0) {
+            break;
+        }
+
+        f = &files[pick];
+        data = file_read(f, &len, &phys);
+        if (phys != PHYS_UNKNOWN) {
+            stats->reads += 1;
+            if (pos != PHYS_UNKNOWN) {
+                stats->seek += distance(pos, phys);
+            }
+            pos = phys + f->buf_len;
+            if (f->n_log < MAX_LOG) {
+                f->log_phys[f->n_log] = phys;
+                f->log_len[f->n_log] = f->buf_len;
+                f->n_log += 1;
+            }
+        }
+
+        ret = mp4len_parser_feed(&f->parser, data, len);
+        if (ret != MP4LEN_AGAIN) {
+            file_done(f, ret);
+        }
+        else {
+            mp4len_parser_want(&f->parser, &f->want_off, &f->want_len);
+        }
+    }
+
+    // what the same reads would have cost one file after another
+    pos = PHYS_UNKNOWN;
+    for (int ii = 0; ii < n_jobs; ii++) {
+        for (int jj = 0; jj < files[ii].n_log; jj++) {
+            if (pos != PHYS_UNKNOWN) {
+                stats->seek_file_order += distance(pos,
+                                                   files[ii].log_phys[jj]);
+            }
+            pos = files[ii].log_phys[jj] + files[ii].log_len[jj];
+        }
+    }
+}
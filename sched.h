@@ -0,0 +1,38 @@
+/* sched
+   Probes a group of files together, reading in order of where their bytes
+   lie on disk, for the mp4len command.
+
+   Nicholas A. Masluk
+   nick@randombytes.net
+   Copyright 2023
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef SCHED_H
+#define SCHED_H
+
+#include "batch.h"
+
+#define SCHED_MAX_FILES 64 // most files probed together
+
+// Head movement over one group of files.
+struct sched_stats {
+    unsigned long long reads; // reads with a known physical offset
+    unsigned long long seek; // bytes of head movement between them
+    unsigned long long seek_file_order; // the same, reading file by file
+};
+
+// Probe n_jobs files (at most SCHED_MAX_FILES) together.  Each file's
+// physical extents are looked up with FIEMAP, and the reads all files want
+// next are served in elevator order: the nearest one onwards in the
+// direction the last reads went, turning round when there are none left
+// that way.  Reads whose physical offset is unknown come last.  Reads are
+// made with read, or pread() if NULL, each file reading into the buffer of
+// its own context in ctxs, of at least MP4LEN_BLOCK_SIZE bytes, so that
+// nothing is allocated.  Fills in each job's ret and res, and adds to
+// *stats.
+void sched_probe(struct batch_job **jobs, mp4len_ctx **ctxs, int n_jobs,
+                 struct sched_stats *stats, mp4len_read_fn read,
+                 void *read_arg);
+
+#endif
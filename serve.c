@@ -0,0 +1,807 @@
+/* serve
+   Answers probes from other processes over a Unix domain socket for the
+   mp4len command, and the client that asks them.
+
+   One thread waits on every connection with epoll, reads requests and
+   hands each to the batch workers.  As each finishes, its worker formats
+   the reply, puts it on a list and wakes the epoll thread with an eventfd,
+   and the epoll thread writes the replies of each connection in the order
+   their requests came.  The epoll thread never waits on the batch: while
+   as many requests are in flight as the batch window holds, no more are
+   read until replies make room.  Only the epoll thread touches
+   connections, and a connection that goes away is kept until every
+   request it sent is done, then freed once the events in hand have been
+   dealt with.
+
+   On SIGINT or SIGTERM the socket is closed and removed, no further
+   requests are read, and the server returns once every request already
+   read has been answered.  A connection whose other end has not closed
+   DRAIN_SECS after that is closed anyway.
+
+   Nicholas A. Masluk
+   nick@randombytes.net
+   Copyright 2023
+   Mozilla Public License Version 2.0
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "serve.h"
+
+#define MAX_LINE PATH_MAX // longest request, newline included
+#define MAX_EVENTS 64
+#define MAX_REPLY 128 // longest reply line
+#define MAX_CONN_REQUESTS 1024 // requests in flight before reading stops
+#define MAX_CONN_OUT 65536 // reply bytes unsent before reading stops
+#define DRAIN_SECS 10.0 // longest wait for connections to close once draining
+
+struct conn;
+
+// One request, from being read until its reply is queued to be sent.
+struct request {
+    struct conn *conn;
+    struct request *next; // next from the same connection
+    struct request *done_next; // next on the server's finished list
+    int done; // reply is set
+    char reply[MAX_REPLY];
+};
+
+struct conn {
+    int fd; // -1 once closed
+    int eof; // no more requests will be read
+    int shut; // drained, waiting for the other end to close
+    char in[MAX_LINE];
+    size_t in_len;
+    char *out; // replies not yet sent
+    size_t out_off;
+    size_t out_len;
+    size_t out_cap;
+    struct request *first; // in flight, in the order read
+    struct request *last;
+    size_t n_req;
+    int ready; // on the server's ready list
+    int dead; // on the server's dead list
+    struct conn *ready_next;
+    struct conn *prev; // in the server's list of open connections, or
+    struct conn *next; // the dead list once closed
+};
+
+struct server {
+    const char *prog;
+    const char *path;
+    int epfd;
+    int lfd; // listening socket
+    int sfd; // signalfd
+    int efd; // eventfd, counts replies put on finished
+    struct batch *batch;
+    pthread_mutex_t lock; // guards finished
+    struct request *finished;
+    struct conn *conns;
+    struct conn *dead; // closed with nothing in flight, to be freed
+    unsigned long long in_flight; // requests read but not yet answered
+    size_t window; // most requests in flight before batch_submit() waits
+    int full; // requests were left unread for want of room
+    int draining;
+    double drain_end; // time connections still open are closed
+};
+
+// Marks on the listening socket, signal and event fds in epoll data, told
+// apart from connections by address.
+static char mark_listen, mark_signal, mark_event;
+
+// Seconds on a monotonic clock.
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Batch callback, from a worker thread: format the reply and hand the
+// request back to the epoll thread.
+static void emit_reply(void *arg, const struct batch_job *job)
+{
+    struct server *s = (struct server*)arg;
+    struct request *req = (struct request*)job->arg;
+    const struct mp4len_result *res = &job->res;
+    unsigned long long one = 1;
+
+    if (job->ret == 0) {
+        snprintf(req->reply, sizeof(req->reply), "%f\t%lu\t%llu\t%lld\n",
+                 res->len_sec, res->unit_per_sec, res->len_unit, res->fsize);
+    }
+    else {
+        snprintf(req->reply, sizeof(req->reply), "error\t%d\t%lld\n",
+                 job->ret, res->fsize);
+    }
+    pthread_mutex_lock(&s->lock);
+    req->done_next = s->finished;
+    s->finished = req;
+    pthread_mutex_unlock(&s->lock);
+    if (write(s->efd, &one, sizeof(one)) < 0) {
+        // the counter is already set, and the epoll thread will look
+    }
+}
+
+// Close a connection's socket, and once nothing is in flight, put it on
+// the dead list to be freed.
+static void conn_close(struct server *s, struct conn *c)
+{
+    if (c->fd >= 0) {
+        close(c->fd);
+        c->fd = -1;
+        if (c->prev) {
+            c->prev->next = c->next;
+        }
+        else {
+            s->conns = c->next;
+        }
+        if (c->next) {
+            c->next->prev = c->prev;
+        }
+    }
+    if ((c->n_req == 0) && !c->dead) {
+        c->dead = 1;
+        c->next = s->dead;
+        s->dead = c;
+    }
+}
+
+// Free the connections on the dead list.
+static void free_dead(struct server *s)
+{
+    struct conn *c;
+
+    while (s->dead != NULL) {
+        c = s->dead;
+        s->dead = c->next;
+        free(c->out);
+        free(c);
+    }
+}
+
+// Return 1 if the batch has no room for another request.  The worker that
+// sent the last reply may hold its slot a moment longer, so batch_submit()
+// can still wait for that, but never on a probe.
+static int server_full(const struct server *s)
+{
+    return s->in_flight >= s->window;
+}
+
+// Set which events to wait for on a connection: requests while it is open,
+// the batch has room and it is not too far behind, and room to write while
+// replies are waiting.
+static void conn_events(struct server *s, struct conn *c)
+{
+    struct epoll_event ev = {0};
+
+    if (server_full(s)) {
+        // resume_reading() is owed once there is room
+        s->full = 1;
+    }
+    if ((!c->eof && !s->draining && !server_full(s)
+         && (c->n_req < MAX_CONN_REQUESTS)
+         && (c->out_len - c->out_off < MAX_CONN_OUT)) || c->shut) {
+        ev.events |= EPOLLIN;
+    }
+    if (c->out_off < c->out_len) {
+        ev.events |= EPOLLOUT;
+    }
+    ev.data.ptr = c;
+    epoll_ctl(s->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+// Send as much of a connection's waiting replies as the socket will take,
+// closing it once it is done with or broken.
+static void conn_write(struct server *s, struct conn *c)
+{
+    ssize_t n_sent;
+
+    while (c->out_off < c->out_len) {
+        n_sent = send(c->fd, c->out + c->out_off, c->out_len - c->out_off,
+                      MSG_NOSIGNAL);
+        if (n_sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                break;
+            }
+            conn_close(s, c);
+            return;
+        }
+        c->out_off += n_sent;
+    }
+    if (c->out_off == c->out_len) {
+        c->out_off = 0;
+        c->out_len = 0;
+    }
+    if (c->eof && (c->n_req == 0) && (c->out_len == 0)
+        && ((c->in_len == 0) || s->draining)) {
+        conn_close(s, c);
+        return;
+    }
+    if (s->draining && !c->shut && (c->n_req == 0) && (c->out_len == 0)) {
+        // closing with requests unread would reset the connection and
+        // could lose replies not yet read, so wait for the other end
+        shutdown(c->fd, SHUT_WR);
+        c->shut = 1;
+    }
+    conn_events(s, c);
+}
+
+// Append a reply to a connection's waiting output.
+// Return 0 if successful, or -1 if out of memory.
+static int conn_append(struct conn *c, const char *reply)
+{
+    size_t len = strlen(reply);
+    char *out;
+
+    if (c->out_len + len > c->out_cap) {
+        out = (char*)realloc(c->out, 2 * (c->out_len + len));
+        if (out == NULL) {
+            return -1;
+        }
+        c->out = out;
+        c->out_cap = 2 * (c->out_len + len);
+    }
+    memcpy(c->out + c->out_len, reply, len);
+    c->out_len += len;
+    return 0;
+}
+
+// Queue the replies of a connection's requests that are done, in order.
+// A connection already closed just drops them, and is put on the dead list
+// with the last.
+// Return 1 if the connection is closed.
+static int conn_replies(struct server *s, struct conn *c)
+{
+    struct request *req;
+
+    while ((c->first != NULL) && c->first->done) {
+        req = c->first;
+        c->first = req->next;
+        if (c->first == NULL) {
+            c->last = NULL;
+        }
+        if ((c->fd >= 0) && conn_append(c, req->reply)) {
+            // cannot reply in order any more
+            fprintf(stderr, "%s: %s\n", s->prog, strerror(ENOMEM));
+            conn_close(s, c);
+        }
+        free(req);
+        c->n_req -= 1;
+        s->in_flight -= 1;
+    }
+    if (c->fd < 0) {
+        conn_close(s, c);
+        return 1;
+    }
+    return 0;
+}
+
+// Start probing one request line from a connection.
+static void conn_request(struct server *s, struct conn *c, const char *path)
+{
+    struct request *req;
+
+    req = (struct request*)calloc(1, sizeof(struct request));
+    if (req == NULL) {
+        fprintf(stderr, "%s: %s: %s\n", s->prog, path, strerror(ENOMEM));
+        c->eof = 1;
+        return;
+    }
+    req->conn = c;
+    if (c->last) {
+        c->last->next = req;
+    }
+    else {
+        c->first = req;
+    }
+    c->last = req;
+    c->n_req += 1;
+    s->in_flight += 1;
+    if (batch_submit(s->batch, path, req)) {
+        snprintf(req->reply, sizeof(req->reply), "error\t%d\t0\n",
+                 MP4LEN_ERR_NOMEM);
+        req->done = 1;
+    }
+}
+
+// Start probing the whole requests read from a connection, as many as the
+// batch has room for, and send what replies are ready.  The rest are kept
+// for resume_reading().
+static void conn_parse(struct server *s, struct conn *c)
+{
+    char *start, *nl = NULL;
+
+    start = c->in;
+    while (!s->draining && !(s->full = server_full(s))
+           && ((nl = memchr(start, '\n', c->in_len - (start - c->in)))
+               != NULL)) {
+        *nl = '\0';
+        if (nl > start) {
+            conn_request(s, c, start);
+        }
+        start = nl + 1;
+    }
+    c->in_len -= start - c->in;
+    memmove(c->in, start, c->in_len);
+    if (s->draining || s->full) {
+        // left for later, or never taken
+    }
+    else if (c->in_len == sizeof(c->in)) {
+        fprintf(stderr, "%s: request too long\n", s->prog);
+        c->eof = 1;
+        c->in_len = 0;
+    }
+    else if (c->eof && (c->in_len > 0)) {
+        // the last request need not end in a newline
+        c->in[c->in_len] = '\0';
+        conn_request(s, c, c->in);
+        c->in_len = 0;
+    }
+    if (!conn_replies(s, c)) {
+        conn_write(s, c);
+    }
+}
+
+// Read what requests have come on a connection and start probing them.
+static void conn_read(struct server *s, struct conn *c)
+{
+    ssize_t n_read;
+
+    if (c->shut) {
+        // no more requests taken, wait for the other end to close
+        n_read = read(c->fd, c->in, sizeof(c->in));
+        if ((n_read == 0) || ((n_read < 0) && (errno != EINTR)
+                              && (errno != EAGAIN))) {
+            conn_close(s, c);
+        }
+        return;
+    }
+    if (s->draining) {
+        return;
+    }
+    if (server_full(s)) {
+        // left unread until replies make room
+        conn_events(s, c);
+        return;
+    }
+    n_read = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+    if ((n_read < 0) && ((errno == EINTR) || (errno == EAGAIN)
+                         || (errno == EWOULDBLOCK))) {
+        return;
+    }
+    if (n_read <= 0) {
+        // half closed, still answer what was asked
+        c->eof = 1;
+    }
+    else {
+        c->in_len += n_read;
+    }
+    conn_parse(s, c);
+}
+
+// Once replies have made room in the batch, start the requests read but
+// left waiting, and read from every connection again.
+static void resume_reading(struct server *s)
+{
+    struct conn *next;
+
+    s->full = 0;
+    for (struct conn *c = s->conns; c != NULL; c = next) {
+        next = c->next;
+        if (c->in_len > 0) {
+            conn_parse(s, c);
+        }
+        else {
+            conn_events(s, c);
+        }
+    }
+}
+
+// Take a new connection.
+static void accept_conn(struct server *s)
+{
+    struct epoll_event ev = {0};
+    struct conn *c;
+    int fd;
+
+    fd = accept(s->lfd, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    c = (struct conn*)calloc(1, sizeof(struct conn));
+    if (c == NULL) {
+        fprintf(stderr, "%s: %s\n", s->prog, strerror(ENOMEM));
+        close(fd);
+        return;
+    }
+    c->fd = fd;
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+        close(fd);
+        free(c);
+        return;
+    }
+    c->next = s->conns;
+    if (c->next) {
+        c->next->prev = c;
+    }
+    s->conns = c;
+}
+
+// Queue every reply the workers have finished.
+static void take_finished(struct server *s)
+{
+    struct request *req, *list;
+    struct conn *ready = NULL, *c;
+    unsigned long long count;
+
+    if (read(s->efd, &count, sizeof(count)) < 0) {
+        // nothing new after all
+    }
+    pthread_mutex_lock(&s->lock);
+    list = s->finished;
+    s->finished = NULL;
+    pthread_mutex_unlock(&s->lock);
+
+    // requests are freed as their replies are queued, so gather their
+    // connections first
+    for (req = list; req != NULL; req = req->done_next) {
+        req->done = 1;
+        if (!req->conn->ready) {
+            req->conn->ready = 1;
+            req->conn->ready_next = ready;
+            ready = req->conn;
+        }
+    }
+    while (ready != NULL) {
+        c = ready;
+        ready = c->ready_next;
+        c->ready = 0;
+        if (!conn_replies(s, c)) {
+            conn_write(s, c);
+        }
+    }
+}
+
+// Stop taking requests, answering those already taken.  The signal is
+// taken and the signalfd dropped from epoll, which would otherwise report
+// it on every wait.
+static void start_draining(struct server *s)
+{
+    struct signalfd_siginfo info;
+
+    if (read(s->sfd, &info, sizeof(info)) < 0) {
+        // dropped from epoll all the same
+    }
+    epoll_ctl(s->epfd, EPOLL_CTL_DEL, s->sfd, NULL);
+    s->draining = 1;
+    s->drain_end = now() + DRAIN_SECS;
+    close(s->lfd);
+    s->lfd = -1;
+    unlink(s->path);
+    for (struct conn *c = s->conns, *next; c != NULL; c = next) {
+        next = c->next;
+        conn_write(s, c);
+    }
+}
+
+// Open the listening socket on s->path.
+// Return 0 if successful, or -1 with errno set.
+static int listen_on(struct server *s)
+{
+    struct sockaddr_un addr = {0};
+
+    if (strlen(s->path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, s->path);
+    s->lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s->lfd < 0) {
+        return -1;
+    }
+    if (bind(s->lfd, (struct sockaddr*)&addr, sizeof(addr))
+        || listen(s->lfd, SOMAXCONN)) {
+        return -1;
+    }
+    return 0;
+}
+
+// Listen on the socket and answer requests until SIGINT or SIGTERM.
+// Return 0 if successful, or MP4LEN_ERR_OPEN or MP4LEN_ERR_NOMEM.
+int serve_socket(const struct serve_opts *opts)
+{
+    struct epoll_event ev = {0}, events[MAX_EVENTS];
+    struct batch_opts bopt = {0};
+    struct server s = {0};
+    sigset_t sigs;
+    double left;
+    int n_events, wait_ms, ret = 0;
+    struct conn *c;
+    void *ptr;
+
+    s.prog = opts->prog;
+    s.path = opts->path;
+    s.lfd = s.sfd = s.efd = -1;
+    pthread_mutex_init(&s.lock, NULL);
+
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    // before any worker starts, so they all keep the signals blocked
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+    s.sfd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+    s.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    s.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if ((s.sfd < 0) || (s.efd < 0) || (s.epfd < 0) || listen_on(&s)) {
+        fprintf(stderr, "%s: %s: %s\n", s.prog, s.path, strerror(errno));
+        ret = MP4LEN_ERR_OPEN;
+        goto out;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = &mark_listen;
+    epoll_ctl(s.epfd, EPOLL_CTL_ADD, s.lfd, &ev);
+    ev.data.ptr = &mark_signal;
+    epoll_ctl(s.epfd, EPOLL_CTL_ADD, s.sfd, &ev);
+    ev.data.ptr = &mark_event;
+    epoll_ctl(s.epfd, EPOLL_CTL_ADD, s.efd, &ev);
+
+    bopt.jobs = opts->jobs;
+    bopt.order = BATCH_ORDER_COMPLETION;
+    bopt.window = opts->window;
+    bopt.cache = opts->cache;
+    bopt.emit = emit_reply;
+    bopt.emit_arg = &s;
+    s.batch = batch_start(&bopt);
+    if (s.batch == NULL) {
+        fprintf(stderr, "%s: %s\n", s.prog, mp4len_strerror(MP4LEN_ERR_NOMEM));
+        unlink(s.path);
+        ret = MP4LEN_ERR_NOMEM;
+        goto out;
+    }
+    s.window = batch_window(s.batch);
+
+    while (!s.draining || (s.in_flight > 0) || (s.conns != NULL)) {
+        wait_ms = -1;
+        if (s.draining && (s.conns != NULL)) {
+            left = s.drain_end - now();
+            if (left <= 0) {
+                // the other ends are slow to close, or never will
+                while (s.conns != NULL) {
+                    conn_close(&s, s.conns);
+                }
+                free_dead(&s);
+                continue;
+            }
+            wait_ms = (int)(left * 1000) + 1;
+        }
+        n_events = epoll_wait(s.epfd, events, MAX_EVENTS, wait_ms);
+        if ((n_events < 0) && (errno != EINTR)) {
+            fprintf(stderr, "%s: %s\n", s.prog, strerror(errno));
+            break;
+        }
+        for (int ii = 0; ii < n_events; ii++) {
+            ptr = events[ii].data.ptr;
+            if (ptr == &mark_listen) {
+                if (!s.draining) {
+                    accept_conn(&s);
+                }
+            }
+            else if (ptr == &mark_signal) {
+                start_draining(&s);
+            }
+            else if (ptr == &mark_event) {
+                take_finished(&s);
+            }
+            else if ((c = (struct conn*)ptr)->fd < 0) {
+                // closed by an earlier event
+            }
+            else if ((events[ii].events & EPOLLERR)
+                     || ((events[ii].events & EPOLLHUP)
+                         && (c->eof || c->shut || server_full(&s)))) {
+                // nobody left to answer
+                conn_close(&s, c);
+            }
+            else if (events[ii].events & (EPOLLIN | EPOLLHUP)) {
+                conn_read(&s, c);
+            }
+            else if (events[ii].events & EPOLLOUT) {
+                conn_write(&s, c);
+            }
+        }
+        if (s.full && !s.draining && !server_full(&s)) {
+            resume_reading(&s);
+        }
+        free_dead(&s);
+    }
+    batch_finish(s.batch, NULL);
+
+out:
+    while (s.conns != NULL) {
+        conn_close(&s, s.conns);
+    }
+    free_dead(&s);
+    if (s.lfd >= 0) {
+        close(s.lfd);
+        if (ret == 0) {
+            unlink(s.path);
+        }
+    }
+    if (s.epfd >= 0) {
+        close(s.epfd);
+    }
+    if (s.efd >= 0) {
+        close(s.efd);
+    }
+    if (s.sfd >= 0) {
+        close(s.sfd);
+    }
+    pthread_mutex_destroy(&s.lock);
+    return ret;
+}
+
+// Parse a reply line into *ret and *res.
+// Return 0 if successful, or -1 if it is not a reply.
+static int parse_reply(const char *line, int *ret, struct mp4len_result *res)
+{
+    memset(res, 0, sizeof(*res));
+    if (strncmp(line, "error\t", 6) == 0) {
+        return (sscanf(line + 6, "%d\t%lld", ret, &res->fsize) == 2) ? 0 : -1;
+    }
+    *ret = 0;
+    return (sscanf(line, "%lf\t%lu\t%llu\t%lld", &res->len_sec,
+                   &res->unit_per_sec, &res->len_unit, &res->fsize) == 4)
+        ? 0 : -1;
+}
+
+// Set *req to the request line for path, made absolute from cwd.
+// Return 0 if successful, or -1 if out of memory.
+static int make_request(char **req, size_t *req_len, const char *cwd,
+                        const char *path)
+{
+    size_t len = strlen(cwd) + strlen(path) + 3;
+
+    free(*req);
+    *req = (char*)malloc(len);
+    if (*req == NULL) {
+        return -1;
+    }
+    if (path[0] == '/') {
+        *req_len = snprintf(*req, len, "%s\n", path);
+    }
+    else {
+        *req_len = snprintf(*req, len, "%s/%s\n", cwd, path);
+    }
+    return 0;
+}
+
+// Ask the server listening on socket_path to probe each path.
+// Return 0 if every path got a reply, or an error code.
+int serve_client(const char *prog, const char *socket_path, char **paths,
+                 int n_paths, serve_reply_fn reply, void *reply_arg)
+{
+    struct sockaddr_un addr = {0};
+    struct mp4len_result res;
+    struct pollfd pfd;
+    char cwd[PATH_MAX], in[MAX_REPLY], *nl, *start;
+    char *req = NULL;
+    size_t req_len = 0, req_off = 0, in_len = 0;
+    ssize_t n;
+    int n_sent = 0, n_got = 0, code, ret = 0;
+
+    for (int ii = 0; ii < n_paths; ii++) {
+        if (strchr(paths[ii], '\n') != NULL) {
+            fprintf(stderr, "%s: %s: %s\n", prog, paths[ii],
+                    "newline in path");
+            return MP4LEN_ERR_USAGE;
+        }
+    }
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        cwd[0] = '\0';
+    }
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: %s: %s\n", prog, socket_path,
+                strerror(ENAMETOOLONG));
+        return MP4LEN_ERR_OPEN;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    pfd.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ((pfd.fd < 0)
+        || connect(pfd.fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        fprintf(stderr, "%s: %s: %s\n", prog, socket_path, strerror(errno));
+        if (pfd.fd >= 0) {
+            close(pfd.fd);
+        }
+        return MP4LEN_ERR_OPEN;
+    }
+
+    // send requests while reading replies, so neither side fills up
+    while ((n_got < n_paths) && (ret == 0)) {
+        if ((req_off == req_len) && (n_sent < n_paths)) {
+            if (make_request(&req, &req_len, cwd, paths[n_sent])) {
+                fprintf(stderr, "%s: %s\n", prog, strerror(ENOMEM));
+                ret = MP4LEN_ERR_NOMEM;
+                break;
+            }
+            req_off = 0;
+            n_sent += 1;
+        }
+        pfd.events = POLLIN | ((req_off < req_len) ? POLLOUT : 0);
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ret = MP4LEN_ERR_OPEN;
+            break;
+        }
+
+        if (pfd.revents & POLLOUT) {
+            n = send(pfd.fd, req + req_off, req_len - req_off,
+                     MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n > 0) {
+                req_off += n;
+            }
+        }
+        if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR))) {
+            continue;
+        }
+        n = recv(pfd.fd, in + in_len, sizeof(in) - in_len, MSG_DONTWAIT);
+        if ((n < 0) && ((errno == EINTR) || (errno == EAGAIN))) {
+            continue;
+        }
+        if (n <= 0) {
+            fprintf(stderr, "%s: %s: %s\n", prog, socket_path,
+                    (n < 0) ? strerror(errno) : "server went away");
+            ret = MP4LEN_ERR_OPEN;
+            break;
+        }
+        in_len += n;
+        start = in;
+        while ((nl = memchr(start, '\n', in_len - (start - in))) != NULL) {
+            *nl = '\0';
+            if ((n_got == n_paths) || parse_reply(start, &code, &res)) {
+                fprintf(stderr, "%s: %s: bad reply: %s\n", prog,
+                        socket_path, start);
+                ret = MP4LEN_ERR_OPEN;
+                break;
+            }
+            reply(reply_arg, paths[n_got++], code, &res);
+            start = nl + 1;
+        }
+        in_len -= start - in;
+        memmove(in, start, in_len);
+        if (in_len == sizeof(in)) {
+            fprintf(stderr, "%s: %s: bad reply\n", prog, socket_path);
+            ret = MP4LEN_ERR_OPEN;
+        }
+    }
+    free(req);
+    close(pfd.fd);
+    return ret;
+}
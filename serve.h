@@ -0,0 +1,51 @@
+/* serve
+   Answers probes from other processes over a Unix domain socket for the
+   mp4len command, and the client that asks them.
+
+   Each request is a path and a newline.  Each reply is a line, in the
+   order the requests were sent on the connection, of either
+   "LENGTH<TAB>UNITS_PER_SEC<TAB>LENGTH_UNITS<TAB>FILE_SIZE" or
+   "error<TAB>CODE<TAB>FILE_SIZE".
+
+   Nicholas A. Masluk
+   nick@randombytes.net
+   Copyright 2023
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <stddef.h>
+
+#include "mp4len.h"
+
+struct serve_opts {
+    const char *prog; // for error messages
+    const char *path; // socket to listen on
+    int jobs; // worker threads
+    size_t window; // most requests being probed at once, 0 for default
+    mp4len_cache *cache; // results to look files up in first, or NULL
+};
+
+// Called by serve_client with each reply, in the order of paths.
+typedef void (*serve_reply_fn)(void *arg, const char *path, int ret,
+                               const struct mp4len_result *res);
+
+// Listen on the socket and answer requests until SIGINT or SIGTERM, then
+// stop taking requests, answer every one already taken and return once
+// every connection has closed, closing those still open after a while.
+// Return 0 if successful, or MP4LEN_ERR_OPEN or MP4LEN_ERR_NOMEM if the
+// server could not be started.
+int serve_socket(const struct serve_opts *opts);
+
+// Ask the server listening on socket_path to probe each path, relative
+// paths being taken from the current directory, and pass each reply to
+// reply.
+// Return 0 if every path got a reply, MP4LEN_ERR_OPEN if the server could
+// not be reached or went away, MP4LEN_ERR_USAGE for a path with a newline
+// in it, or MP4LEN_ERR_NOMEM.
+int serve_client(const char *prog, const char *socket_path, char **paths,
+                 int n_paths, serve_reply_fn reply, void *reply_arg);
+
+#endif
@@ -0,0 +1,136 @@
+/* alloc
+   Checks that probing a file allocates no memory once the context is made,
+   for make check.  Linked with --wrap for each allocator, so every
+   allocation libmp4len makes is counted here.
+
+   Nicholas A. Masluk
+   nick@randombytes.net
+   Copyright 2023
+   Mozilla Public License Version 2.0
+*/
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mp4len.h"
+
+#define PROBES 1000 // probes of each kind after warming up
+#define FILE_SIZE (3 * MP4LEN_BLOCK_SIZE + 100) // test file, several blocks
+
+static unsigned long long n_allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+int __real_posix_memalign(void **ptr, size_t align, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    n_allocs += 1;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+    n_allocs += 1;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    n_allocs += 1;
+    return __real_realloc(ptr, size);
+}
+
+int __wrap_posix_memalign(void **ptr, size_t align, size_t size)
+{
+    n_allocs += 1;
+    return __real_posix_memalign(ptr, align, size);
+}
+
+// Write a file of FILE_SIZE bytes, "ftypisom" at the start and a version 0
+// "mvhd" box of 90000 units per second and 900000 units in the middle, so
+// the search goes through more than one block.
+// Return the open file, or -1.
+static int make_file(char *path)
+{
+    static unsigned char data[FILE_SIZE];
+    unsigned char *mvhd = data + FILE_SIZE / 2;
+    int fd;
+
+    memcpy(data, "\0\0\0\x14" "ftypisom", 12);
+    memcpy(mvhd, "\0\0\0\x6c" "mvhd", 8);
+    memcpy(mvhd + 20, "\0\x01\x5f\x90" "\0\x0d\xbb\xa0", 8);
+    fd = mkstemp(path);
+    if ((fd < 0) || (write(fd, data, sizeof(data)) != sizeof(data))) {
+        return -1;
+    }
+    return fd;
+}
+
+// Probe the file every way a long-lived caller would, once.
+// Return 0 if every probe found the length, or -1.
+static int probe_all(mp4len_ctx *ctx, int fd, const char *path)
+{
+    struct mp4len_result res;
+    long long hdr_off;
+
+    if (mp4len_probe_fd(ctx, fd, &res) || (res.len_unit != 900000)) {
+        return -1;
+    }
+    hdr_off = res.hdr_off;
+    if (mp4len_probe_path(ctx, path, &res) || (res.len_unit != 900000)) {
+        return -1;
+    }
+    if (mp4len_probe_fd_hint(ctx, fd, hdr_off, &res)
+        || (res.len_unit != 900000)) {
+        return -1;
+    }
+    return 0;
+}
+
+int main(void)
+{
+    char path[] = "/tmp/mp4len-alloc-XXXXXX";
+    mp4len_pool *pool;
+    mp4len_ctx *ctx, *pooled;
+    unsigned long long before;
+    int fd, failed = 0;
+
+    fd = make_file(path);
+    ctx = mp4len_ctx_new();
+    pool = mp4len_pool_new(1);
+    pooled = pool ? mp4len_pool_get(pool) : NULL;
+    if ((fd < 0) || (ctx == NULL) || (pooled == NULL)
+        || probe_all(ctx, fd, path) || probe_all(pooled, fd, path)) {
+        fprintf(stderr, "alloc: could not set up the test\n");
+        failed = 1;
+    }
+
+    before = n_allocs;
+    for (int ii = 0; !failed && (ii < PROBES); ii++) {
+        failed = probe_all(ctx, fd, path) || probe_all(pooled, fd, path);
+    }
+    if (!failed && (n_allocs != before)) {
+        fprintf(stderr, "alloc: %llu allocations in %d probes\n",
+                n_allocs - before, 6 * PROBES);
+        failed = 1;
+    }
+    if (!failed) {
+        printf("alloc: no allocations in %d probes\n", 6 * PROBES);
+    }
+
+    if (pooled != NULL) {
+        mp4len_pool_put(pool, pooled);
+    }
+    mp4len_pool_free(pool);
+    mp4len_ctx_free(ctx);
+    if (fd >= 0) {
+        close(fd);
+        unlink(path);
+    }
+    return failed;
+}
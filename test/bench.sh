@@ -0,0 +1,51 @@
+#!/bin/sh
+# bench
+#   Prints files per second probing a synthetic corpus with 1 to 64
+#   workers, for make bench.  Local files answer too quickly to show what
+#   workers do on network storage, so each read is held up by LATENCY
+#   seconds (default 0.002, about a network round trip) with --fault-delay;
+#   LATENCY=0 measures the files as they are.
+#
+#   Usage: test/bench.sh [FILES] (default 2000)
+#
+#   Nicholas A. Masluk
+#   nick@randombytes.net
+#   Copyright 2023
+#   Mozilla Public License Version 2.0
+
+set -e
+
+MP4LEN=${MP4LEN:-./mp4len}
+FILES=${1:-2000}
+LATENCY=${LATENCY:-0.002}
+DIR=$(mktemp -d /tmp/mp4len-bench-XXXXXX)
+trap 'rm -rf "$DIR"' EXIT
+
+# one 256 KiB video, 10 seconds long, with its header at the end as most
+# cameras write it
+printf '\000\000\000\024ftypisom\000\000\000\000' > "$DIR/template"
+truncate -s 262036 "$DIR/template"
+printf '\000\000\000\154mvhd\000\000\000\000\000\000\000\000\000\000\000\000'\
+'\000\001\137\220\000\015\273\240' >> "$DIR/template"
+truncate -s 262144 "$DIR/template"
+
+mkdir "$DIR/corpus"
+i=0
+while [ "$i" -lt "$FILES" ]; do
+    cp "$DIR/template" "$DIR/corpus/$i.mp4"
+    i=$((i + 1))
+done
+rm "$DIR/template"
+
+if [ "$LATENCY" = 0 ]; then
+    FAULT=
+else
+    FAULT=--fault-delay=$LATENCY
+fi
+echo "$FILES files, $LATENCY s per read"
+printf 'workers\tfiles/s\n'
+for jobs in 1 2 4 8 16 32 64; do
+    rate=$("$MP4LEN" -r -j "$jobs" --stats $FAULT "$DIR/corpus" 2>&1 \
+           >/dev/null | sed -n 's/^files per second: //p')
+    printf '%s\t%s\n' "$jobs" "$rate"
+done
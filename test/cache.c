@@ -0,0 +1,95 @@
+/* cache
+   Checks that the result cache gives back what was put in it, for make
+   check: a success as a success, whatever its time scale, and a lasting
+   error as that error.
+
+   Nicholas A. Masluk
+   nick@randombytes.net
+   Copyright 2023
+   Mozilla Public License Version 2.0
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mp4len.h"
+
+// Put *res, or the error ret if not MP4LEN_OK, in the cache under a key of
+// its own, and look it up again.
+// Return 0 if the lookup gives back the same, or -1.
+static int round_trip(mp4len_cache *cache, unsigned long long ino, int ret,
+                      const struct mp4len_result *res, const char *what)
+{
+    struct mp4len_key key = {0};
+    struct mp4len_result got;
+    int got_ret;
+
+    key.dev = 1;
+    key.ino = ino;
+    key.size = res->fsize;
+    key.mtime_ns = 1;
+    key.ctime_ns = 1;
+    if (ret == MP4LEN_OK) {
+        mp4len_cache_put(cache, &key, res);
+    }
+    else {
+        mp4len_cache_put_error(cache, &key, ret);
+    }
+    got_ret = mp4len_cache_lookup(cache, &key, &got);
+    if ((got_ret != ret)
+        || ((ret == MP4LEN_OK)
+            && ((got.unit_per_sec != res->unit_per_sec)
+                || (got.len_unit != res->len_unit)
+                || (got.hdr_off != res->hdr_off)))) {
+        fprintf(stderr, "cache: %s came back as %d, %lu units per second, "
+                "%llu units\n", what, got_ret, got.unit_per_sec,
+                got.len_unit);
+        return -1;
+    }
+    return 0;
+}
+
+int main(void)
+{
+    char path[] = "/tmp/mp4len-cache-XXXXXX";
+    struct mp4len_result res = {0};
+    mp4len_cache *cache;
+    int fd, failed = 0;
+
+    fd = mkstemp(path);
+    cache = (fd >= 0) ? mp4len_cache_open(path, 0) : NULL;
+    if (cache == NULL) {
+        fprintf(stderr, "cache: could not set up the test\n");
+        if (fd >= 0) {
+            close(fd);
+            unlink(path);
+        }
+        return 1;
+    }
+
+    res.unit_per_sec = 90000;
+    res.len_unit = 900000;
+    res.fsize = 1000;
+    res.hdr_off = 100;
+    failed |= round_trip(cache, 1, MP4LEN_OK, &res, "a success");
+    // the length must not be taken for an error code
+    res.unit_per_sec = 0;
+    res.len_unit = MP4LEN_ERR_NOT_MP4;
+    failed |= round_trip(cache, 2, MP4LEN_OK, &res,
+                         "a success with no time scale");
+    res.len_unit = 0;
+    failed |= round_trip(cache, 3, MP4LEN_OK, &res,
+                         "a success with no time scale or length");
+    memset(&res, 0, sizeof(res));
+    failed |= round_trip(cache, 4, MP4LEN_ERR_NOT_MP4, &res, "an error");
+    if (!failed) {
+        printf("cache: results and errors kept apart\n");
+    }
+
+    mp4len_cache_close(cache);
+    close(fd);
+    unlink(path);
+    return failed ? 1 : 0;
+}
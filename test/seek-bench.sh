@@ -0,0 +1,92 @@
+#!/bin/sh
+# seek-bench
+#   Measures how far the disk heads would travel probing videos on an ext4
+#   loopback image in file order (--schedule=fifo) and in disk order
+#   (--schedule=physical), for make bench-seek.  The distance is measured
+#   from the requests the loop device is actually sent, traced with the
+#   block_rq_issue event with the page cache dropped first, not from the
+#   figures --stats works out.  Needs root, for the mount, the trace and
+#   dropping the cache.
+#
+#   Usage: test/seek-bench.sh [FILES] (default 300)
+#
+#   Nicholas A. Masluk
+#   nick@randombytes.net
+#   Copyright 2023
+#   Mozilla Public License Version 2.0
+
+set -e
+
+MP4LEN=$(realpath "${MP4LEN:-./mp4len}")
+FILES=${1:-300}
+TRACE=/sys/kernel/tracing
+DIR=$(mktemp -d /tmp/mp4len-seek-XXXXXX)
+
+if [ "$(id -u)" != 0 ]; then
+    echo "seek-bench: needs root" >&2
+    exit 1
+fi
+if [ ! -d "$TRACE/events/block" ]; then
+    mount -t tracefs nodev "$TRACE" 2>/dev/null || true
+fi
+if [ ! -d "$TRACE/events/block" ]; then
+    echo "seek-bench: no block trace events in $TRACE" >&2
+    exit 1
+fi
+cleanup() {
+    echo 0 > "$TRACE/events/block/block_rq_issue/enable" 2>/dev/null || true
+    umount "$DIR/mnt" 2>/dev/null || true
+    rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+# one 1 MiB video with its header at the end, as most cameras write it
+printf '\000\000\000\024ftypisom\000\000\000\000' > "$DIR/template"
+truncate -s 1048468 "$DIR/template"
+printf '\000\000\000\154mvhd\000\000\000\000\000\000\000\000\000\000\000\000'\
+'\000\001\137\220\000\015\273\240' >> "$DIR/template"
+truncate -s 1048576 "$DIR/template"
+
+truncate -s $((FILES * 2 + 64))M "$DIR/image"
+mkfs.ext4 -q -F "$DIR/image"
+mkdir "$DIR/mnt"
+mount -o loop "$DIR/image" "$DIR/mnt"
+dev=$(lsblk -no MAJ:MIN "$(findmnt -no SOURCE "$DIR/mnt")" | tr -d ' ' \
+      | tr : ,)
+
+# written in a shuffled order, so names and places on disk disagree as
+# they do after years of uploads
+seq "$FILES" | shuf | while read -r i; do
+    cp --sparse=never "$DIR/template" "$DIR/mnt/$(printf '%06d' "$i").mp4"
+done
+ls "$DIR/mnt"/*.mp4 > "$DIR/list"
+sync
+
+# Print the bytes of head movement between the traced requests to the loop
+# device, and their number.
+seek() {
+    awk -v dev="$dev" '
+        $0 ~ "block_rq_issue: " dev " " {
+            for (i = 1; i <= NF; i++) {
+                if ($i == "+") {
+                    sector = $(i - 1); len = $(i + 1)
+                }
+            }
+            if (n > 0) {
+                total += (sector > pos) ? sector - pos : pos - sector
+            }
+            pos = sector + len; n += 1
+        }
+        END { printf "%.1f MiB in %d requests\n", total * 512 / 1048576, n }
+    ' "$TRACE/trace"
+}
+
+echo "$FILES files of 1 MiB, header at the end"
+for sched in fifo physical; do
+    echo 3 > /proc/sys/vm/drop_caches
+    echo > "$TRACE/trace"
+    echo 1 > "$TRACE/events/block/block_rq_issue/enable"
+    "$MP4LEN" -j 1 --schedule="$sched" --files-from="$DIR/list" >/dev/null
+    echo 0 > "$TRACE/events/block/block_rq_issue/enable"
+    printf '%s\t%s\n' "$sched" "$(seek)"
+done
@@ -0,0 +1,531 @@
+/* walk
+   Walks directory trees in parallel for the mp4len command.
+
+   Each walker thread keeps a deque of directories still to read.  A thread
+   reads directories from the bottom of its own deque, pushing any
+   subdirectories found back onto the bottom, so it works depth first
+   through nearby directories.  A thread with nothing left steals from the
+   top of another thread's deque, taking the oldest and usually largest
+   subtree, or waits to be woken when more directories are queued.  The
+   roots all start out in the one set of threads.  Directories are read
+   with getdents64 and entries sorted out by their d_type, so entries are
+   only stat'ed when the file system does not report a type, or for
+   symbolic links that pass the filter.
+
+   Nicholas A. Masluk
+   nick@randombytes.net
+   Copyright 2023
+   Mozilla Public License Version 2.0
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "walk.h"
+
+#define DENTS_SIZE 65536 // bytes of directory entries to read at once
+#define MAX_THREADS 8 // default walker threads, at most
+
+// Directory entry as returned by getdents64
+struct linux_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// Directory entry types, see getdents64(2)
+enum {
+    TYPE_UNKNOWN = 0,
+    TYPE_DIR = 4,
+    TYPE_REG = 8,
+    TYPE_LNK = 10
+};
+
+// Directories still to read, owned by one walker thread.
+struct deque {
+    _Alignas(64) pthread_mutex_t lock;
+    char **items; // items[top] to items[bottom - 1] are queued
+    size_t top;
+    size_t bottom;
+    size_t cap;
+};
+
+struct walker {
+    struct deque *deques;
+    int n_threads;
+    _Atomic unsigned long long pending; // directories queued or being read
+    _Atomic unsigned long long pushed; // directories ever queued
+    _Atomic int idle; // threads waiting for work
+    pthread_mutex_t idle_lock;
+    pthread_cond_t work; // more queued, or none left to read
+    _Atomic unsigned long long errors;
+    _Atomic unsigned long long skipped; // files the filter passed over
+    const struct walk_opts *opts;
+};
+
+struct walk_thread {
+    struct walker *w;
+    int id;
+    char *dents; // getdents64 buffer
+    char *path; // path of the entry being looked at
+    size_t path_cap;
+};
+
+// Add each extension in a comma separated list to the filter.
+// Return 0 if successful, or -1 if out of memory.
+int walk_add_exts(struct walk_filter *f, const char *list)
+{
+    const char *start = list;
+    const char *end;
+    char **exts;
+
+    while (*start != '\0') {
+        end = strchr(start, ',');
+        if (end == NULL) {
+            end = start + strlen(start);
+        }
+        if (*start == '.') {
+            start++;
+        }
+        if (end > start) {
+            exts = (char**)realloc(f->exts, (f->n_exts + 1) * sizeof(char*));
+            if (exts == NULL) {
+                return -1;
+            }
+            f->exts = exts;
+            f->exts[f->n_exts] = strndup(start, end - start);
+            if (f->exts[f->n_exts] == NULL) {
+                return -1;
+            }
+            f->n_exts += 1;
+        }
+        start = (*end == ',') ? end + 1 : end;
+    }
+    return 0;
+}
+
+// Add a glob to the filter.
+// Return 0 if successful, or -1 if out of memory.
+int walk_add_glob(struct walk_filter *f, const char *glob)
+{
+    char **globs;
+
+    globs = (char**)realloc(f->globs, (f->n_globs + 1) * sizeof(char*));
+    if (globs == NULL) {
+        return -1;
+    }
+    f->globs = globs;
+    f->globs[f->n_globs] = strdup(glob);
+    if (f->globs[f->n_globs] == NULL) {
+        return -1;
+    }
+    f->n_globs += 1;
+    return 0;
+}
+
+// Free the lists held by the filter.
+void walk_filter_free(struct walk_filter *f)
+{
+    for (int ii = 0; ii < f->n_exts; ii++) {
+        free(f->exts[ii]);
+    }
+    for (int ii = 0; ii < f->n_globs; ii++) {
+        free(f->globs[ii]);
+    }
+    free(f->exts);
+    free(f->globs);
+    memset(f, 0, sizeof(*f));
+}
+
+// Return 1 if the file name (or path) passes the filter.
+int walk_match(const struct walk_filter *f, const char *name)
+{
+    const char *base, *ext;
+    int ok;
+
+    if (f == NULL) {
+        return 1;
+    }
+    base = strrchr(name, '/');
+    base = (base == NULL) ? name : base + 1;
+
+    if (f->n_exts > 0) {
+        ext = strrchr(base, '.');
+        if (ext == NULL) {
+            return 0;
+        }
+        ok = 0;
+        for (int ii = 0; (ii < f->n_exts) && !ok; ii++) {
+            ok = (strcasecmp(ext + 1, f->exts[ii]) == 0);
+        }
+        if (!ok) {
+            return 0;
+        }
+    }
+    if (f->n_globs > 0) {
+        ok = 0;
+        for (int ii = 0; (ii < f->n_globs) && !ok; ii++) {
+            ok = (fnmatch(f->globs[ii], base, 0) == 0);
+        }
+        if (!ok) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Push a directory onto the bottom of a deque.  Takes ownership of dir.
+// Return 0 if successful, or -1 if out of memory.
+static int deque_push(struct deque *d, char *dir)
+{
+    char **items;
+    int ret = 0;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom == d->cap) {
+        if (d->top > 0) {
+            // reuse the space left by steals
+            memmove(d->items, d->items + d->top,
+                    (d->bottom - d->top) * sizeof(char*));
+            d->bottom -= d->top;
+            d->top = 0;
+        }
+        else {
+            items = (char**)realloc(d->items,
+                                    (d->cap ? 2 * d->cap : 64)
+                                    * sizeof(char*));
+            if (items == NULL) {
+                ret = -1;
+            }
+            else {
+                d->items = items;
+                d->cap = d->cap ? 2 * d->cap : 64;
+            }
+        }
+    }
+    if (ret == 0) {
+        d->items[d->bottom++] = dir;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return ret;
+}
+
+// Pop a directory from the bottom (steal = 0) or top (steal = 1) of a
+// deque.  Return NULL if it is empty.
+static char *deque_take(struct deque *d, int steal)
+{
+    char *dir = NULL;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->top < d->bottom) {
+        dir = steal ? d->items[d->top++] : d->items[--d->bottom];
+        if (d->top == d->bottom) {
+            d->top = 0;
+            d->bottom = 0;
+        }
+    }
+    pthread_mutex_unlock(&d->lock);
+    return dir;
+}
+
+// Count a queued directory as finished, waking the idle threads to exit if
+// it was the last.
+static void dir_done(struct walker *w)
+{
+    if (atomic_fetch_sub(&w->pending, 1) == 1) {
+        pthread_mutex_lock(&w->idle_lock);
+        pthread_cond_broadcast(&w->work);
+        pthread_mutex_unlock(&w->idle_lock);
+    }
+}
+
+// Queue a directory for thread id to read, waking an idle thread to take
+// it.  Takes ownership of dir.
+static void queue_dir(struct walker *w, int id, char *dir)
+{
+    atomic_fetch_add(&w->pending, 1);
+    if (deque_push(&w->deques[id], dir)) {
+        fprintf(stderr, "%s: %s: %s\n", w->opts->prog, dir,
+                strerror(ENOMEM));
+        free(dir);
+        atomic_fetch_add(&w->errors, 1);
+        dir_done(w);
+        return;
+    }
+    atomic_fetch_add(&w->pushed, 1);
+    if (atomic_load(&w->idle) > 0) {
+        pthread_mutex_lock(&w->idle_lock);
+        pthread_cond_signal(&w->work);
+        pthread_mutex_unlock(&w->idle_lock);
+    }
+}
+
+// Set t->path to dir/name.  Return 0 if successful, or -1 if out of memory.
+static int set_path(struct walk_thread *t, const char *dir, size_t dir_len,
+                    const char *name)
+{
+    size_t len = dir_len + 1 + strlen(name) + 1;
+    char *path;
+
+    if (len > t->path_cap) {
+        path = (char*)realloc(t->path, 2 * len);
+        if (path == NULL) {
+            return -1;
+        }
+        t->path = path;
+        t->path_cap = 2 * len;
+    }
+    memcpy(t->path, dir, dir_len);
+    t->path[dir_len] = '/';
+    strcpy(t->path + dir_len + 1, name);
+    return 0;
+}
+
+// Read one directory, queueing its subdirectories and handing matching
+// files to the callback.
+static void read_dir(struct walk_thread *t, const char *dir)
+{
+    struct walker *w = t->w;
+    const struct walk_opts *opts = w->opts;
+    struct linux_dirent64 *ent;
+    struct stat st;
+    unsigned long long skipped = 0;
+    long long min_size = (opts->filter != NULL) ? opts->filter->min_size : 0;
+    size_t dir_len;
+    long n_read;
+    int fd, type, have_st;
+
+    fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s: %s\n", opts->prog, dir, strerror(errno));
+        atomic_fetch_add(&w->errors, 1);
+        return;
+    }
+    dir_len = strlen(dir);
+    while ((dir_len > 1) && (dir[dir_len - 1] == '/')) {
+        dir_len -= 1;
+    }
+
+    while ((n_read = syscall(SYS_getdents64, fd, t->dents, DENTS_SIZE)) > 0) {
+        for (long pos = 0; pos < n_read; pos += ent->d_reclen) {
+            ent = (struct linux_dirent64*)(t->dents + pos);
+            if ((strcmp(ent->d_name, ".") == 0)
+                || (strcmp(ent->d_name, "..") == 0)) {
+                continue;
+            }
+            type = ent->d_type;
+            if ((type == TYPE_LNK)
+                && !walk_match(opts->filter, ent->d_name)) {
+                // only links to files are followed
+                continue;
+            }
+            have_st = 0;
+            if ((type == TYPE_UNKNOWN) || (type == TYPE_LNK)) {
+                if (fstatat(fd, ent->d_name, &st,
+                            (type == TYPE_LNK) ? 0 : AT_SYMLINK_NOFOLLOW)) {
+                    continue;
+                }
+                have_st = 1;
+                type = S_ISDIR(st.st_mode) ? TYPE_DIR
+                     : S_ISREG(st.st_mode) ? TYPE_REG : TYPE_UNKNOWN;
+                if ((type == TYPE_DIR) && (ent->d_type == TYPE_LNK)) {
+                    continue;
+                }
+            }
+
+            if (type == TYPE_REG) {
+                if (!walk_match(opts->filter, ent->d_name)) {
+                    skipped += 1;
+                    continue;
+                }
+                if ((min_size > 0)
+                    && ((!have_st
+                         && fstatat(fd, ent->d_name, &st,
+                                    AT_SYMLINK_NOFOLLOW))
+                        || (st.st_size < min_size))) {
+                    // too small to be worth opening, or gone already
+                    skipped += 1;
+                    continue;
+                }
+            }
+            else if (type != TYPE_DIR) {
+                continue;
+            }
+            if (set_path(t, dir, dir_len, ent->d_name)) {
+                fprintf(stderr, "%s: %s: %s\n", opts->prog, dir,
+                        strerror(ENOMEM));
+                atomic_fetch_add(&w->errors, 1);
+                break;
+            }
+            if (type == TYPE_DIR) {
+                char *sub = strdup(t->path);
+                if (sub != NULL) {
+                    queue_dir(w, t->id, sub);
+                }
+            }
+            else {
+                opts->file(opts->file_arg, t->path);
+            }
+        }
+    }
+    if (skipped > 0) {
+        atomic_fetch_add(&w->skipped, skipped);
+    }
+    if (n_read < 0) {
+        fprintf(stderr, "%s: %s: %s\n", opts->prog, dir, strerror(errno));
+        atomic_fetch_add(&w->errors, 1);
+    }
+    close(fd);
+}
+
+// Walker thread, reads directories from its own deque or steals them from
+// others until no directory is queued or being read anywhere.
+static void *walk_thread(void *arg)
+{
+    struct walk_thread *t = (struct walk_thread*)arg;
+    struct walker *w = t->w;
+    unsigned long long seen;
+    char *dir;
+
+    for (;;) {
+        seen = atomic_load(&w->pushed);
+        dir = deque_take(&w->deques[t->id], 0);
+        for (int ii = 1; (dir == NULL) && (ii < w->n_threads); ii++) {
+            dir = deque_take(&w->deques[(t->id + ii) % w->n_threads], 1);
+        }
+        if (dir == NULL) {
+            // others are still reading, and may find more directories;
+            // one queued since the deques were looked at shows in pushed,
+            // so no wake up is missed
+            pthread_mutex_lock(&w->idle_lock);
+            atomic_fetch_add(&w->idle, 1);
+            while ((atomic_load(&w->pending) > 0)
+                   && (atomic_load(&w->pushed) == seen)) {
+                pthread_cond_wait(&w->work, &w->idle_lock);
+            }
+            atomic_fetch_sub(&w->idle, 1);
+            pthread_mutex_unlock(&w->idle_lock);
+            if (atomic_load(&w->pending) == 0) {
+                break;
+            }
+            continue;
+        }
+        read_dir(t, dir);
+        free(dir);
+        dir_done(w);
+    }
+    return NULL;
+}
+
+// Walk the tree under each root, calling opts->file for every regular file
+// passing the filter.
+// Return the number of directories that could not be read.
+unsigned long long walk_trees(char **roots, int n_roots,
+                              const struct walk_opts *opts)
+{
+    struct walker w;
+    struct walk_thread *threads;
+    pthread_t *tids;
+    int n_threads = opts->threads;
+    char *dir;
+
+    if (n_threads < 1) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = (cpus < 1) ? 1 : (cpus > MAX_THREADS) ? MAX_THREADS
+                  : (int)cpus;
+    }
+
+    memset(&w, 0, sizeof(w));
+    w.opts = opts;
+    w.n_threads = n_threads;
+    atomic_init(&w.pending, 0);
+    atomic_init(&w.pushed, 0);
+    atomic_init(&w.idle, 0);
+    atomic_init(&w.errors, 0);
+    atomic_init(&w.skipped, 0);
+    pthread_mutex_init(&w.idle_lock, NULL);
+    pthread_cond_init(&w.work, NULL);
+    w.deques = (struct deque*)aligned_alloc(64, n_threads
+                                                * sizeof(struct deque));
+    threads = (struct walk_thread*)calloc(n_threads,
+                                          sizeof(struct walk_thread));
+    tids = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+    if ((w.deques == NULL) || (threads == NULL) || (tids == NULL)) {
+        fprintf(stderr, "%s: %s\n", opts->prog, strerror(ENOMEM));
+        free(tids);
+        free(threads);
+        free(w.deques);
+        pthread_cond_destroy(&w.work);
+        pthread_mutex_destroy(&w.idle_lock);
+        return n_roots;
+    }
+    memset(w.deques, 0, n_threads * sizeof(struct deque));
+    for (int ii = 0; ii < n_threads; ii++) {
+        pthread_mutex_init(&w.deques[ii].lock, NULL);
+    }
+
+    // spread the roots out, threads steal the rest as they go
+    for (int ii = 0; ii < n_roots; ii++) {
+        dir = strdup(roots[ii]);
+        if (dir != NULL) {
+            queue_dir(&w, ii % n_threads, dir);
+        }
+    }
+
+    int n_started = 0;
+    for (int ii = 0; ii < n_threads; ii++) {
+        threads[ii].w = &w;
+        threads[ii].id = ii;
+        threads[ii].dents = (char*)malloc(DENTS_SIZE);
+        if (threads[ii].dents == NULL) {
+            continue;
+        }
+        if (pthread_create(&tids[ii], NULL, walk_thread, &threads[ii])) {
+            free(threads[ii].dents);
+            threads[ii].dents = NULL;
+            continue;
+        }
+        n_started += 1;
+    }
+    if (n_started == 0) {
+        // no threads to be had, walk here instead
+        threads[0].dents = (char*)malloc(DENTS_SIZE);
+        if (threads[0].dents != NULL) {
+            walk_thread(&threads[0]);
+        }
+    }
+
+    // every thread is done with every deque before any goes
+    for (int ii = 0; ii < n_threads; ii++) {
+        if ((threads[ii].dents != NULL) && (n_started > 0)) {
+            pthread_join(tids[ii], NULL);
+        }
+    }
+    for (int ii = 0; ii < n_threads; ii++) {
+        free(threads[ii].dents);
+        free(threads[ii].path);
+        pthread_mutex_destroy(&w.deques[ii].lock);
+        free(w.deques[ii].items);
+    }
+    free(tids);
+    free(threads);
+    free(w.deques);
+    pthread_cond_destroy(&w.work);
+    pthread_mutex_destroy(&w.idle_lock);
+    if (opts->skipped != NULL) {
+        *opts->skipped = atomic_load(&w.skipped);
+    }
+    return atomic_load(&w.errors);
+}
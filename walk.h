@@ -0,0 +1,57 @@
+/* walk
+   Walks directory trees in parallel for the mp4len command.
+
+   Nicholas A. Masluk
+   nick@randombytes.net
+   Copyright 2023
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef WALK_H
+#define WALK_H
+
+// Which files are worth opening.  A name must have one of the extensions,
+// if any are given, and match one of the globs, if any are given.  A file
+// found walking a tree must also be at least min_size bytes.
+struct walk_filter {
+    char **exts; // without the dot, compared ignoring case
+    int n_exts;
+    char **globs; // fnmatch(3) patterns for the base name
+    int n_globs;
+    long long min_size; // 0 to take any size without a stat(2)
+};
+
+// Called for each matching file, from any of the walker threads at once.
+typedef void (*walk_file_fn)(void *arg, const char *path);
+
+struct walk_opts {
+    const char *prog; // for error messages
+    int threads; // walker threads, 0 for default
+    const struct walk_filter *filter;
+    walk_file_fn file;
+    void *file_arg;
+    unsigned long long *skipped; // set to the files filtered out, or NULL
+};
+
+// Add each extension in a comma separated list to the filter.
+// Return 0 if successful, or -1 if out of memory.
+int walk_add_exts(struct walk_filter *f, const char *list);
+
+// Add a glob to the filter.
+// Return 0 if successful, or -1 if out of memory.
+int walk_add_glob(struct walk_filter *f, const char *glob);
+
+// Free the lists held by the filter.
+void walk_filter_free(struct walk_filter *f);
+
+// Return 1 if the file name (or path) passes the filter.
+int walk_match(const struct walk_filter *f, const char *name);
+
+// Walk the tree under each root, calling opts->file for every regular file
+// passing the filter.  Symbolic links to files are followed, links to
+// directories are not.
+// Return the number of directories that could not be read.
+unsigned long long walk_trees(char **roots, int n_roots,
+                              const struct walk_opts *opts);
+
+#endif
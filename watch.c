@@ -0,0 +1,438 @@
+/* watch
+   Keeps an index up to date with changes under directory trees, for the
+   mp4len command.
+
+   Every directory under the roots gets an inotify watch.  A file closed
+   after writing, moved in, moved out or deleted is queued on the batch
+   workers, which probe it, or find it gone, and its new record is appended
+   to the index's log, so the work done follows the changes rather than the
+   size of the library.  Once the log holds an eighth as many records as
+   the index (and at least COMPACT_MIN), it is merged into a new index.
+
+   A directory moved within the trees has each file under it recorded at
+   its new path and removed at the old one.  A directory moved out of the
+   trees stops being watched, but what was under it stays in the index
+   until it is built again, as the index keeps no paths to find it by.
+   If the kernel's event queue overflows, every file is probed again.
+
+   When watching starts, each file under the roots is compared with its
+   record in the index, and probed if it has none, or its size or
+   modification time differ, or it failed in a way that may not last, so
+   changes made since the index was built are not missed.  Files removed
+   meanwhile stay in the index, for the same reason as above.
+
+   Nicholas A. Masluk
+   nick@randombytes.net
+   Copyright 2023
+   Mozilla Public License Version 2.0
+*/
+
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "index.h"
+#include "watch.h"
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM \
+                      | IN_MOVED_TO)
+#define COMPACT_MIN 4096 // fewest log records worth merging
+#define COMPACT_SHARE 8 // merge once the log is this fraction of the index
+#define EVENT_BUF 65536
+
+struct watcher {
+    const char *prog;
+    const struct walk_filter *filter;
+    int ifd; // inotify
+    char **dirs; // path of each watched directory, by watch descriptor
+    int dirs_cap;
+    uint32_t moved_cookie; // directory moved away, not yet seen arriving
+    char *moved_path; // where it was, or NULL
+    struct batch *batch;
+    struct index_log log;
+    int log_failed; // an error writing the log has been reported
+    struct index *start; // while first adding the trees, to queue only
+                         // files changed since the index was made
+};
+
+// Return path/name in new memory, or NULL if out of memory.
+static char *path_join(const char *path, const char *name)
+{
+    char *joined;
+
+    joined = (char*)malloc(strlen(path) + strlen(name) + 2);
+    if (joined != NULL) {
+        sprintf(joined, "%s/%s", path, name);
+    }
+    return joined;
+}
+
+// Batch callback, append each file's record to the log, merging the log
+// into the index once it is large enough.
+static void emit_change(void *arg, const struct batch_job *job)
+{
+    struct watcher *w = (struct watcher*)arg;
+    struct index_log *log = &w->log;
+    int failed;
+
+    // a file that cannot be found has gone
+    failed = index_log_add(log, job->path, job->keyed ? &job->key : NULL,
+                           job->ret, &job->res);
+    if (!failed && (log->n_recs >= COMPACT_MIN)
+        && (log->n_recs >= log->n_base / COMPACT_SHARE)) {
+        failed = index_log_compact(log);
+    }
+    if (failed && !w->log_failed) {
+        fprintf(stderr, "%s: %s: %s\n", w->prog, log->file, strerror(errno));
+        w->log_failed = 1;
+    }
+    else if (!failed) {
+        w->log_failed = 0;
+    }
+}
+
+// Return 1 if the index has a lasting record of path as it is now.
+static int unchanged(const struct watcher *w, const char *path)
+{
+    const struct index_rec *rec;
+    struct mp4len_key key;
+
+    rec = index_find(w->start, index_hash(w->log.cwd, path));
+    return (rec != NULL) && (mp4len_key_path(path, &key) == 0)
+        && (rec->size == key.size) && (rec->mtime_ns == key.mtime_ns)
+        && (!(rec->flags & INDEX_FAILED)
+            || mp4len_error_lasting((int)rec->len_unit));
+}
+
+// Queue a file to probe, if the filter takes it, and while first adding
+// the trees, if it changed since the index was made.
+static void queue_file(struct watcher *w, const char *path)
+{
+    if (walk_match(w->filter, path)
+        && ((w->start == NULL) || !unchanged(w, path))
+        && batch_submit(w->batch, path, NULL)) {
+        fprintf(stderr, "%s: %s: %s\n", w->prog, path,
+                mp4len_strerror(MP4LEN_ERR_NOMEM));
+    }
+}
+
+// Note the path of watch descriptor wd.
+// Return 0 if successful, or -1 if out of memory.
+static int dir_set(struct watcher *w, int wd, const char *path)
+{
+    char **dirs, *copy;
+    int cap = w->dirs_cap;
+
+    while (wd >= cap) {
+        cap = cap ? 2 * cap : 64;
+    }
+    if (cap > w->dirs_cap) {
+        dirs = (char**)realloc(w->dirs, cap * sizeof(char*));
+        if (dirs == NULL) {
+            return -1;
+        }
+        memset(dirs + w->dirs_cap, 0, (cap - w->dirs_cap) * sizeof(char*));
+        w->dirs = dirs;
+        w->dirs_cap = cap;
+    }
+    copy = strdup(path);
+    if (copy == NULL) {
+        return -1;
+    }
+    free(w->dirs[wd]);
+    w->dirs[wd] = copy;
+    return 0;
+}
+
+// Watch the directory path and each one below it.  With submit set, queue
+// every file in them as well, since they may have been written before the
+// watch began, and if old is not NULL, queue each one's path under old,
+// where the tree was before it moved, to be found gone.
+static void add_tree(struct watcher *w, const char *path, int submit,
+                     const char *old)
+{
+    struct dirent *ent;
+    struct stat st;
+    char *sub, *old_sub = NULL;
+    DIR *dir;
+    int wd, is_dir;
+
+    wd = inotify_add_watch(w->ifd, path,
+                           WATCH_EVENTS | IN_ONLYDIR | IN_DONT_FOLLOW);
+    if (wd < 0) {
+        fprintf(stderr, "%s: %s: %s\n", w->prog, path, strerror(errno));
+        return;
+    }
+    if (dir_set(w, wd, path)) {
+        fprintf(stderr, "%s: %s: %s\n", w->prog, path,
+                mp4len_strerror(MP4LEN_ERR_NOMEM));
+        return;
+    }
+    dir = opendir(path);
+    if (dir == NULL) {
+        return;
+    }
+    while ((ent = readdir(dir)) != NULL) {
+        if ((strcmp(ent->d_name, ".") == 0)
+            || (strcmp(ent->d_name, "..") == 0)) {
+            continue;
+        }
+        sub = path_join(path, ent->d_name);
+        old_sub = (old != NULL) ? path_join(old, ent->d_name) : NULL;
+        if ((sub == NULL) || ((old != NULL) && (old_sub == NULL))) {
+            free(old_sub);
+            free(sub);
+            continue;
+        }
+        // links to directories are not followed, as when walking
+        is_dir = (ent->d_type == DT_DIR);
+        if (ent->d_type == DT_UNKNOWN) {
+            is_dir = (lstat(sub, &st) == 0) && S_ISDIR(st.st_mode);
+        }
+        if (is_dir) {
+            add_tree(w, sub, submit, old_sub);
+        }
+        else if (submit) {
+            if (old_sub != NULL) {
+                queue_file(w, old_sub);
+            }
+            queue_file(w, sub);
+        }
+        free(old_sub);
+        free(sub);
+    }
+    closedir(dir);
+}
+
+// Stop watching the directory path and every one below it.
+static void drop_tree(struct watcher *w, const char *path)
+{
+    size_t len = strlen(path);
+
+    for (int wd = 0; wd < w->dirs_cap; wd++) {
+        if ((w->dirs[wd] != NULL) && (strncmp(w->dirs[wd], path, len) == 0)
+            && ((w->dirs[wd][len] == '\0') || (w->dirs[wd][len] == '/'))) {
+            // its path is freed when IN_IGNORED comes
+            inotify_rm_watch(w->ifd, wd);
+        }
+    }
+}
+
+// Deal with a directory moved away that did not turn up elsewhere in the
+// trees.
+static void moved_out(struct watcher *w)
+{
+    if (w->moved_path != NULL) {
+        drop_tree(w, w->moved_path);
+        free(w->moved_path);
+        w->moved_path = NULL;
+    }
+}
+
+// Act on one event.
+static void handle_event(struct watcher *w, const struct inotify_event *ev,
+                         char **roots, int n_roots)
+{
+    struct stat st;
+    char *path;
+
+    if (ev->mask & IN_Q_OVERFLOW) {
+        fprintf(stderr, "%s: events lost, probing every file again\n",
+                w->prog);
+        moved_out(w);
+        for (int ii = 0; ii < n_roots; ii++) {
+            add_tree(w, roots[ii], 1, NULL);
+        }
+        return;
+    }
+    if ((ev->wd < 0) || (ev->wd >= w->dirs_cap)
+        || (w->dirs[ev->wd] == NULL)) {
+        return;
+    }
+    if (ev->mask & IN_IGNORED) {
+        // the directory is gone or no longer watched
+        free(w->dirs[ev->wd]);
+        w->dirs[ev->wd] = NULL;
+        return;
+    }
+    if (ev->len == 0) {
+        return;
+    }
+    path = path_join(w->dirs[ev->wd], ev->name);
+    if (path == NULL) {
+        fprintf(stderr, "%s: %s\n", w->prog,
+                mp4len_strerror(MP4LEN_ERR_NOMEM));
+        return;
+    }
+
+    if ((ev->mask & IN_MOVED_TO) && (ev->mask & IN_ISDIR)
+        && (w->moved_path != NULL) && (ev->cookie == w->moved_cookie)) {
+        // moved within the trees
+        add_tree(w, path, 1, w->moved_path);
+        free(w->moved_path);
+        w->moved_path = NULL;
+        free(path);
+        return;
+    }
+    moved_out(w);
+    if ((ev->mask & IN_MOVED_FROM) && (ev->mask & IN_ISDIR)) {
+        // wait for the matching IN_MOVED_TO, normally the next event
+        w->moved_cookie = ev->cookie;
+        w->moved_path = path;
+        return;
+    }
+    if (ev->mask & IN_ISDIR) {
+        if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+            add_tree(w, path, 1, NULL);
+        }
+    }
+    else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM
+                         | IN_DELETE)) {
+        queue_file(w, path);
+    }
+    else if ((ev->mask & IN_CREATE) && (lstat(path, &st) == 0)
+             && (S_ISLNK(st.st_mode) || (st.st_nlink > 1))) {
+        // a link is never written, a new file waits until it has been
+        queue_file(w, path);
+    }
+    free(path);
+}
+
+// Open the index, creating an empty one if there is none, note its size
+// for the log and keep it open in w->start.
+// Return 0 if successful, or -1 with errno set.
+static int index_ready(struct watcher *w, const char *file)
+{
+    struct index_build ib;
+    struct index *idx;
+    int ret;
+
+    idx = index_open(file);
+    if ((idx == NULL) && (errno == ENOENT)) {
+        if (index_build_init(&ib)) {
+            errno = ENOMEM;
+            return -1;
+        }
+        ret = index_build_write(&ib, file);
+        index_build_free(&ib);
+        if (ret) {
+            return -1;
+        }
+        idx = index_open(file);
+    }
+    if (idx == NULL) {
+        return -1;
+    }
+    w->log.n_base = index_size(idx);
+    w->start = idx;
+    return 0;
+}
+
+// Watch the trees and keep the index up to date until SIGINT or SIGTERM.
+// Return 0 if successful, or MP4LEN_ERR_OPEN or MP4LEN_ERR_NOMEM.
+int watch_index(const struct watch_opts *opts, char **roots, int n_roots)
+{
+    // aligned for the events read into it
+    char buf[EVENT_BUF] __attribute__((aligned(8)));
+    const struct inotify_event *ev;
+    struct batch_opts bopt = {0};
+    struct watcher w = {0};
+    struct pollfd fds[2];
+    sigset_t sigs;
+    ssize_t len;
+    int sfd, ret = 0;
+
+    w.prog = opts->prog;
+    w.filter = opts->filter;
+    w.log.fd = -1;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    // before any worker starts, so they all keep the signals blocked
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+    sfd = signalfd(-1, &sigs, SFD_CLOEXEC);
+    w.ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if ((sfd < 0) || (w.ifd < 0)) {
+        fprintf(stderr, "%s: %s\n", w.prog, strerror(errno));
+        ret = MP4LEN_ERR_OPEN;
+        goto out;
+    }
+    if (index_log_open(&w.log, opts->index_file)
+        || index_ready(&w, opts->index_file)) {
+        fprintf(stderr, "%s: %s: %s\n", w.prog, opts->index_file,
+                strerror(errno));
+        ret = MP4LEN_ERR_OPEN;
+        goto out;
+    }
+
+    bopt.jobs = opts->jobs;
+    // results for the same path are logged in the order of its events
+    bopt.order = BATCH_ORDER_INPUT;
+    bopt.cache = opts->cache;
+    bopt.keys = 1;
+    bopt.emit = emit_change;
+    bopt.emit_arg = &w;
+    w.batch = batch_start(&bopt);
+    if (w.batch == NULL) {
+        fprintf(stderr, "%s: %s\n", w.prog, mp4len_strerror(MP4LEN_ERR_NOMEM));
+        ret = MP4LEN_ERR_NOMEM;
+        goto out;
+    }
+    for (int ii = 0; ii < n_roots; ii++) {
+        add_tree(&w, roots[ii], 1, NULL);
+    }
+    index_close(w.start);
+    w.start = NULL;
+
+    fds[0].fd = w.ifd;
+    fds[0].events = POLLIN;
+    fds[1].fd = sfd;
+    fds[1].events = POLLIN;
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "%s: %s\n", w.prog, strerror(errno));
+            break;
+        }
+        if (fds[1].revents) {
+            break;
+        }
+        while ((len = read(w.ifd, buf, sizeof(buf))) > 0) {
+            for (char *ptr = buf; ptr < buf + len;
+                 ptr += sizeof(struct inotify_event) + ev->len) {
+                ev = (const struct inotify_event*)ptr;
+                handle_event(&w, ev, roots, n_roots);
+            }
+        }
+    }
+    batch_finish(w.batch, NULL);
+
+out:
+    index_close(w.start);
+    free(w.moved_path);
+    for (int wd = 0; wd < w.dirs_cap; wd++) {
+        free(w.dirs[wd]);
+    }
+    free(w.dirs);
+    index_log_close(&w.log);
+    if (w.ifd >= 0) {
+        close(w.ifd);
+    }
+    if (sfd >= 0) {
+        close(sfd);
+    }
+    return ret;
+}
@@ -0,0 +1,35 @@
+/* watch
+   Keeps an index up to date with changes under directory trees, for the
+   mp4len command.
+
+   Nicholas A. Masluk
+   nick@randombytes.net
+   Copyright 2023
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include "mp4len.h"
+#include "walk.h"
+
+struct watch_opts {
+    const char *prog; // for error messages
+    const char *index_file; // index to keep up to date
+    const struct walk_filter *filter; // which files are indexed
+    int jobs; // worker threads
+    mp4len_cache *cache; // results to look files up in first, or NULL
+};
+
+// Watch every directory under each root until SIGINT or SIGTERM.  Each
+// file written, moved or removed there is probed again, or found gone, and
+// its record appended to the index's log, which is merged into the index
+// whenever it grows past an eighth of it.  Files added or changed since
+// the index was made are probed when watching starts.  An index that does
+// not exist yet is started empty, and every file probed into it.
+// Return 0 if successful, or MP4LEN_ERR_OPEN or MP4LEN_ERR_NOMEM if
+// watching could not be started.
+int watch_index(const struct watch_opts *opts, char **roots, int n_roots);
+
+#endif